@@ -0,0 +1,402 @@
+/*
+ *      halloc_test.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Fragmentation simulator and benchmark for the slot allocator.
+ *
+ *	Runs alloc/free sequences against nbd-freecache.c with no cache
+ *	behind it and reports, every so many operations, how fast it's going
+ *	and what the free space looks like; free slots, number of extents,
+ *	the largest extent, the fragmentation index (1 - largest / free) and
+ *	a histogram of extent sizes. Same seed, same sequence, so two
+ *	versions of the allocator can be compared run for run.
+ *
+ *	Workloads;
+ *
+ *	random	- objects of random size, a random live object is freed
+ *	fifo	- as random but the oldest object is freed (cache expiry)
+ *	stream	- a number of writers each growing an object a few slots at
+ *			  a time, interleaved, oldest freed first
+ *	trace	- read from a file (-t), a line per operation;
+ *			  "a <id> <slots>" allocates, "f <id>" frees
+ *
+ *	The synthetic workloads keep the allocator around the fill level (-f),
+ *	allocating below it and freeing above it.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "nbd.h"
+
+#define TEST_STREAMS	8			// writers in the stream workload
+#define TEST_COLUMNS	8			// histogram columns, 2 log2 buckets each
+
+typedef struct test_piece {
+
+	uint32_t	slot;
+	int			count;
+
+} test_piece;
+
+typedef struct test_object {
+
+	uint32_t	size;				// slots wanted
+	uint32_t	have;				// slots got
+	int			pieces;
+	int			room;
+	test_piece*	piece;
+
+} test_object;
+
+test_object*	test_objects;		// indexed by id
+uint32_t		test_nobjects;
+uint32_t*		test_ring;			// live ids, oldest first
+uint32_t		test_head,test_tail,test_size;
+
+uint32_t		test_slots		= 1024*1024;
+uint64_t		test_ops		= 10000000;
+uint64_t		test_report		= 1000000;
+int				test_fill		= 90;
+int				test_max		= 256;
+char*			test_workload	= "random";
+char*			test_trace		= NULL;
+
+struct {
+
+	uint64_t	allocs;				// calls to hallocAllocate
+	uint64_t	frees;				// calls to hallocFree
+	uint64_t	objects;
+	uint64_t	pieces;
+	uint64_t	nsecs;				// inside the allocator
+	uint64_t	failed;				// objects that didn't fit
+
+} test_stats,test_last;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	testNow		- monotonic clock in nsecs
+//	testObject	- the object for "id", growing the table as needed
+//	testAlloc	- allocate "count" more slots to object "id"
+//	testFree	- give all of object "id" back
+//
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t testNow()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+test_object* testObject(uint32_t id)
+{
+	uint32_t n = test_nobjects;
+
+	if( id >= n ) {
+		while( id >= n ) n = n ? n*2 : 65536;
+		test_objects = (test_object*)realloc(test_objects,n*sizeof(test_object));
+		memset(&test_objects[test_nobjects],0,(n-test_nobjects)*sizeof(test_object));
+		test_nobjects = n;
+	}
+	return &test_objects[id];
+}
+
+int testAlloc(uint32_t id,uint32_t count)
+{
+	test_object	*o = testObject(id);
+	uint32_t	slot;
+	int			got;
+	uint64_t	t0;
+
+	while( count ) {
+		got = count;
+		t0 = testNow();
+		hallocAllocate(&slot,&got);
+		test_stats.nsecs += testNow()-t0;
+		test_stats.allocs++;
+		if( !got ) return False;
+		if( o->pieces && (o->piece[o->pieces-1].slot+o->piece[o->pieces-1].count == slot) ) {
+			o->piece[o->pieces-1].count += got;		// carried on where it left off
+		} else {
+			if( o->pieces == o->room ) {
+				o->room = o->room ? o->room*2 : 4;
+				o->piece = (test_piece*)realloc(o->piece,o->room*sizeof(test_piece));
+			}
+			o->piece[o->pieces].slot = slot;
+			o->piece[o->pieces].count = got;
+			o->pieces++;
+			test_stats.pieces++;
+		}
+		o->have += got;
+		count -= got;
+	}
+	return True;
+}
+
+void testFree(uint32_t id)
+{
+	test_object	*o = testObject(id);
+	uint64_t	t0 = testNow();
+	int			i,j;
+
+	for(i=0;i<o->pieces;i++)
+		for(j=0;j<o->piece[i].count;j++) hallocFree(o->piece[i].slot+j,id);
+	test_stats.nsecs += testNow()-t0;
+	test_stats.frees += o->have;
+	o->pieces = 0;
+	o->have = 0;
+	o->size = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	testPush	- add a live id to the ring
+//	testPop		- take the oldest (or a random) live id off the ring
+//	testSize	- a random object size, mostly small, the odd big one
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void testPush(uint32_t id)
+{
+	if( test_tail-test_head == test_size ) {
+		uint32_t	n = test_size ? test_size*2 : 65536;
+		uint32_t*	ring = (uint32_t*)malloc(n*sizeof(uint32_t));
+		uint32_t	i;
+
+		for(i=test_head;i<test_tail;i++) ring[i-test_head] = test_ring[i%test_size];
+		free(test_ring);
+		test_ring = ring;
+		test_tail -= test_head;
+		test_head = 0;
+		test_size = n;
+	}
+	test_ring[test_tail++%test_size] = id;
+}
+
+uint32_t testPop(int oldest)
+{
+	uint32_t i,id;
+
+	if( !oldest ) {
+		i = (test_head+random()%(test_tail-test_head))%test_size;
+		id = test_ring[i];
+		test_ring[i] = test_ring[test_head%test_size];
+		test_ring[test_head%test_size] = id;
+	}
+	return test_ring[test_head++%test_size];
+}
+
+uint32_t testSize()
+{
+	uint32_t size = 1+random()%test_max;
+
+	if( random()%4 ) size = 1+size/16;
+	return size;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	testHeader	- column titles for testReport
+//	testReport	- a line of throughput and free space shape
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void testHeader()
+{
+	char	title[16];
+	int		i;
+
+	printf("%10s %8s %6s %10s %8s %9s %6s %6s |","Ops","Mops/s","Used%","Free","Extents","Largest","Frag","Pieces");
+	for(i=0;i<TEST_COLUMNS;i++) {
+		if( i == TEST_COLUMNS-1 ) sprintf(title,"%d+",1<<(i*2));
+		else sprintf(title,"%d",1<<(i*2));
+		printf(" %7s",title);
+	}
+	printf("\n");
+}
+
+void testReport(uint64_t ops)
+{
+	uint64_t	hist[HALLOC_BUCKETS],cols[TEST_COLUMNS],largest,extents,free = hallocAvailable();
+	uint64_t	nsecs = test_stats.nsecs-test_last.nsecs;
+	uint64_t	calls = test_stats.allocs+test_stats.frees-test_last.allocs-test_last.frees;
+	uint64_t	objects = test_stats.objects-test_last.objects;
+	int			i;
+
+	extents = hallocExtents(hist,HALLOC_BUCKETS,&largest);
+	memset(cols,0,sizeof(cols));
+	for(i=0;i<HALLOC_BUCKETS;i++) cols[i/2 < TEST_COLUMNS ? i/2 : TEST_COLUMNS-1] += hist[i];
+	printf("%10lld %8.2f %6.2f %10lld %8lld %9lld %6.3f %6.2f |",(unsigned long long)ops,
+		   nsecs ? (double)calls*1000.0/nsecs : 0.0,100.0*(test_slots-free)/test_slots,
+		   (unsigned long long)free,(unsigned long long)extents,(unsigned long long)largest,
+		   free ? 1.0-(double)largest/free : 0.0,
+		   objects ? (double)(test_stats.pieces-test_last.pieces)/objects : 0.0);
+	for(i=0;i<TEST_COLUMNS;i++) printf(" %7lld",(unsigned long long)cols[i]);
+	printf("\n");
+	test_last = test_stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	testSynthetic	- random, fifo and stream workloads
+//	testTrace		- replay a trace file
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void testSynthetic()
+{
+	uint32_t	stream[TEST_STREAMS],next = 0,id,want;
+	uint64_t	op,target = (uint64_t)test_slots*test_fill/100;
+	int			oldest = strcmp(test_workload,"random") != 0;
+	int			streams = !strcmp(test_workload,"stream");
+	int			s;
+	test_object	*o;
+
+	for(s=0;s<TEST_STREAMS;s++) {
+		stream[s] = next++;
+		testObject(stream[s])->size = testSize();
+	}
+	for(op=1;op<=test_ops;op++) {
+		if( (test_slots-hallocAvailable() > target) && (test_tail > test_head) ) {
+			testFree(testPop(oldest));
+		} else if( streams ) {
+			s = random()%TEST_STREAMS;
+			o = testObject(stream[s]);
+			want = 1+random()%4;
+			if( want > o->size-o->have ) want = o->size-o->have;
+			if( !testAlloc(stream[s],want) ) test_stats.failed++;
+			if( o->have == o->size || !want ) {
+				testPush(stream[s]);
+				test_stats.objects++;
+				stream[s] = next++;
+				testObject(stream[s])->size = testSize();
+			}
+		} else {
+			id = next++;
+			testObject(id)->size = testSize();
+			if( !testAlloc(id,testObject(id)->size) ) test_stats.failed++;
+			testPush(id);
+			test_stats.objects++;
+		}
+		if( !(op%test_report) ) testReport(op);
+	}
+}
+
+int testTrace()
+{
+	FILE*		fp = fopen(test_trace,"r");
+	char		line[256],op;
+	uint32_t	id,size;
+	uint64_t	ops = 0;
+
+	if(!fp) {
+		printf("Unable to open trace file '%s'\n",test_trace);
+		return False;
+	}
+	while( fgets(line,sizeof(line),fp) && (ops < test_ops) ) {
+		if( sscanf(line," %c %u %u",&op,&id,&size) < 2 ) continue;
+		switch(op) {
+			case 'a':
+				if( testObject(id)->have ) testFree(id);
+				testObject(id)->size = size;
+				if( !testAlloc(id,size) ) test_stats.failed++;
+				test_stats.objects++;
+				break;
+			case 'f':
+				testFree(id);
+				break;
+			default:
+				continue;
+		}
+		if( !(++ops%test_report) ) testReport(ops);
+	}
+	if( ops%test_report ) testReport(ops);
+	fclose(fp);
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	main	- parse options, run the workload, summarise
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void usage()
+{
+	printf("usage: halloc_test [-s slots] [-n ops] [-r report every] [-f fill %%] [-m max object slots]\n");
+	printf("                   [-w random|fifo|stream] [-t trace file] [-S seed]\n");
+	exit(1);
+}
+
+int main(int argc,char **argv)
+{
+	int			c,seed = 1;
+	uint64_t	t0;
+	void*		table;
+
+	while ((c = getopt (argc, argv, "s:n:r:f:m:w:t:S:")) != -1)
+	{
+		switch(c) {
+			case 's':
+				test_slots = atol(optarg);
+				break;
+			case 'n':
+				test_ops = atoll(optarg);
+				break;
+			case 'r':
+				test_report = atoll(optarg);
+				break;
+			case 'f':
+				test_fill = atoi(optarg);
+				break;
+			case 'm':
+				test_max = atoi(optarg);
+				break;
+			case 'w':
+				test_workload = optarg;
+				break;
+			case 't':
+				test_trace = optarg;
+				test_workload = "trace";
+				break;
+			case 'S':
+				seed = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if( !test_slots || !test_report || (test_fill < 1) || (test_fill > 99) || (test_max < 1) ) usage();
+	if( strcmp(test_workload,"random") && strcmp(test_workload,"fifo") && strcmp(test_workload,"stream") && !test_trace ) usage();
+
+	openlog("halloc_test",LOG_PERROR,LOG_USER);
+	srandom(seed);
+	table = calloc(test_slots,sizeof(cache_entry));	// an empty slot table, all free
+	hallocLoad(table,test_slots);
+	free(table);
+	printf("Workload %s, %ld slots, %lld ops, fill %d%%, objects up to %d slots, seed %d\n",test_workload,
+		   (unsigned long)test_slots,(unsigned long long)test_ops,test_fill,test_max,seed);
+	testHeader();
+
+	t0 = testNow();
+	if( test_trace ) {
+		if( !testTrace() ) exit(1);
+	} else testSynthetic();
+	t0 = testNow()-t0;
+
+	printf("Objects %lld, %.2f pieces each, %lld didn't fit, %lld allocs, %lld frees, %.2fs (%.2fs in the allocator)\n",
+		   (unsigned long long)test_stats.objects,
+		   test_stats.objects ? (double)test_stats.pieces/test_stats.objects : 0.0,
+		   (unsigned long long)test_stats.failed,(unsigned long long)test_stats.allocs,
+		   (unsigned long long)test_stats.frees,(double)t0/1e9,(double)test_stats.nsecs/1e9);
+	hallocStats();
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ *      nbd-admit.c
+ *      (c) Gareth Bult 2012
+ *
+ *	TinyLFU admission filter for cache inserts.
+ *
+ *	A count-min sketch (4 rows of 4-bit counters) estimates how often each
+ *	block has been touched recently, with a doorkeeper bloom filter in front
+ *	of it so one-hit wonders never reach the sketch. Every 10 x width
+ *	samples the counters are halved and the doorkeeper cleared, so old
+ *	history fades. A block is admitted once it has been seen at least
+ *	"admit_threshold" times and, when the cache is full, only if it's
+ *	more popular than the block it would push out. Memory is fixed at
+ *	admitInit() time.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include "nbd.h"
+
+#define ADMIT_ROWS	4
+#define ADMIT_MAX	(1<<22)		// widest sketch we'll allocate (8M of RAM)
+
+int admit_threshold = 2;		// zero admits everything
+
+struct {
+
+	uint64_t*	sketch;			// ADMIT_ROWS x width nibbles
+	uint64_t*	door;			// doorkeeper, width bits
+	uint32_t	width;
+	uint32_t	mask;
+	uint64_t	samples;
+
+} admit;
+
+struct {
+
+	uint64_t	records;
+	uint64_t	admitted;
+	uint64_t	rejected;		// not seen often enough
+	uint64_t	lost;			// less popular than the victim
+	uint64_t	resets;
+
+} admit_stats;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	admitInit	- size the sketch for a cache of "entries" blocks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int admitInit(uint64_t entries)
+{
+	uint32_t width = 64;
+
+	while( (width < entries) && (width < ADMIT_MAX) ) width <<= 1;
+	memset(&admit,0,sizeof(admit));
+	memset(&admit_stats,0,sizeof(admit_stats));
+	admit.width		= width;
+	admit.mask		= width-1;
+	admit.sketch	= (uint64_t*)calloc(ADMIT_ROWS*width/16,sizeof(uint64_t));
+	admit.door		= (uint64_t*)calloc(width/64,sizeof(uint64_t));
+	if( !admit.sketch || !admit.door ) {
+		syslog(LOG_ALERT,"Unable to allocate admission sketch (%ld)",(unsigned long)width);
+		return False;
+	}
+	syslog(LOG_INFO,"Admission filter, threshold %d, width %ld (%ldK)",admit_threshold,
+		   (unsigned long)width,(unsigned long)((ADMIT_ROWS*width/2+width/8)/1024));
+	return True;
+}
+
+void admitClose()
+{
+	free(admit.sketch);
+	free(admit.door);
+	admit.sketch = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	Sketch primitives
+//
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t admitHash(uint64_t block)
+{
+	block ^= block >> 33;
+	block *= 0xff51afd7ed558ccdULL;
+	block ^= block >> 33;
+	block *= 0xc4ceb9fe1a85ec53ULL;
+	block ^= block >> 33;
+	return block;
+}
+
+uint32_t admitIndex(uint64_t h,int row)
+{
+	return ((uint32_t)h + row*(uint32_t)(h>>32)) & admit.mask;
+}
+
+int admitCounter(uint32_t row,uint32_t i)
+{
+	uint64_t n = (uint64_t)row*admit.width+i;
+	return (admit.sketch[n>>4] >> ((n&15)*4)) & 15;
+}
+
+void admitIncrement(uint32_t row,uint32_t i)
+{
+	uint64_t n = (uint64_t)row*admit.width+i;
+	admit.sketch[n>>4] += 1ULL << ((n&15)*4);
+}
+
+int admitDoor(uint64_t h,int set)
+{
+	uint32_t	a = (uint32_t)(h>>7) & admit.mask;
+	uint32_t	b = (uint32_t)(h>>39) & admit.mask;
+	int			seen = (admit.door[a>>6] >> (a&63) & 1) && (admit.door[b>>6] >> (b&63) & 1);
+
+	if(set) {
+		admit.door[a>>6] |= 1ULL << (a&63);
+		admit.door[b>>6] |= 1ULL << (b&63);
+	}
+	return seen;
+}
+
+void admitReset()
+{
+	uint64_t i;
+
+	for(i=0;i<ADMIT_ROWS*admit.width/16;i++) admit.sketch[i] = (admit.sketch[i] >> 1) & 0x7777777777777777ULL;
+	memset(admit.door,0,admit.width/8);
+	admit.samples /= 2;
+	admit_stats.resets++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	admitEstimate	- how often has this block been seen lately
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int admitEstimate(uint64_t block)
+{
+	uint64_t	h = admitHash(block);
+	int			row,c,min = 15;
+
+	if(!admit.sketch) return 0;
+	for(row=0;row<ADMIT_ROWS;row++) {
+		c = admitCounter(row,admitIndex(h,row));
+		if(c < min) min = c;
+	}
+	return min+admitDoor(h,False);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	admitRecord	- count an access (conservative update of the sketch)
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void admitRecord(uint64_t block)
+{
+	uint64_t	h = admitHash(block);
+	int			row,c[ADMIT_ROWS],min = 15;
+
+	if(!admit.sketch) return;
+	admit_stats.records++;
+	if(!admitDoor(h,True)) return;
+	for(row=0;row<ADMIT_ROWS;row++) {
+		c[row] = admitCounter(row,admitIndex(h,row));
+		if(c[row] < min) min = c[row];
+	}
+	if( min < 15 )
+		for(row=0;row<ADMIT_ROWS;row++)
+			if(c[row] == min) admitIncrement(row,admitIndex(h,row));
+	if( ++admit.samples >= 10ULL*admit.width ) admitReset();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	admitCheck	- record an access and decide whether to cache the block
+//
+//	"victim" is the block we'd have to evict to make room, or NULL if
+//	there is free space.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int admitCheck(uint64_t block,uint64_t* victim)
+{
+	int freq;
+
+	admitRecord(block);
+	if(!admit_threshold || !admit.sketch) {
+		admit_stats.admitted++;
+		return True;
+	}
+	freq = admitEstimate(block);
+	if( freq < admit_threshold ) {
+		admit_stats.rejected++;
+		return False;
+	}
+	if( victim && (freq <= admitEstimate(*victim)) ) {
+		admit_stats.lost++;
+		return False;
+	}
+	admit_stats.admitted++;
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	admitStats	- log admission counters
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void admitStats()
+{
+	uint64_t total = admit_stats.admitted+admit_stats.rejected+admit_stats.lost;
+
+	syslog(LOG_INFO,"ADMIT STATS");
+	syslog(LOG_INFO,"Threshold %d, width %ld, samples %lld, resets %lld, accesses %lld",
+		   admit_threshold,(unsigned long)admit.width,(unsigned long long)admit.samples,
+		   (unsigned long long)admit_stats.resets,(unsigned long long)admit_stats.records);
+	syslog(LOG_INFO,"Admitted %lld (%.2f%%), rejected %lld (cold), %lld (lost to victim)",
+		   (unsigned long long)admit_stats.admitted,
+		   total ? 100.0*admit_stats.admitted/total : 0.0,
+		   (unsigned long long)admit_stats.rejected,(unsigned long long)admit_stats.lost);
+}
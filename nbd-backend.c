@@ -0,0 +1,1175 @@
+/*
+ *      nbd-backend.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Client side of the link to the backend nbd-server hosts.
+ *
+ *	Each host gets a small pool of persistent connections, opened when the
+ *	client gives us an export name. Requests are tagged with a per-host
+ *	handle and pipelined, many to a socket; a receiver thread per socket
+ *	matches replies back to their request by handle and wakes whoever is
+ *	waiting. If a connection drops everything pending on it fails and the
+ *	receiver keeps trying to reconnect until it gets back in.
+ *
+ *	The volume is laid out over the hosts as raid1 (every host a mirror),
+ *	raid0 (striped) or raid10 (striped over sets of mirrors), see
+ *	backendLayout. Requests are cut at stripe unit boundaries and each
+ *	piece goes to the mirrors of its stripe, all in parallel.
+ *
+ *	backendSubmit / backendWait are the async pair, backendRequest does
+ *	both. Reads go to the mirror with the lowest latency x queue depth, and
+ *	big ones are split across all the mirrors at once. A read that's taking
+ *	longer than its host's hedge_pct percentile is sent to a second mirror
+ *	as well, and whichever answers first wins. Writes go to every mirror
+ *	at once and return when backend_quorum of them have acked; the rest
+ *	carry on in the background and the caller is told which hosts were
+ *	left behind so it can keep those blocks dirty for them. Any write that
+ *	fails on a host is noted in its resync map (nbd-resync.c).
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include "nbd.h"
+
+backend_host	backends[MAX_HOSTS];
+int				backend_count = 0;
+int				backend_conns = 2;		// connections per host
+int				backend_quorum = QUORUM_ALL;
+int				backend_layout = LAYOUT_RAID1;
+int				backend_copies = 2;		// mirrors per stripe for raid10
+int				stripe_unit = 64;		// KB
+int				backend_mirrors = 1;	// worked out from the above by backendLayout
+int				backend_stripes = 1;
+char*			backend_layout_names[] = { "raid1" , "raid0" , "raid10" , "ec" };
+int				backend_split = 256;	// KB, reads this big are spread over every host (0=off)
+int				hedge_pct = 95;			// hedge reads slower than this percentile (0=off)
+int				hedge_budget = 5;		// most hedges, as a % of reads
+char*			backend_quorum_names[] = { "all" , "majority" , "first" };
+
+struct {
+
+	uint64_t		writes;
+	uint64_t		failed;			// quorum not reached
+	uint64_t		lagged;			// hosts left behind, failed or still going
+	uint64_t		bytes,usecs;	// volume bytes written and time taken
+	latency_hist	hist[MAX_HOSTS+1];	// quorum latency by number of replicas
+
+} write_stats;
+
+struct {
+
+	uint64_t		reads;
+	uint64_t		split;			// reads spread across hosts
+	uint64_t		retries;		// pieces re-read from another host
+	uint64_t		striped;		// reads spanning stripe units
+	uint64_t		hedged;			// second host asked
+	uint64_t		hedge_wins;		// and it answered first
+	uint64_t		denied;			// out of budget
+	double			tokens;
+	latency_hist	hist;			// whole read, hedging included
+
+} read_stats;
+
+pthread_mutex_t	hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	latRecord		- add a sample (usecs) to a latency histogram
+//	latPercentile	- pct'th percentile, to within 1/8th
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void latRecord(latency_hist* h,uint64_t usecs)
+{
+	int msb,b;
+
+	if( usecs < 8 ) b = usecs;
+	else {
+		msb = 63-__builtin_clzll(usecs);
+		b = (msb-2)*8+((usecs>>(msb-3))&7);
+	}
+	h->bucket[b]++;
+	h->count++;
+}
+
+uint64_t latPercentile(latency_hist* h,double pct)
+{
+	uint64_t	want = h->count*pct/100+0.999,seen = 0;
+	int			b;
+
+	if(!h->count) return 0;
+	for(b=0;b<LAT_BUCKETS;b++) {
+		seen += h->bucket[b];
+		if( seen >= want ) break;
+	}
+	if( b < 8 ) return b;
+	return ((8ULL+(b&7)+1)<<((b>>3)-1))-1;		// top of the bucket
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	doConnect	- open a TCP connection to a backend host
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int doConnect(char* host)
+{
+    struct addrinfo hints;
+    struct addrinfo *ai = NULL;
+    int s;
+    int size = 1;
+
+    memset(&hints,'\0',sizeof(hints));
+    hints.ai_family     = AF_UNSPEC;
+    hints.ai_socktype   = SOCK_STREAM;
+    hints.ai_flags      = AI_ADDRCONFIG | AI_NUMERICSERV;
+    hints.ai_protocol   = IPPROTO_TCP;
+
+    if( getaddrinfo(host, NBD_SERVER_PORT, &hints, &ai) != 0) {
+        syslog(LOG_ERR,"%s :: Unable to resolve hostname, errno=%d",host,errno);
+        return -1;
+    }
+    s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(s<0) {
+        syslog(LOG_ERR,"%s :: Unable to allocate socket (%d)",host,errno);
+        freeaddrinfo(ai);
+        return -1;
+    }
+    if(connect(s, ai->ai_addr, ai->ai_addrlen) < 0) {
+        syslog(LOG_ERR,"%s :: Unable to connect to server, err=%d",host,errno);
+        freeaddrinfo(ai);
+        close(s);
+        return -1;
+    }
+    if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &size, sizeof(int)) < 0) {
+        syslog(LOG_ERR,"%s :: Error setting options, errno=%d",host,errno);
+    }
+    freeaddrinfo(ai);
+    return s;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	negotiate	- new style handshake with nbd-server for export "name"
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void negotiate(int sock, uint64_t *rsize64, uint32_t *flags, char* name, uint32_t needed_flags, uint32_t client_flags, uint32_t do_opts)
+{
+    uint64_t magic, size64;
+    uint16_t tmp;
+    char buf[256] = "\0\0\0\0\0\0\0\0\0";
+    uint32_t opt;
+    uint32_t namesize;
+
+    syslog(LOG_INFO,"Client negotiation");
+    if (read(sock, buf, 8) < 0) {
+        syslog(LOG_ERR,"Failed to read PASSWD, err=%d",errno);
+        return;
+    }
+    if (strlen(buf)==0) {
+        syslog(LOG_ERR,"Zero length PASSWD, err=%d",errno);
+        return;
+    }
+    if (strcmp(buf, INIT_PASSWD)) {
+        syslog(LOG_ERR,"Bad PASSWD, err=%d",errno);
+        return;
+    }
+    if (read(sock, &magic, sizeof(magic)) < 0) {
+        syslog(LOG_ERR,"Error reading MAGIC, err=%d",errno);
+        return;
+    }
+    magic = ntohll(magic);
+    if (magic != OPTS_MAGIC) {
+        syslog(LOG_ERR,"Bad MAGIC, err=%d",errno);
+        return;
+    }
+    if(read(sock, &tmp, sizeof(uint16_t)) < 0) {
+        syslog(LOG_ERR,"Error reading flags, err=%d",errno);
+        return;
+    }
+    *flags = ((uint32_t)ntohs(tmp));
+    client_flags = htonl(client_flags);
+    if (write(sock, &client_flags, sizeof(client_flags)) < 0) {
+        syslog(LOG_ERR,"Error returning client flags, err=%d",errno);
+        return;
+    }
+    magic = htonll(OPTS_MAGIC);
+    if (write(sock, &magic, sizeof(magic)) < 0) {
+        syslog(LOG_ERR,"Error writing MAGIC, err=%d",errno);
+        return;
+    }
+    opt = ntohl(NBD_OPT_EXPORT_NAME);
+    if (write(sock, &opt, sizeof(opt)) < 0) {
+        syslog(LOG_ERR,"Error writing command, err=%d",errno);
+        return;
+    }
+    namesize = (uint32_t)strlen(name);
+    namesize = ntohl(namesize);
+    if (write(sock, &namesize, sizeof(namesize)) < 0) {
+        syslog(LOG_ERR,"Error writing share name, err=%d",errno);
+        return;
+    }
+    if (write(sock, name, strlen(name)) < 0) {
+        syslog(LOG_ERR,"Error writing share name length, err=%d",errno);
+        return;
+    }
+    syslog(LOG_ALERT,"SENT NAME=%s",name);
+    if (read(sock, &size64, sizeof(size64)) < 0) {
+        syslog(LOG_ERR,"Error reading size, err=%d",errno);
+        return;
+    }
+    size64 = ntohll(size64);
+    syslog(LOG_INFO,"Share name is %s, size is %luMB",name,(unsigned long)(size64>>20));
+    if(read(sock, &tmp, sizeof(tmp)) < 0) {
+        syslog(LOG_ERR,"Error reading flags, err=%d",errno);
+        return;
+    }
+    *flags |= (uint32_t)ntohs(tmp);
+    if (read(sock, &buf, 124) < 0) {
+        syslog(LOG_ERR,"Error reading zeros, err=%d",errno);
+        return;
+    }
+    *rsize64 = size64;
+}
+
+int doSetup(char* host,char* name,uint64_t *size64)
+{
+    uint32_t flags;
+    uint32_t needed_flags=0;
+    uint32_t cflags=0;
+    uint32_t opts=0;
+    int s;
+    //
+    s = doConnect(host);
+    if(s == -1) return -1;
+    *size64 = 0;
+    negotiate(s, size64, &flags, name, needed_flags, cflags, opts);
+    if(!*size64) {		// negotiate has logged why
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendIO	- move all of "len" bytes, or fail
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int backendIO(int sock,int out,void* p,size_t len)
+{
+	ssize_t n;
+
+	while( len ) {
+		n = out ? send(sock,p,len,MSG_NOSIGNAL) : read(sock,p,len);
+		if( n <= 0 ) {
+			if( (n < 0) && (errno == EINTR) ) continue;
+			return False;
+		}
+		p += n;
+		len -= n;
+	}
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendSignal	- count an ack (or failure) for a group of writes
+//	backendComplete	- a request has finished, wake whoever's waiting
+//	backendDrop		- a connection has failed, fail everything pending on it
+//	backendConnect	- (re)connect one connection of the pool
+//
+//	backendComplete and backendDrop are called with the host lock held.
+//	backendDrop only shuts the socket down, it's closed by the receiver
+//	(under wlock) when it reconnects so a sender can never end up writing
+//	to a recycled descriptor.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void backendSignal(backend_group* g,backend_req* r,int ok)
+{
+	if(!g) return;
+	pthread_mutex_lock(&g->lock);
+	if(ok && !g->acks++) g->first = r;
+	if(!ok) g->fails++;
+	pthread_cond_signal(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+}
+
+void backendComplete(backend_conn* c,backend_req* r,int ok)
+{
+	backend_host	*b = c->host;
+	struct timeval	now;
+	uint64_t		usecs;
+
+	gettimeofday(&now,NULL);
+	usecs = (now.tv_sec-r->start.tv_sec)*1000000ULL+now.tv_usec-r->start.tv_usec;
+	c->inflight--;
+	b->inflight--;
+	b->usecs += usecs;
+	if( ok ) b->ewma += ((double)usecs-b->ewma)/8;
+	if( ok && !r->background ) govSample(b-backends+1,usecs);
+	if( !ok ) {
+		b->failed++;
+		if( r->cmd == NBD_WRITE ) resyncMark(b-backends,r->off,r->len);
+	} else if( r->cmd == NBD_READ ) {
+		b->reads++;
+		b->rbytes += r->len;
+		latRecord(&b->rhist,usecs);
+	} else {
+		b->writes++;
+		b->wbytes += r->len;
+		latRecord(&b->whist,usecs);
+	}
+	pthread_cond_broadcast(&b->cond);
+	if( r->detached ) {
+		if(ok) b->async_done++;
+		else b->async_failed++;
+		free(r);
+		return;
+	}
+	r->done = True;
+	r->ok = ok;
+	backendSignal(r->group,r,ok);
+}
+
+void backendDrop(backend_conn* c)
+{
+	backend_host	*b = c->host;
+	backend_req		*r;
+
+	if(!c->up) return;
+	c->up = False;
+	shutdown(c->sock,SHUT_RDWR);
+	while( (r = c->pending) ) {
+		c->pending = r->next;
+		backendComplete(c,r,False);
+	}
+	if(b->running) syslog(LOG_ALERT,"%s :: Connection lost",b->name);
+}
+
+int backendConnect(backend_conn* c,uint64_t* size)
+{
+	backend_host	*b = c->host;
+	int				sock = doSetup(b->name,b->export,size);
+
+	if( sock == -1 ) return False;
+	pthread_mutex_lock(&c->wlock);
+	if( c->sock != -1 ) close(c->sock);
+	c->sock = sock;
+	pthread_mutex_unlock(&c->wlock);
+	pthread_mutex_lock(&b->lock);
+	c->up = True;
+	pthread_mutex_unlock(&b->lock);
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendReceiver	- one per connection, matches replies to requests
+//
+//	While the connection is down it retries with a backoff of up to 30s.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void* backendReceiver(void* arg)
+{
+	backend_conn		*c = (backend_conn*)arg;
+	backend_host		*b = c->host;
+	backend_req			*r,**rp;
+	struct nbd_reply	reply;
+	char				*dst,*junk = NULL;
+	uint64_t			size;
+	int					ok,broken,wait = 1,i;
+
+	while( b->running ) {
+		if( !c->up ) {
+			for(i=0;(i<wait) && b->running;i++) sleep(1);
+			if( !b->running ) break;
+			if( !backendConnect(c,&size) ) {
+				wait = wait < 15 ? wait*2 : 30;
+				continue;
+			}
+			wait = 1;
+			pthread_mutex_lock(&b->lock);
+			b->reconnects++;
+			pthread_mutex_unlock(&b->lock);
+			syslog(LOG_INFO,"%s :: Reconnected",b->name);
+			continue;
+		}
+		ok = backendIO(c->sock,False,&reply,sizeof(reply)) && (ntohl(reply.magic) == NBD_REPLY_MAGIC);
+		pthread_mutex_lock(&b->lock);
+		r = NULL;
+		if( ok ) {
+			for(rp=&c->pending;*rp && memcmp(reply.handle,&(*rp)->handle,sizeof(reply.handle));rp=&(*rp)->next);
+			if( (r = *rp) ) {
+				*rp = r->next;
+				r->busy = True;
+				dst = r->detached ? NULL : r->buf;
+			} else syslog(LOG_ALERT,"%s :: Reply for unknown handle",b->name);
+		} else if( c->up && b->running ) syslog(LOG_ALERT,"%s :: Bad reply from backend, err=%d",b->name,errno);
+		if( !r ) {
+			backendDrop(c);
+			pthread_mutex_unlock(&b->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		broken = False;
+		if( (ok = !reply.error) && (r->cmd == NBD_READ) ) {
+			if( !dst ) dst = junk = (char*)malloc(r->len);		// nobody wants it any more
+			if( !backendIO(c->sock,False,dst,r->len) ) ok = False,broken = True;
+			free(junk);
+			junk = NULL;
+		} else if( !ok ) syslog(LOG_ERR,"%s :: Backend error %d on %s",b->name,ntohl(reply.error),r->cmd==NBD_READ?"READ":"WRITE");
+
+		pthread_mutex_lock(&b->lock);
+		backendComplete(c,r,ok);
+		if( broken ) backendDrop(c);
+		pthread_mutex_unlock(&b->lock);
+	}
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendLayout		- work out stripes x mirrors for the hosts we have
+//	backendChunks		- cut a volume range at stripe unit boundaries
+//	backendSkip			- hosts that don't hold a given stripe column
+//	backendDirtyMask	- DIRTY bits for the hosts that hold a block
+//
+//	Hosts are grouped into columns of backend_mirrors copies; host h is
+//	mirror h%mirrors of column h/mirrors. Stripe unit u of the volume lives
+//	in column u%stripes at offset (u/stripes)*unit on each of its mirrors.
+//	With one column (raid1) offsets map straight through.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int backendLayout()
+{
+	switch(backend_layout) {
+		case LAYOUT_RAID0:	backend_mirrors = 1;				break;
+		case LAYOUT_RAID10:	backend_mirrors = backend_copies;	break;
+		case LAYOUT_EC:		backend_mirrors = 1;				break;
+		default:			backend_mirrors = backend_count;
+	}
+	if( (backend_layout == LAYOUT_EC) && ((ec_k >= backend_count) || !ecInit(ec_k,backend_count-ec_k)) ) {
+		syslog(LOG_ALERT,"Erasure coding %d data shards needs more than %d hosts",ec_k,backend_count);
+		return False;
+	}
+	if( (backend_mirrors < 1) || (backend_count % backend_mirrors) ) {
+		syslog(LOG_ALERT,"%d hosts won't divide into %s with %d copies",
+			   backend_count,backend_layout_names[backend_layout],backend_mirrors);
+		return False;
+	}
+	if( (stripe_unit < NCACHE_BSIZE/1024) || (stripe_unit % (NCACHE_BSIZE/1024)) ) {
+		syslog(LOG_ALERT,"Stripe unit must be a multiple of %dK",NCACHE_BSIZE/1024);
+		return False;
+	}
+	backend_stripes = backend_layout == LAYOUT_EC ? ec_k : backend_count/backend_mirrors;
+	syslog(LOG_INFO,"Layout %s, %d stripes x %d mirrors, stripe unit %dK",
+		   backend_layout_names[backend_layout],backend_stripes,backend_mirrors,stripe_unit);
+	return True;
+}
+
+int backendChunks(uint64_t off,uint32_t len,backend_chunk** chunks)
+{
+	backend_chunk	*c;
+	uint64_t		unit = stripe_unit*1024ULL,u;
+	uint32_t		size,boff = 0;
+	int				n = 0;
+
+	if( backend_stripes <= 1 ) {
+		c = *chunks = (backend_chunk*)malloc(sizeof(backend_chunk));
+		c->hoff	= off;
+		c->boff	= 0;
+		c->len	= len;
+		c->col	= 0;
+		return 1;
+	}
+	*chunks = (backend_chunk*)malloc((len/unit+2)*sizeof(backend_chunk));
+	while( len ) {
+		c = &(*chunks)[n++];
+		u = off/unit;
+		size = unit-off%unit < len ? unit-off%unit : len;
+		c->col	= u%backend_stripes;
+		c->hoff	= (u/backend_stripes)*unit+off%unit;
+		c->boff	= boff;
+		c->len	= size;
+		off += size;
+		boff += size;
+		len -= size;
+	}
+	return n;
+}
+
+uint32_t backendSkip(int col)
+{
+	uint32_t all = (1<<backend_count)-1;
+
+	return all & ~(((1<<backend_mirrors)-1) << (col*backend_mirrors));
+}
+
+uint8_t backendDirtyMask(uint64_t block)
+{
+	int col;
+
+	if( backend_layout == LAYOUT_EC ) return ecDirtyMask(block);
+	if( backend_stripes <= 1 ) return 0xFF;
+	col = (block*NCACHE_BSIZE/(stripe_unit*1024ULL))%backend_stripes;
+	return 1 | (((1<<backend_mirrors)-1) << (col*backend_mirrors+1));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendOpen	- connect the pool for every host for export "name"
+//	backendClose	- drop all the connections
+//
+//	Only the first connection to each host has to succeed up front, the
+//	receivers bring up the rest.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int backendOpen(char** hosts,char* name,uint64_t* size)
+{
+	backend_host	*b;
+	backend_conn	*c;
+	uint64_t		hsize,csize;
+	int				i;
+
+	backendClose();
+	if( backend_conns < 1 ) backend_conns = 1;
+	if( backend_conns > BACKEND_CONNS ) backend_conns = BACKEND_CONNS;
+	for(backend_count=0;hosts[backend_count] && (backend_count<MAX_HOSTS);backend_count++) {
+		b = &backends[backend_count];
+		memset(b,0,sizeof(backend_host));
+		b->name		= hosts[backend_count];
+		b->export	= strdup(name);
+		b->running	= True;
+		b->nconns	= backend_conns;
+		pthread_mutex_init(&b->lock,NULL);
+		pthread_cond_init(&b->cond,NULL);
+		for(i=0;i<b->nconns;i++) {
+			c = &b->conns[i];
+			c->host = b;
+			c->sock = -1;
+			pthread_mutex_init(&c->wlock,NULL);
+		}
+		hsize = 0;
+		for(i=0;i<b->nconns;i++) {
+			c = &b->conns[i];
+			if( !backendConnect(c,i ? &csize : &hsize) && !i ) {
+				syslog(LOG_ALERT,"Unable to connect to host [%s] (%d)",b->name,errno);
+				backend_count++;
+				backendClose();
+				return False;
+			}
+			if( pthread_create(&c->thread,NULL,backendReceiver,c) != 0 ) {
+				syslog(LOG_ALERT,"Error creating receiver for [%s], err=%d",b->name,errno);
+				backend_count++;
+				backendClose();
+				return False;
+			}
+		}
+		syslog(LOG_INFO,"%s :: Negotiated size=%lld, %d connections",b->name,
+			   (unsigned long long)hsize,b->nconns);
+		if( backend_count && (hsize != *size) )
+			syslog(LOG_ALERT,"%s :: Size mismatch, %lld vs %lld",b->name,
+				   (unsigned long long)hsize,(unsigned long long)*size);
+		if( !backend_count || (hsize < *size) ) *size = hsize;
+	}
+	if( !backendLayout() ) {
+		backendClose();
+		return False;
+	}
+	if( backend_stripes > 1 ) *size = (*size/(stripe_unit*1024ULL))*stripe_unit*1024ULL*backend_stripes;
+	return backend_count > 0;
+}
+
+void backendClose()
+{
+	struct nbd_request	request;
+	backend_host		*b;
+	backend_conn		*c;
+	int					i,n;
+
+	for(i=0;i<backend_count;i++) {
+		b = &backends[i];
+		b->running = False;
+		for(n=0;n<b->nconns;n++) {
+			c = &b->conns[n];
+			pthread_mutex_lock(&c->wlock);
+			if( c->up ) {
+				memset(&request,0,sizeof(request));
+				request.magic = htonl(NBD_REQUEST_MAGIC);
+				request.type  = htonl(NBD_CLOSE);
+				if( !backendIO(c->sock,True,&request,sizeof(request)) )
+					syslog(LOG_ERR,"%s :: Error sending CLOSE, err=%d",b->name,errno);
+			}
+			if( c->sock != -1 ) shutdown(c->sock,SHUT_RDWR);
+			pthread_mutex_unlock(&c->wlock);
+			if( c->thread ) pthread_join(c->thread,NULL);
+			if( c->sock != -1 ) close(c->sock);
+			c->sock = -1;
+			c->thread = 0;
+			pthread_mutex_destroy(&c->wlock);
+		}
+		free(b->export);
+		b->export = NULL;
+	}
+	backend_count = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendSettle	- wait out any write in flight to this host that overlaps
+//	backendSubmit	- queue a request on the least busy connection to a host
+//	backendWait		- wait for it to complete, frees the request
+//	backendRequest	- both of the above
+//
+//	The request is on the pending list before it's sent, so the reply can
+//	never beat it. If no connection is up it completes at once, failed.
+//	Writes settle first; requests on different connections can complete in
+//	any order, and a background write must not land on top of a newer one.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void backendSettle(backend_host* b,uint64_t off,uint32_t len)
+{
+	backend_req	*r;
+	int			i,busy;
+
+	do {
+		busy = False;
+		for(i=0;(i<b->nconns) && !busy;i++)
+			for(r=b->conns[i].pending;r && !busy;r=r->next)
+				if( (r->cmd == NBD_WRITE) && (r->off < off+len) && (off < r->off+r->len) ) busy = True;
+		if(busy) pthread_cond_wait(&b->cond,&b->lock);
+	} while( busy );
+}
+
+backend_req* backendSubmit(int host,uint32_t cmd,uint64_t off,char* buf,uint32_t len,backend_group* g)
+{
+	backend_host		*b = &backends[host];
+	backend_conn		*c = NULL;
+	backend_req			*r = (backend_req*)calloc(1,sizeof(backend_req));
+	struct nbd_request	request;
+	int					i,ok;
+
+	r->cmd	= cmd;
+	r->off	= off;
+	r->buf	= buf;
+	r->len	= len;
+	r->group = g;
+	r->background = govBackground();
+
+	pthread_mutex_lock(&b->lock);
+	if( cmd == NBD_WRITE ) {
+		resyncTouch(host,off,len);
+		backendSettle(b,off,len);
+	}
+	gettimeofday(&r->start,NULL);
+	for(i=0;i<b->nconns;i++)
+		if( b->conns[i].up && (!c || (b->conns[i].inflight < c->inflight)) ) c = &b->conns[i];
+	if( !c ) {
+		r->done = True;
+		b->failed++;
+		if( cmd == NBD_WRITE ) resyncMark(host,off,len);
+		pthread_mutex_unlock(&b->lock);
+		backendSignal(g,r,False);
+		return r;
+	}
+	r->handle = ++b->handle;
+	r->next = c->pending;
+	c->pending = r;
+	c->inflight++;
+	if( ++b->inflight > b->peak ) b->peak = b->inflight;
+	pthread_mutex_unlock(&b->lock);
+
+	request.magic	= htonl(NBD_REQUEST_MAGIC);
+	request.type	= htonl(cmd);
+	request.from	= htonll(off);
+	request.len		= htonl(len);
+	memcpy(request.handle,&r->handle,sizeof(request.handle));
+
+	pthread_mutex_lock(&c->wlock);
+	pthread_mutex_lock(&b->lock);
+	ok = !r->done;			// dropped before we got to send it
+	pthread_mutex_unlock(&b->lock);
+	if( ok ) ok = backendIO(c->sock,True,&request,sizeof(request)) &&
+				  ((cmd != NBD_WRITE) || backendIO(c->sock,True,buf,len));
+	pthread_mutex_unlock(&c->wlock);
+	if( !ok ) {
+		pthread_mutex_lock(&b->lock);
+		if( !r->done ) backendDrop(c);
+		pthread_mutex_unlock(&b->lock);
+	}
+	return r;
+}
+
+int backendWait(int host,backend_req* r)
+{
+	backend_host	*b = &backends[host];
+	int				ok;
+
+	pthread_mutex_lock(&b->lock);
+	while( !r->done ) pthread_cond_wait(&b->cond,&b->lock);
+	ok = r->ok;
+	pthread_mutex_unlock(&b->lock);
+	free(r);
+	return ok;
+}
+
+int backendRequest(int host,uint32_t cmd,uint64_t off,char* buf,uint32_t len)
+{
+	return backendWait(host,backendSubmit(host,cmd,off,buf,len,NULL));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendPick	- the best host to send a read to, -1 if none are up
+//
+//	Hosts are scored by their latency (EWMA of the last few requests)
+//	times the queue they'd be joining, so a slow or busy host gets less
+//	of the traffic without being starved of samples altogether.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int backendPick(uint32_t skip)
+{
+	backend_host	*b;
+	double			score,best = 0;
+	int				i,n,up,pick = -1;
+
+	for(i=0;i<backend_count;i++) {
+		if( skip & (1<<i) ) continue;
+		b = &backends[i];
+		pthread_mutex_lock(&b->lock);
+		for(n=up=0;n<b->nconns;n++) up |= b->conns[n].up;
+		score = (b->ewma+1)*(b->inflight+1);
+		pthread_mutex_unlock(&b->lock);
+		if( up && ((pick == -1) || (score < best)) ) {
+			pick = i;
+			best = score;
+		}
+	}
+	return pick;
+}
+
+//	backendUp - is any connection to a host up
+
+int backendUp(int host)
+{
+	backend_host	*b = &backends[host];
+	int				n,up;
+
+	pthread_mutex_lock(&b->lock);
+	for(n=up=0;n<b->nconns;n++) up |= b->conns[n].up;
+	pthread_mutex_unlock(&b->lock);
+	return up;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendReadFrom	- read from the best host, falling back to the rest
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int backendReadFrom(uint64_t off,char* buf,uint32_t len,uint32_t skip)
+{
+	int host;
+
+	while( (host = backendPick(skip)) != -1 ) {
+		if(backendRequest(host,NBD_READ,off,buf,len)) return True;
+		skip |= 1<<host;
+	}
+	return False;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendCancel	- give up on a read, the reply will be thrown away
+//	hedgeDelay		- how long to give a host before hedging, in usecs
+//	hedgeToken		- take a hedge from the budget, refilled per read
+//	hedgeSubmit		- send a read to the best host, note when to hedge it
+//	hedgeFinish		- wait for it, hedging to the next host if it's slow
+//	backendHedged	- read from the best host, hedge to the next if slow
+//
+//	NBD has no way to cancel a request, so the loser still runs to
+//	completion on its host; we just stop waiting for it. A reply that's
+//	already coming in is waited for, it can't be far off and it's reading
+//	into the caller's buffer. Hedging only starts once a host has enough
+//	samples to say what slow is. A striped read submits every stripe unit
+//	first and then finishes them in turn, so they all hedge on their own.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void backendCancel(int host,backend_req* r)
+{
+	backend_host *b = &backends[host];
+
+	pthread_mutex_lock(&b->lock);
+	while( r->busy && !r->done ) pthread_cond_wait(&b->cond,&b->lock);
+	r->group = NULL;
+	if( r->done ) free(r);
+	else r->detached = True;
+	pthread_mutex_unlock(&b->lock);
+}
+
+uint64_t hedgeDelay(int host)
+{
+	backend_host	*b = &backends[host];
+	uint64_t		usecs = 0;
+
+	if(!hedge_pct) return 0;
+	pthread_mutex_lock(&b->lock);
+	if( b->rhist.count >= 64 ) usecs = latPercentile(&b->rhist,hedge_pct);
+	pthread_mutex_unlock(&b->lock);
+	return usecs;
+}
+
+int hedgeToken()
+{
+	int ok;
+
+	pthread_mutex_lock(&hedge_lock);
+	if( (ok = read_stats.tokens >= 1) ) {
+		read_stats.tokens--;
+		read_stats.hedged++;
+	} else read_stats.denied++;
+	pthread_mutex_unlock(&hedge_lock);
+	return ok;
+}
+
+int hedgeSubmit(backend_hedge* hg,uint64_t off,char* buf,uint32_t len,uint32_t skip)
+{
+	struct timeval	now;
+	uint64_t		usecs = 0;
+
+	pthread_mutex_lock(&hedge_lock);
+	read_stats.tokens += hedge_budget/100.0;
+	if( read_stats.tokens > 10 ) read_stats.tokens = 10;
+	pthread_mutex_unlock(&hedge_lock);
+
+	memset(hg,0,sizeof(backend_hedge));
+	hg->skip = skip;
+	hg->other = -1;
+	if( (hg->host = backendPick(skip)) == -1 ) return False;
+	if( (usecs = hedgeDelay(hg->host)) ) hg->other = backendPick(skip|(1<<hg->host));
+
+	pthread_mutex_init(&hg->g.lock,NULL);
+	pthread_cond_init(&hg->g.cond,NULL);
+	hg->r = backendSubmit(hg->host,NBD_READ,off,buf,len,&hg->g);
+
+	gettimeofday(&now,NULL);
+	usecs += now.tv_usec;
+	hg->ts.tv_sec  = now.tv_sec+usecs/1000000;
+	hg->ts.tv_nsec = (usecs%1000000)*1000;
+	return True;
+}
+
+int hedgeFinish(backend_hedge* hg,uint64_t off,char* buf,uint32_t len)
+{
+	backend_group	*g = &hg->g;
+	char			*hbuf = NULL;
+	int				ok;
+
+	if( hg->host == -1 ) return False;
+	pthread_mutex_lock(&g->lock);
+	if( hg->other != -1 ) {
+		while( !g->acks && !g->fails && (pthread_cond_timedwait(&g->cond,&g->lock,&hg->ts) != ETIMEDOUT) );
+		if( !g->acks && !g->fails && hedgeToken() ) {
+			pthread_mutex_unlock(&g->lock);
+			hbuf = (char*)malloc(len);
+			hg->h = backendSubmit(hg->other,NBD_READ,off,hbuf,len,g);
+			pthread_mutex_lock(&g->lock);
+		}
+	}
+	while( !g->acks && (g->fails < (hg->h ? 2 : 1)) ) pthread_cond_wait(&g->cond,&g->lock);
+	pthread_mutex_unlock(&g->lock);
+
+	ok = g->acks > 0;
+	backendCancel(hg->host,hg->r);
+	if(hg->h) backendCancel(hg->other,hg->h);
+	if( hg->h && (g->first == hg->h) ) {
+		memcpy(buf,hbuf,len);
+		pthread_mutex_lock(&hedge_lock);
+		read_stats.hedge_wins++;
+		pthread_mutex_unlock(&hedge_lock);
+	}
+	free(hbuf);
+	pthread_mutex_destroy(&g->lock);
+	pthread_cond_destroy(&g->cond);
+	if( ok ) return True;
+	return backendReadFrom(off,buf,len,hg->skip|(1<<hg->host)|(hg->h ? 1<<hg->other : 0));
+}
+
+int backendHedged(uint64_t off,char* buf,uint32_t len,uint32_t skip)
+{
+	backend_hedge hg;
+
+	if(!hedgeSubmit(&hg,off,buf,len,skip)) return False;
+	return hedgeFinish(&hg,off,buf,len);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendSplit	- read a range in pieces from several mirrors at once
+//	backendMirror	- read a range that lives on one set of mirrors
+//	backendRead		- read a range of the volume
+//	backendWrite	- write a range to every mirror that holds it
+//
+//	Reads of backend_split KB or more are cut into one piece per live
+//	mirror, best first, and read in parallel. A piece that fails is retried
+//	on the other mirrors in turn. On a striped layout each stripe unit is
+//	read from its own mirror set, all at once, and hedged on its own; they
+//	aren't split any further, the stripe has already spread the read out.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int backendSplit(uint64_t off,char* buf,uint32_t len,int* host,int n,uint32_t skip)
+{
+	backend_req	*r[MAX_HOSTS];
+	uint32_t	piece,start,size;
+	int			i,ok = True;
+
+	piece = (len/n+NCACHE_BSIZE-1) & ~(NCACHE_BSIZE-1);
+	for(i=0;(i<n) && (i*piece<len);i++) {
+		start = i*piece;
+		size = len-start < piece ? len-start : piece;
+		r[i] = backendSubmit(host[i],NBD_READ,off+start,buf+start,size,NULL);
+	}
+	n = i;
+	for(i=0;i<n;i++) {
+		if(backendWait(host[i],r[i])) continue;
+		start = i*piece;
+		size = len-start < piece ? len-start : piece;
+		pthread_mutex_lock(&hedge_lock);
+		read_stats.retries++;
+		pthread_mutex_unlock(&hedge_lock);
+		if(!backendReadFrom(off+start,buf+start,size,skip|(1<<host[i]))) ok = False;
+	}
+	pthread_mutex_lock(&hedge_lock);
+	read_stats.split++;
+	pthread_mutex_unlock(&hedge_lock);
+	return ok;
+}
+
+int backendMirror(uint64_t off,char* buf,uint32_t len,uint32_t skip)
+{
+	int			host[MAX_HOSTS];
+	uint32_t	used = skip;
+	int			n = 0;
+
+	if( backend_split && (len >= backend_split*1024) )
+		while( (n < backend_count) && ((host[n] = backendPick(used)) != -1) ) used |= 1<<host[n++];
+	if( n < 2 ) return backendHedged(off,buf,len,skip);
+	return backendSplit(off,buf,len,host,n,skip);
+}
+
+int backendRead(uint64_t off,char* buf,uint32_t len)
+{
+	backend_chunk	*chunk;
+	backend_hedge	*hg;
+	struct timeval	t0,t1;
+	int				i,n,ok = True;
+
+	if( backend_layout == LAYOUT_EC ) return ecRead(off,buf,len);
+	gettimeofday(&t0,NULL);
+	n = backendChunks(off,len,&chunk);
+	if( n == 1 ) ok = backendMirror(chunk->hoff,buf,len,backendSkip(chunk->col));
+	else {
+		hg = (backend_hedge*)malloc(n*sizeof(backend_hedge));
+		for(i=0;i<n;i++) hedgeSubmit(&hg[i],chunk[i].hoff,buf+chunk[i].boff,chunk[i].len,backendSkip(chunk[i].col));
+		for(i=0;i<n;i++)
+			if(!hedgeFinish(&hg[i],chunk[i].hoff,buf+chunk[i].boff,chunk[i].len)) ok = False;
+		free(hg);
+	}
+	free(chunk);
+	gettimeofday(&t1,NULL);
+	pthread_mutex_lock(&hedge_lock);
+	read_stats.reads++;
+	if( n > 1 ) read_stats.striped++;
+	latRecord(&read_stats.hist,(t1.tv_sec-t0.tv_sec)*1000000ULL+t1.tv_usec-t0.tv_usec);
+	pthread_mutex_unlock(&hedge_lock);
+	return ok;
+}
+
+int backendWrite(uint64_t off,char* buf,uint32_t len,uint8_t* lag)
+{
+	backend_chunk	*chunk;
+	backend_req		**r;
+	backend_group	*g;
+	backend_host	*b;
+	struct timeval	start,end;
+	int				i,m,n,host,need,ok = True;
+
+	*lag = 0;
+	if(!backend_count) return False;
+	if( backend_layout == LAYOUT_EC ) {
+		gettimeofday(&start,NULL);
+		ok = ecWrite(off,buf,len);
+		gettimeofday(&end,NULL);
+		pthread_mutex_lock(&hedge_lock);
+		write_stats.writes++;
+		if(!ok) write_stats.failed++;
+		write_stats.bytes += len;
+		write_stats.usecs += (end.tv_sec-start.tv_sec)*1000000ULL+end.tv_usec-start.tv_usec;
+		pthread_mutex_unlock(&hedge_lock);
+		return ok;
+	}
+	switch(backend_quorum) {
+		case QUORUM_MAJORITY:	need = backend_mirrors/2+1;	break;
+		case QUORUM_FIRST:		need = 1;					break;
+		default:				need = backend_mirrors;
+	}
+	gettimeofday(&start,NULL);
+	n = backendChunks(off,len,&chunk);
+	g = (backend_group*)calloc(n,sizeof(backend_group));
+	r = (backend_req**)malloc(n*backend_mirrors*sizeof(backend_req*));
+	for(i=0;i<n;i++) {
+		pthread_mutex_init(&g[i].lock,NULL);
+		pthread_cond_init(&g[i].cond,NULL);
+		for(m=0;m<backend_mirrors;m++)
+			r[i*backend_mirrors+m] = backendSubmit(chunk[i].col*backend_mirrors+m,NBD_WRITE,
+												   chunk[i].hoff,buf+chunk[i].boff,chunk[i].len,&g[i]);
+	}
+	for(i=0;i<n;i++) {
+		pthread_mutex_lock(&g[i].lock);
+		while( (g[i].acks < need) && (backend_mirrors-g[i].fails >= need) ) pthread_cond_wait(&g[i].cond,&g[i].lock);
+		if( g[i].acks < need ) ok = False;
+		pthread_mutex_unlock(&g[i].lock);
+	}
+	gettimeofday(&end,NULL);
+	//
+	//	Anything not acked yet is left to finish on its own, the caller
+	//	keeps those hosts' dirty bits set until the destager catches up
+	//
+	for(i=0;i<n*backend_mirrors;i++) {
+		host = chunk[i/backend_mirrors].col*backend_mirrors+i%backend_mirrors;
+		b = &backends[host];
+		pthread_mutex_lock(&b->lock);
+		if( !r[i]->done ) {
+			r[i]->detached = True;
+			r[i]->group = NULL;
+			*lag |= 1<<(host+1);
+		} else {
+			if( !r[i]->ok ) *lag |= 1<<(host+1);
+			free(r[i]);
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+	for(i=0;i<n;i++) {
+		pthread_mutex_destroy(&g[i].lock);
+		pthread_cond_destroy(&g[i].cond);
+	}
+	free(g);
+	free(r);
+	free(chunk);
+
+	write_stats.writes++;
+	if(!ok) write_stats.failed++;
+	write_stats.bytes += len;
+	write_stats.usecs += (end.tv_sec-start.tv_sec)*1000000ULL+end.tv_usec-start.tv_usec;
+	for(i=1;i<=backend_count;i++) if(*lag & (1<<i)) write_stats.lagged++;
+	latRecord(&write_stats.hist[backend_mirrors],(end.tv_sec-start.tv_sec)*1000000ULL+end.tv_usec-start.tv_usec);
+	return ok;
+}
+
+//	backendWriteHost - write the parts of a range that live on one host
+
+int backendWriteHost(int host,uint64_t off,char* buf,uint32_t len)
+{
+	backend_chunk	*chunk;
+	int				i,n,ok = True;
+
+	if( backend_layout == LAYOUT_EC ) return ecWriteHost(host,off,buf,len);
+	n = backendChunks(off,len,&chunk);
+	for(i=0;i<n;i++)
+		if( (chunk[i].col == host/backend_mirrors) &&
+			!backendRequest(host,NBD_WRITE,chunk[i].hoff,buf+chunk[i].boff,chunk[i].len) ) ok = False;
+	free(chunk);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	backendStats	- log traffic per host
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void backendStats()
+{
+	backend_host	*b;
+	uint64_t		rtotal = 0,wtotal = 0;
+	int				i,n,up;
+
+	if(!backend_count) return;
+	syslog(LOG_INFO,"BACKEND STATS");
+	for(i=0;i<backend_count;i++) {
+		rtotal += backends[i].rbytes;
+		wtotal += backends[i].wbytes;
+	}
+	syslog(LOG_INFO,"Layout %s, %d stripes x %d mirrors, stripe unit %dK",
+		   backend_layout_names[backend_layout],backend_stripes,backend_mirrors,stripe_unit);
+	syslog(LOG_INFO,"Reads %lld, across stripes %lld, split %lld (at %dK), pieces retried %lld",
+		   (unsigned long long)read_stats.reads,(unsigned long long)read_stats.striped,
+		   (unsigned long long)read_stats.split,backend_split,(unsigned long long)read_stats.retries);
+	syslog(LOG_INFO,"Read p50 %lldus, p99 %lldus, p99.9 %lldus",
+		   (unsigned long long)latPercentile(&read_stats.hist,50),
+		   (unsigned long long)latPercentile(&read_stats.hist,99),
+		   (unsigned long long)latPercentile(&read_stats.hist,99.9));
+	syslog(LOG_INFO,"Hedging at p%d :: hedged %lld (%.2f%%), won %lld, out of budget (%d%%) %lld",
+		   hedge_pct,(unsigned long long)read_stats.hedged,
+		   read_stats.reads ? 100.0*read_stats.hedged/read_stats.reads : 0.0,
+		   (unsigned long long)read_stats.hedge_wins,hedge_budget,(unsigned long long)read_stats.denied);
+	for(i=0;i<backend_count;i++) {
+		b = &backends[i];
+		for(n=up=0;n<b->nconns;n++) up += b->conns[n].up;
+		syslog(LOG_INFO,"%-16s :: reads %lld (%lldMB), writes %lld (%lldMB), avg %lldus",b->name,
+			   (unsigned long long)b->reads,(unsigned long long)b->rbytes>>20,
+			   (unsigned long long)b->writes,(unsigned long long)b->wbytes>>20,
+			   (unsigned long long)(b->reads+b->writes ? b->usecs/(b->reads+b->writes) : 0));
+		syslog(LOG_INFO,"%-16s :: connections %d/%d up, in flight %ld (peak %ld), failed %lld, reconnects %lld",b->name,
+			   up,b->nconns,(unsigned long)b->inflight,(unsigned long)b->peak,
+			   (unsigned long long)b->failed,(unsigned long long)b->reconnects);
+		syslog(LOG_INFO,"%-16s :: read share %.1f%%, latency ewma %.0fus, read p50 %lldus, p99 %lldus",b->name,
+			   rtotal ? 100.0*b->rbytes/rtotal : 0.0,b->ewma,
+			   (unsigned long long)latPercentile(&b->rhist,50),(unsigned long long)latPercentile(&b->rhist,99));
+		syslog(LOG_INFO,"%-16s :: write p50 %lldus, p99 %lldus, background writes %lld, failed %lld",b->name,
+			   (unsigned long long)latPercentile(&b->whist,50),(unsigned long long)latPercentile(&b->whist,99),
+			   (unsigned long long)b->async_done,(unsigned long long)b->async_failed);
+	}
+	syslog(LOG_INFO,"Mirrored writes %lld, quorum %s, no quorum %lld, replicas left behind %lld",
+		   (unsigned long long)write_stats.writes,backend_quorum_names[backend_quorum],
+		   (unsigned long long)write_stats.failed,(unsigned long long)write_stats.lagged);
+	for(i=1;i<=MAX_HOSTS;i++) {
+		if(!write_stats.hist[i].count) continue;
+		syslog(LOG_INFO,"%d replicas :: writes %lld, p50 %lldus, p99 %lldus",i,
+			   (unsigned long long)write_stats.hist[i].count,
+			   (unsigned long long)latPercentile(&write_stats.hist[i],50),
+			   (unsigned long long)latPercentile(&write_stats.hist[i],99));
+	}
+	//
+	//	Host bytes over volume bytes, 2x for two way mirroring, (k+m)/k
+	//	for full EC rows and worse for small ones (parity and read back)
+	//
+	syslog(LOG_INFO,"Volume writes %lldMB at %.1fMB/s, host writes %lldMB, amplification %.2fx",
+		   (unsigned long long)write_stats.bytes>>20,
+		   write_stats.usecs ? (double)write_stats.bytes/write_stats.usecs : 0.0,
+		   (unsigned long long)wtotal>>20,write_stats.bytes ? (double)wtotal/write_stats.bytes : 0.0);
+	if( backend_layout == LAYOUT_EC ) ecStats();
+}
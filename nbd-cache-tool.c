@@ -21,13 +21,15 @@
 #include "nbd.h"
 
 char *hosts[] = {"127.0.0.1","127.0.0.1",NULL};
+extern int cache_paged;
+extern int cache_version;
 
 void main(int argc,char **argv)
 {
     int c,status;
 	void* data;
 	char *dev="/dev/cache/onegig";
-	char* options = "gxelfwrts:b:";
+	char* options = "gxelpfwrtMs:b:i:V:";
 	long block = -1;
 	int host=0;
 	char data_block[4096];
@@ -39,7 +41,7 @@ void main(int argc,char **argv)
 		printf("Error opening cache\n");
 		exit(1);
 	}
-	if(status) options="f";
+	if(status) options="pfV:";
 	
     while ((c = getopt (argc, argv, options)) != -1)
     {
@@ -59,6 +61,18 @@ void main(int argc,char **argv)
 				}
 				else printf("Specify which block first!\n");
 				break;
+			case 'p':
+				cache_paged = 1;
+				break;
+			case 'V':
+				cache_version = atoi(optarg);
+				break;
+			case 'M':
+				cacheClose(dev);
+				exit(cacheMigrate(dev) ? 0 : 1);
+			case 'i':
+				pindexBench(atoi(optarg));
+				break;
 			case 'f':
 				cacheFormat(hosts);
 				exit(0);
@@ -3,7 +3,15 @@
  *      (c) Gareth Bult 2012
  *
  *	Advances caching model for NBD client / RAID module.
- *	Impelemts LFU model using BDB / secondary index.
+ *	Clean blocks are evicted by ARC or 2Q (nbd-evict.c), and read misses
+ *	are only cached if they get past the TinyLFU filter (nbd-admit.c).
+ *	Optionally keeps the block index on the device (nbd-pindex.c).
+ *	Writes are handled write-back, write-through or write-around per export.
+ *	Optionally the slots are written as a log of segments (nbd-log.c).
+ *	Format v2 keeps the slot headers in their own region so the data slots
+ *	are 4K aligned and go O_DIRECT; cacheMigrate converts a v1 cache.
+ *	A reclaimer thread keeps a reserve of free slots so writes rarely have
+ *	to evict for themselves.
  *
  *  TODO :: Fix trim, it's not working
  *  TODO :: Fix to work with block size > 1024
@@ -19,7 +27,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sched.h>
 #include <limits.h>
 #include <linux/fs.h>
 #include <fcntl.h>
@@ -47,19 +58,44 @@ uint64_t	data_offset;	// start of actual data
 uint32_t*	freeq;			// freeq for free blocks
 uint32_t*	freeq_next;		// next free block
 uint8_t		DIRTY;			// bitmap for flushing to hosts
+uint64_t	cache_dirty;	// blocks waiting to be destaged
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;	// held by anyone touching the index
 
 int 		cache;			// cache file handle
 DB*			hash_used;		// hash table for used blocks
 DB*			hash_dirty;		// hash table for dirty blocks
-DB*			hash_index;		// index for hash_used (on "usecount")
 DBT 		key,val;		//
 
 uint64_t	cache_ptr;		// current SEEK pointer for cache
 uint64_t	cache_tmp;		// 
 
 cache_header header;
+int			cache_paged = 0;	// format with a paged on-device index
+int			cache_version = CACHE_VERSION;	// format new caches as
+int			cache_direct = -1;	// O_DIRECT handle on the data slots (v2)
+uint32_t	slot_size;			// bytes a slot takes on the device
+
+struct {
+
+	uint64_t	reads;					// slot reads
+	uint64_t	syscalls;				// reads issued for them
+	uint64_t	bounced;				// copied through an aligned buffer
+	uint64_t	meta_writes;			// v2 metadata updates
+
+} slot_stats;
+
+#define READ_SIZES	8					// request size classes, 4K << n
+
+struct {
+
+	uint64_t		requests;
+	uint64_t		blocks;
+	uint64_t		runs;				// runs of contiguous slots read for hits
+	uint64_t		syscalls;			// SSD reads issued for them
+	latency_hist	hist;				// whole request, usecs
+
+} read_sizes[READ_SIZES];
 
-int 		mirror;			// debug file
 
 	struct {
 		
@@ -78,6 +114,178 @@ typedef struct writeEntry {
 
 writeEntry *writeList = NULL;
 
+struct {
+
+	uint64_t	reads,writes;			// requests sent straight to the backend
+	uint64_t	read_bytes,write_bytes;
+	uint64_t	ssd_saved;				// bytes we didn't write to the cache
+	uint64_t	invalidated;			// cached blocks dropped by bypass writes
+
+} bypass_stats;
+
+int			cache_mode = CACHE_WB;		// mode for exports not in the table
+char*		cache_mode_file = NULL;		// "export mode" per line
+char*		cache_mode_names[] = { "writeback" , "writethrough" , "writearound" };
+
+struct {
+
+	char		name[64];
+	int			mode;
+
+} cache_modes[MAX_EXPORTS],cache_export;
+int			cache_mode_count = 0;
+
+struct {
+
+	uint64_t	writes;
+	uint64_t	bytes;
+	uint64_t	ssd_bytes;				// written to the cache, including read fills
+	uint64_t	usecs;
+	uint64_t	max_usecs;
+
+} mode_stats[3];
+
+struct {
+
+	uint64_t	fills;					// backend reads
+	uint64_t	blocks;
+	uint64_t	inserted;				// blocks admitted to the cache
+	uint64_t	backend_usecs;
+	uint64_t	insert_usecs;
+	uint64_t	requested;				// missing blocks asked for by clients
+	uint64_t	coalesced;				// of which served by someone else's fill
+	uint64_t	stale;					// fills not cached, written to meanwhile
+
+} miss_stats;
+
+struct {
+
+	uint64_t	writes;					// cacheStore calls
+	uint64_t	bytes;
+	uint64_t	runs;					// indexUpdateRun calls
+	uint64_t	blocks;
+	uint64_t	ops;					// index lookups and stores they made
+	uint64_t	nsecs;					// thread CPU time spent in them
+
+} update_stats;
+
+typedef struct miss_flight {
+
+	uint64_t			block;
+	uint32_t			count;
+	char*				buf;			// the filler's buffer
+	int					done,ok,stale;
+	int					waiters;
+	struct miss_flight*	next;
+
+} miss_flight;
+
+typedef struct write_flight {
+
+	uint64_t			block;
+	uint32_t			count;
+	struct write_flight*	next;
+
+} write_flight;
+
+int				miss_coalesce = True;	// let overlapping misses share one fill
+miss_flight*	flights = NULL;			// fills waiting on the backend
+write_flight*	write_flights = NULL;	// writes out on the backend without cache_lock
+pthread_cond_t	flight_cond = PTHREAD_COND_INITIALIZER;
+
+int			dirty_limit = 80;			// dirty % at which write-back acks are delayed the most
+int			throttle_max = 100;			// ms, most a write-back ack is held back
+int			cache_full = False;			// last allocation found nothing to evict
+
+struct {
+
+	char		name[64];
+	uint64_t	writes;
+	uint64_t	delayed;				// writes held back
+	uint64_t	usecs;					// total delay
+	uint64_t	max_usecs;
+	uint64_t	fallback;				// written around, no room in the cache
+
+} throttle_stats[MAX_EXPORTS];
+int			throttle_count = 0;
+
+int			reclaim_low = 5;			// % of slots free, below this the reclaimer starts
+int			reclaim_high = 10;			// and frees until we're back up to this
+int			reclaim_running = False;
+pthread_t	reclaim_thread;
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+
+struct {
+
+	uint64_t	lows;					// times free space fell below reclaim_low
+	uint64_t	highs;					// and was brought back up to reclaim_high
+	uint64_t	runs;
+	uint64_t	blocks;
+	uint64_t	usecs;
+	uint64_t	stalls;					// writes that had to evict for themselves
+
+} reclaim_stats;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheModeParse	- turn "wb", "writethrough" etc into a CACHE_ mode
+//	cacheModeLoad	- (re)read the per-export mode table
+//	cacheSetExport	- pick the mode for the export we're serving
+//	cacheExportMode	- and what it is
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int cacheModeParse(char* text)
+{
+	if(!strcasecmp(text,"wt") || !strcasecmp(text,"writethrough")) return CACHE_WT;
+	if(!strcasecmp(text,"wa") || !strcasecmp(text,"writearound")) return CACHE_WA;
+	if(!strcasecmp(text,"wb") || !strcasecmp(text,"writeback")) return CACHE_WB;
+	return -1;
+}
+
+int cacheModeLoad()
+{
+	FILE	*fp;
+	char	line[256],name[64],mode[32];
+	int		m;
+
+	if(!cache_mode_file) return True;
+	if(!(fp = fopen(cache_mode_file,"r"))) {
+		syslog(LOG_ERR,"Unable to open cache mode table [%s], err=%d",cache_mode_file,errno);
+		return False;
+	}
+	cache_mode_count = 0;
+	while( fgets(line,sizeof(line),fp) && (cache_mode_count < MAX_EXPORTS) ) {
+		if( (line[0] == '#') || (sscanf(line,"%63s %31s",name,mode) != 2) ) continue;
+		if( (m = cacheModeParse(mode)) == -1 ) {
+			syslog(LOG_ERR,"Unknown cache mode [%s] for export [%s]",mode,name);
+			continue;
+		}
+		strcpy(cache_modes[cache_mode_count].name,name);
+		cache_modes[cache_mode_count++].mode = m;
+	}
+	fclose(fp);
+	syslog(LOG_INFO,"Loaded %d cache modes from [%s]",cache_mode_count,cache_mode_file);
+	if(cache_export.name[0]) cacheSetExport(cache_export.name);
+	return True;
+}
+
+void cacheSetExport(char* name)
+{
+	int i;
+
+	strncpy(cache_export.name,name,sizeof(cache_export.name)-1);
+	cache_export.mode = cache_mode;
+	for(i=0;i<cache_mode_count;i++)
+		if(!strcmp(cache_modes[i].name,cache_export.name)) cache_export.mode = cache_modes[i].mode;
+	syslog(LOG_INFO,"Export [%s] cache mode is %s",cache_export.name,cache_mode_names[cache_export.mode]);
+}
+
+int cacheExportMode()
+{
+	return cache_export.mode;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //	cacheTRIM	- issue an SSD TRIM request
@@ -108,6 +316,208 @@ void cacheTRIM(uint64_t start,uint64_t count)
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheGeometry	- work out where the metadata, index and data live
+//
+//	With a paged index each slot also pays for two index entries (the index
+//	is sized for 50% occupancy) and the index starts on a page boundary.
+//
+//	v1 slots are a packed cache_entry followed by the data, with the slot
+//	table saved on close just after the header. v2 starts with a region
+//	of cache_meta, one per slot (which is also the saved table), then the
+//	index, then plain 4K data slots on a 4K boundary so they can be read
+//	and written O_DIRECT.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void cacheGeometry()
+{
+	uint64_t	space 	= cache_device.size-NCACHE_HSIZE;
+	uint64_t	slot 	= NCACHE_BSIZE+2*sizeof(cache_entry);
+	uint64_t	meta;
+
+	if( header.version >= CACHE_VERSION ) {
+		slot_size			= NCACHE_BSIZE;
+		slot				= NCACHE_BSIZE+sizeof(cache_meta);
+		if(header.paged) slot += 2*PINDEX_PSIZE/PINDEX_EPP;
+		cache_entries		= (cache_device.size-NCACHE_BSIZE) / slot;
+		header.meta_offset	= NCACHE_BSIZE;
+		do {
+			meta				= (header.meta_offset+cache_entries*sizeof(cache_meta)+NCACHE_BSIZE-1) & ~(uint64_t)(NCACHE_BSIZE-1);
+			header.index_pages	= header.paged ? (cache_entries*2+PINDEX_EPP-1)/PINDEX_EPP : 0;
+			header.index_offset	= header.paged ? meta : 0;
+			data_offset			= meta+(uint64_t)header.index_pages*PINDEX_PSIZE;
+		} while( (data_offset+cache_entries*NCACHE_BSIZE > cache_device.size) && (cache_entries = cache_entries > 64 ? cache_entries-64 : 0) );
+		return;
+	}
+	slot_size = NCACHE_ESIZE;
+	if(!header.paged) {
+		cache_entries 	= space / slot;
+		data_offset 	= NCACHE_HSIZE+cache_entries*sizeof(cache_entry);
+		return;
+	}
+	cache_entries = space / (slot+2*PINDEX_PSIZE/PINDEX_EPP);
+	do {
+		header.index_pages 	= (cache_entries*2+PINDEX_EPP-1)/PINDEX_EPP;
+		header.index_offset	= (NCACHE_HSIZE+cache_entries*sizeof(cache_entry)+PINDEX_PSIZE-1) & ~(uint64_t)(PINDEX_PSIZE-1);
+		data_offset			= header.index_offset+(uint64_t)header.index_pages*PINDEX_PSIZE;
+	} while( (data_offset+cache_entries*NCACHE_ESIZE > cache_device.size) && (cache_entries = cache_entries > PINDEX_EPP ? cache_entries-PINDEX_EPP : 0) );
+}
+
+//	slotOffset - where a slot starts on the device
+
+uint64_t slotOffset(uint32_t slot)
+{
+	return data_offset+(uint64_t)slot_size*slot;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheReadTable	- read the saved slot table (v1 or v2) as cache_entry
+//	cacheWriteTable	- write it back
+//
+///////////////////////////////////////////////////////////////////////////////
+
+cache_entry* cacheReadTable()
+{
+	cache_entry	*table = (cache_entry*)malloc(cache_entries*sizeof(cache_entry));
+	cache_meta	*meta;
+	uint64_t	size,slot;
+
+	if( header.version < CACHE_VERSION ) {
+		size = cache_entries*sizeof(cache_entry);
+		if( pread(cache,table,size,NCACHE_HSIZE) != size ) {
+			syslog(LOG_ALERT,"Unable to read the slot table, err=%d",errno);
+			free(table);
+			return NULL;
+		}
+		return table;
+	}
+	size = cache_entries*sizeof(cache_meta);
+	meta = (cache_meta*)malloc(size);
+	if( pread(cache,meta,size,header.meta_offset) != size ) {
+		syslog(LOG_ALERT,"Unable to read the metadata region, err=%d",errno);
+		free(meta);
+		free(table);
+		return NULL;
+	}
+	for(slot=0;slot<cache_entries;slot++) {
+		table[slot].block		= meta[slot].block;
+		table[slot].usecount	= meta[slot].usecount;
+		table[slot].dirty		= meta[slot].dirty;
+	}
+	free(meta);
+	return table;
+}
+
+int cacheWriteTable(cache_entry* table)
+{
+	cache_meta	*meta;
+	uint64_t	size,slot;
+	int			ok;
+
+	if( header.version < CACHE_VERSION ) {
+		size = cache_entries*sizeof(cache_entry);
+		ok = pwrite(cache,table,size,NCACHE_HSIZE) == size;
+	} else {
+		size = cache_entries*sizeof(cache_meta);
+		meta = (cache_meta*)calloc(cache_entries,sizeof(cache_meta));
+		for(slot=0;slot<cache_entries;slot++) {
+			meta[slot].block	= table[slot].block;
+			meta[slot].usecount	= table[slot].usecount;
+			meta[slot].dirty	= table[slot].dirty;
+		}
+		ok = pwrite(cache,meta,size,header.meta_offset) == size;
+		free(meta);
+	}
+	if(!ok) syslog(LOG_ALERT,"Unable to write the slot table, err=%d",errno);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	indexGet	- find a block in whichever index we're using
+//	indexPut	- store an entry, "was" is the state it was in (FREE if new)
+//	indexDel	- remove a block from the index
+//	indexPutRun	- store "count" new blocks in slots from entry->slot, one
+//				  extent with the extent index
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int indexGet(uint64_t block,hash_entry* entry)
+{
+	if(header.paged) return pindexGet(block,entry);
+	if(cache_extents) return extentGet(block,entry);
+
+	key.data = &block;
+	key.size = sizeof(block);
+	if(hash_used->get(hash_used,NULL,&key,&val,0))
+		if(hash_dirty->get(hash_dirty,NULL,&key,&val,0)) return False;
+	memcpy(entry,val.data,sizeof(hash_entry));
+	return True;
+}
+
+int indexPut(hash_entry* entry,uint8_t was)
+{
+	DB* db = entry->dirty == USED ? hash_used : hash_dirty;
+
+	cache_dirty += (entry->dirty != USED) - (was && (was != USED));
+	if(header.paged) return pindexPut(entry);
+	if(cache_extents) return extentPut(entry,1);
+
+	key.data = &entry->block;
+	key.size = sizeof(entry->block);
+	if( was && ((was == USED) != (entry->dirty == USED)) ) {
+		DB* old = was == USED ? hash_used : hash_dirty;
+		if( old->del(old,NULL,&key,0) != 0 )
+			syslog(LOG_ALERT,"ERR :: indexPut :: unable to move block [%lld]",(unsigned long long)entry->block);
+	}
+	val.data = entry;
+	val.size = sizeof(hash_entry);
+	if( db->put(db,NULL,&key,&val,0) != 0 ) {
+		syslog(LOG_ALERT,"ERR :: indexPut :: block [%lld]",(unsigned long long)entry->block);
+		return False;
+	}
+	return True;
+}
+
+int indexDel(uint64_t block)
+{
+	if(header.paged) return pindexDel(block);
+	if(cache_extents) return extentDel(block,1);
+
+	key.data = &block;
+	key.size = sizeof(block);
+	if(hash_used->del(hash_used,NULL,&key,0) == 0) return True;
+	return hash_dirty->del(hash_dirty,NULL,&key,0) == 0;
+}
+
+int indexPutRun(hash_entry* entry,int count)
+{
+	hash_entry	e = *entry;
+	int			i;
+
+	if(cache_extents) {
+		cache_dirty += entry->dirty != USED ? count : 0;
+		return extentPut(entry,count);
+	}
+	for(i=0;i<count;i++,e.block++,e.slot++)
+		if(!indexPut(&e,FREE)) return False;
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cachePrefetch	- hint that a request for this range is on its way
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void cachePrefetch(uint64_t off,int len)
+{
+	if(header.paged) pindexPrefetch(off/NCACHE_BSIZE,(len+NCACHE_BSIZE-1)/NCACHE_BSIZE);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //	cacheOpen	- initialise caching operations
@@ -119,16 +529,6 @@ void cacheTRIM(uint64_t start,uint64_t count)
 
 int cacheOpen(char* dev,char** hosts)
 {
-	//
-	//	cacheIndexKey - generate index key for secondary index (by usecount)
-	//
-	int cacheIndexKey(DB* db,const DBT* key,const DBT* val, DBT* idx)
-	{
-		hash_entry* entry = (hash_entry*)val->data;
-		idx->data = &entry->usecount;
-		idx->size = sizeof(entry->usecount);
-		return 0;
-	}
 	//
 	//	cacheHashFn - optimised hashing function for block numbers
 	//
@@ -161,26 +561,6 @@ int cacheOpen(char* dev,char** hosts)
 		return True;
 	}
 	//
-	//	cacheInitIndex - initialise a BTREE DB
-	//
-	int cacheInitIndex(DB** db)
-	{
-		int ret;
-		DB* d;
-	
-		if( db_create(db,NULL,0) != 0) {
-			syslog(LOG_ALERT,"Unable to create DB handle");
-			return False;
-		}
-		d=*db;
-		d->set_flags(d,DB_DUP|DB_DUPSORT);
-		if( ret = d->open(d, NULL, NULL, NULL, DB_BTREE , DB_CREATE, 0777) != 0) {
-			syslog(LOG_ALERT,"Unable to open memory DB, err=%d",errno);
-			return False;
-		}
-		return True;
-	}
-	//
 	memset(&key,0,sizeof(key));
 	memset(&val,0,sizeof(val));
 	//	
@@ -189,11 +569,6 @@ int cacheOpen(char* dev,char** hosts)
 		syslog(LOG_ALERT,"Unable to open Cache (%s), err=%d",dev,errno);
 		return -1;
 	}
-	mirror = open("/dev/vols/blocks/test",O_RDWR|O_EXCL);
-	if( mirror == -1 ) {
-		syslog(LOG_ALERT,"Unable to open Mirror (%s), err=%d",dev,errno);
-		return -1;
-	}
 
 	cache_ptr = -1;
 	if(ioctl(cache,BLKGETSIZE64,&cache_device.size)==-1) {
@@ -204,17 +579,25 @@ int cacheOpen(char* dev,char** hosts)
 		syslog(LOG_ALERT,"Error reading cache sector size, err=%d",errno);
 		return -1;
 	}
-	cache_entries 	= (cache_device.size-NCACHE_HSIZE) / (NCACHE_BSIZE+2*sizeof(cache_entry));
-	data_offset 	= NCACHE_HSIZE+cache_entries*sizeof(cache_entry);
 	READ_HEADER(cache,header);
+	cacheGeometry();
+	cache_direct = cache;
+	if( (header.version >= CACHE_VERSION) && ((cache_direct = open(dev,O_RDWR|O_DIRECT)) == -1) ) {
+		syslog(LOG_ERR,"Unable to open (%s) O_DIRECT, err=%d, data will go through the page cache",dev,errno);
+		cache_direct = cache;
+	}
 	
-	if( !cacheInitDB(&hash_used) || !cacheInitDB(&hash_dirty) || !cacheInitIndex(&hash_index) ){
+	if(header.paged) {
+		cache_extents = False;
+		if(!pindexOpen(cache,header.index_offset,header.index_pages)) return -1;
+	}
+	else if(cache_extents) {
+		if(!extentOpen(cache_device.size*CACHE_FACTOR)) return -1;
+	}
+	else if( !cacheInitDB(&hash_used) || !cacheInitDB(&hash_dirty) ){
 		return -1;
 	}
-	//if(hash_used->associate(hash_used,NULL,hash_index,cacheIndexKey,0)) {
-	//	syslog(LOG_ALERT,"Failed to create Index DB");
-	//	return -1;
-	//}
+	if(!evictInit(cache_entries) || !admitInit(cache_entries)) return -1;
 	//
 	if(memcmp(&header.magic,CACHE_MAGIC,sizeof(header.magic))) {
 		syslog(LOG_ERR,"Bad Magic in Cache header - reformat this device");
@@ -286,26 +669,38 @@ int cacheSave()
 		cursor->c_close(cursor);	
 		return count;
 	}
+	int cacheSavePage(hash_entry* entry,void* arg)
+	{
+		cache_entry* ptr = (cache_entry*)arg + entry->slot;
+		ptr->dirty 		= entry->dirty;
+		ptr->block 		= entry->block;
+		ptr->usecount	= entry->usecount;
+		return True;
+	}
 	int bytes,ret;
 	uint32_t slot;
 	int meta_size = cache_entries*sizeof(cache_entry);
 	cache_entry* index_base = (cache_entry*)malloc(meta_size);
+	int used = 0,dirty = 0;
 
 	memset(index_base,0,meta_size);
 	
-	int used = cacheSaveHash(index_base,hash_used);
-	int dirty = cacheSaveHash(index_base,hash_dirty);
-	
-	if(lseek(cache,NCACHE_HSIZE,SEEK_SET)==-1) {
-		syslog(LOG_ALERT,"Unable to seek to the beginning of the cache");
-		return False;
+	if(header.paged || cache_extents) {
+		if(header.paged) pindexWalk(cacheSavePage,index_base);
+		else extentWalk(cacheSavePage,index_base);
+		for(slot=0;slot<cache_entries;slot++) {
+			if(index_base[slot].dirty == USED) used++;
+			else if(index_base[slot].dirty) dirty++;
+		}
+	} else {
+		used = cacheSaveHash(index_base,hash_used);
+		dirty = cacheSaveHash(index_base,hash_dirty);
 	}
-	bytes = write(cache,index_base,meta_size);
+	
+	ret = cacheWriteTable(index_base);
 	free(index_base);
-	if(bytes != meta_size) {
-		syslog(LOG_ALERT,"Failed to write to cache");
-		return False;
-	} 
+	if(!ret) return False;
+	bytes = cache_entries*(header.version < CACHE_VERSION ? sizeof(cache_entry) : sizeof(cache_meta));
 	syslog(LOG_INFO,"Cache save :: %d used, %d dirty, data=%dM, meta=%dM",
 		   used,dirty,(int)(cache_device.size/1024/1024),bytes/1024/1024);
 	
@@ -324,9 +719,16 @@ int cacheClose(char* dev)
 {
 	if(header.open) {	
 		cacheSave();
-		hash_used->close(hash_used,0);
-		hash_dirty->close(hash_dirty,0);
+		if(header.paged) pindexClose();
+		else if(cache_extents) extentClose();
+		else {
+			hash_used->close(hash_used,0);
+			hash_dirty->close(hash_dirty,0);
+		}
+		evictClose();
+		admitClose();
 		free(freeq);
+		if( cache_direct != cache ) close(cache_direct);
 		syslog(LOG_INFO,"Cache (%s) closed",dev);
 		header.open = 0;
 		WRITE_HEADER(cache,header);	
@@ -349,7 +751,9 @@ int cacheFormat(char** hosts)
 	uint64_t 		block;
 	int 			count,i,size;
 	
-	
+	header.paged = cache_paged;
+	header.version = cache_version;
+	cacheGeometry();
 	
 	if(lseek(cache,0,SEEK_SET)==-1) {		
 		syslog(LOG_ALERT,"Seek error, err=%d",errno);	
@@ -406,15 +810,167 @@ int cacheFormat(char** hosts)
 	printf("Header Information:\n");
 	printf("Magic ... "); for(i=0;i<sizeof(header.magic);i++) printf("%c",header.magic[i]); printf("\n");
 	printf("Size .... %lldM\n",(unsigned long long)header.size/1024/1024*512);
+	printf("Version . %d\n",header.version < CACHE_VERSION ? 1 : header.version);
 	printf("Hosts ... %d\n",header.hcount);
 	printf("Open .... %d\n",header.open);
 	printf("ReIndex . %d\n",header.reindex);
+	if(header.paged)
+		printf("Index ... %ld pages @ %lld\n",(unsigned long)header.index_pages,(unsigned long long)header.index_offset);
 	for(i=0;i<header.hcount;i++) {
 		printf(  "Host %i - %s\n",i,inet_ntoa(header.hosts[i]));
 	}
 	return True;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheMigrate	- convert a cleanly closed v1 cache to v2, in place
+//
+//	Slots keep their numbers so the saved table carries straight over.
+//	The v2 data starts further up the device than v1's, so early on a
+//	slot's new home can still hold v1 data we haven't read; it's held in
+//	memory until the read has got past it. The metadata region (and a
+//	paged index, which is rebuilt) covers the start of the v1 data so
+//	it's written last, then the header. Not crash safe, take a copy or
+//	destage everything first.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define MIGRATE_BATCH	256				// v1 slots per read
+
+int cacheMigrate(char* dev)
+{
+	struct pending {
+		uint32_t		slot;
+		struct pending*	next;
+		char			data[NCACHE_BSIZE];
+	} *head = NULL,**tail = &head,*p;
+	cache_entry	*table;
+	hash_entry	entry;
+	uint64_t	v1_entries,v1_offset;
+	uint32_t	slot,n,i;
+	char		*rbuf;
+	int			moved = 0,ok = False;
+	//
+	//	migrateFlush - write out the held slots the read has got past
+	//
+	int migrateFlush(uint64_t frontier)
+	{
+		while( head && (slotOffset(head->slot)+NCACHE_BSIZE <= frontier) ) {
+			p = head;
+			if( pwrite(cache,p->data,NCACHE_BSIZE,slotOffset(p->slot)) != NCACHE_BSIZE ) {
+				printf("Write error, slot=%ld, errno=%d\n",(unsigned long)p->slot,errno);
+				return False;
+			}
+			if( !(head = p->next) ) tail = &head;
+			free(p);
+			moved++;
+		}
+		return True;
+	}
+	//
+	cache = open(dev,O_RDWR|O_EXCL);
+	if( cache == -1 ) {
+		printf("Unable to open (%s), errno=%d\n",dev,errno);
+		return False;
+	}
+	if( (ioctl(cache,BLKGETSIZE64,&cache_device.size) == -1) ||
+		(pread(cache,&header,sizeof(header),0) != sizeof(header)) ) {
+		printf("Unable to read the cache header, errno=%d\n",errno);
+		close(cache);
+		return False;
+	}
+	if(memcmp(&header.magic,CACHE_MAGIC,sizeof(header.magic))) {
+		printf("Bad Magic in Cache header, nothing to migrate\n");
+		close(cache);
+		return False;
+	}
+	if( header.version >= CACHE_VERSION ) {
+		printf("Cache is already version %d\n",header.version);
+		close(cache);
+		return True;
+	}
+	if( header.open ) {
+		printf("Cache wasn't closed cleanly, open and close it first\n");
+		close(cache);
+		return False;
+	}
+	cacheGeometry();
+	v1_entries	= cache_entries;
+	v1_offset	= data_offset;
+	if( !(table = cacheReadTable()) ) {
+		close(cache);
+		return False;
+	}
+	header.version = CACHE_VERSION;
+	cacheGeometry();
+	if( cache_entries < v1_entries ) {
+		printf("Version %d only has room for %lld of %lld slots\n",CACHE_VERSION,
+			(unsigned long long)cache_entries,(unsigned long long)v1_entries);
+		free(table);
+		close(cache);
+		return False;
+	}
+	printf("Migrating (%s) to version %d, %lld slots, data @ %lld (was %lld)\n",dev,CACHE_VERSION,
+		(unsigned long long)cache_entries,(unsigned long long)data_offset,(unsigned long long)v1_offset);
+	//
+	//	Copy the data slots down (or up)
+	//
+	rbuf = (char*)malloc(MIGRATE_BATCH*NCACHE_ESIZE);
+	for(slot=0;slot<v1_entries;slot+=n) {
+		n = v1_entries-slot < MIGRATE_BATCH ? v1_entries-slot : MIGRATE_BATCH;
+		if( pread(cache,rbuf,n*NCACHE_ESIZE,v1_offset+(uint64_t)NCACHE_ESIZE*slot) != n*NCACHE_ESIZE ) {
+			printf("Read error, slot=%ld, errno=%d\n",(unsigned long)slot,errno);
+			goto done;
+		}
+		for(i=0;i<n;i++) {
+			if(!table[slot+i].dirty) continue;
+			p = (struct pending*)malloc(sizeof(struct pending));
+			p->slot = slot+i;
+			p->next = NULL;
+			memcpy(p->data,rbuf+i*NCACHE_ESIZE+sizeof(cache_entry),NCACHE_BSIZE);
+			*tail = p;
+			tail = &p->next;
+		}
+		if(!migrateFlush(v1_offset+(uint64_t)NCACHE_ESIZE*(slot+n))) goto done;
+	}
+	if(!migrateFlush(~(uint64_t)0)) goto done;
+	//
+	//	Then the metadata, the index and the header
+	//
+	table = (cache_entry*)realloc(table,cache_entries*sizeof(cache_entry));
+	memset(table+v1_entries,0,(cache_entries-v1_entries)*sizeof(cache_entry));
+	if(!cacheWriteTable(table)) goto done;
+	if(header.paged) {
+		if( !pindexOpen(cache,header.index_offset,header.index_pages) || !pindexClear() ) goto done;
+		for(slot=0;slot<cache_entries;slot++) {
+			if(!table[slot].dirty) continue;
+			entry.slot		= slot;
+			entry.block		= table[slot].block;
+			entry.dirty		= table[slot].dirty;
+			entry.usecount	= table[slot].usecount;
+			entry.dtime		= 0;
+			pindexPut(&entry);
+		}
+		pindexClose();
+	}
+	if( (pwrite(cache,&header,sizeof(header),0) != sizeof(header)) || fsync(cache) ) {
+		printf("Unable to write the cache header, errno=%d\n",errno);
+		goto done;
+	}
+	printf("Ok, %d slots moved\n",moved);
+	ok = True;
+done:
+	while( (p = head) ) {
+		head = p->next;
+		free(p);
+	}
+	free(rbuf);
+	free(table);
+	close(cache);
+	return ok;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //	cacheLoad	- load the cache in from backing store
@@ -423,26 +979,17 @@ int cacheFormat(char** hosts)
 
 int cacheLoad()
 {
-	int bytes,ret;
+	int ret;
 	uint32_t slot;
-	int meta_size = cache_entries*sizeof(cache_entry);
 	int used=0;
 	int dirty=0;
 	DB* db;
 
 	syslog(LOG_INFO,"Cache Load");
 	
-	if(lseek(cache,NCACHE_HSIZE,SEEK_SET)==-1) {
-		syslog(LOG_ALERT,"Unable to seek BOF in cacheLoad");
-		return False;
-	}
-	cache_entry* index_base = (cache_entry*)malloc(meta_size);
+	cache_entry* index_base = cacheReadTable();
 	cache_entry* ptr = index_base;
-	bytes = read(cache,ptr,meta_size);
-	if( bytes != meta_size ) {
-		syslog(LOG_ALERT,"Cache header is wrong size!");
-		return False;
-	}
+	if(!index_base) return False;
 	hallocLoad(ptr,cache_entries);
 	for(slot=0;slot<cache_entries;slot++) {
 		if(!ptr->dirty) {
@@ -453,6 +1000,7 @@ int cacheLoad()
 		switch(ptr->dirty) {
 			case USED:
 				db = hash_used;
+				evictInsert(ptr->block,slot);
 				used++;
 				break;
 			default:
@@ -460,11 +1008,21 @@ int cacheLoad()
 				dirty++;
 				break;
 		}
+		if(header.paged) {		// the index is already on the device
+			ptr++;
+			continue;
+		}
 		hash_entry entry;
 		entry.slot 		= slot;
 		entry.block 	= ptr->block;
 		entry.dirty 	= ptr->dirty;
 		entry.usecount	= ptr->usecount;
+		entry.dtime		= 0;
+		if(cache_extents) {		// neighbours merge as they go in
+			if(!extentPut(&entry,1)) return False;
+			ptr++;
+			continue;
+		}
 			
 		val.data = &entry;
 		val.size = sizeof(hash_entry);
@@ -478,6 +1036,7 @@ int cacheLoad()
 		ptr++;
 	}
 	syslog(LOG_INFO,"Loaded %d used, %d dirty, free list size = %ld",used,dirty,freeq_next-freeq);
+	cache_dirty = dirty;
 	free(index_base);
 	header.open = 1;		
 	WRITE_HEADER(cache,header);
@@ -486,21 +1045,153 @@ int cacheLoad()
 ///////////////////////////////////////////////////////////////////////////////
 //
 //	cacheRead	- read an entry from the cache
+//	cacheFill	- fetch a run of missing blocks from the backend
+//
+//	Contiguous misses go to the backend as one read, and are then cached
+//	if they get past the admission filter. Fills in progress are kept on
+//	"flights" so a second reader missing on the same blocks waits for the
+//	first fill and copies its data, rather than going to the backend again.
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-int cacheReadMirror(uint64_t off,char* pbuf,int len)
+miss_flight* flightFind(uint64_t block)
 {
-	int ret;
-	hash_entry* entry;
-	uint64_t block = off/NCACHE_BSIZE;
-	DB* db = hash_used;
-	
-	lseek(mirror,off,SEEK_SET);
-	if( read(mirror,pbuf,len) != len ) {
-		syslog(LOG_ERR,"Read error = %d",errno);
-		return False;
+	miss_flight* f;
+
+	if(!miss_coalesce) return NULL;
+	for(f=flights;f;f=f->next)
+		if( (block >= f->block) && (block < f->block+f->count) ) return f;
+	return NULL;
+}
+
+void flightInvalidate(uint64_t block,uint32_t count)
+{
+	miss_flight* f;
+
+	for(f=flights;f;f=f->next)
+		if( (f->block < block+count) && (block < f->block+f->count) ) f->stale = True;
+}
+
+int flightJoin(miss_flight* f,uint64_t block,int count,char* pbuf)
+{
+	int n = f->block+f->count-block;
+
+	if( n > count ) n = count;
+	f->waiters++;
+	while( !f->done ) pthread_cond_wait(&flight_cond,&cache_lock);
+	if( f->ok ) memcpy(pbuf,f->buf+(block-f->block)*NCACHE_BSIZE,n*NCACHE_BSIZE);
+	f->waiters--;
+	pthread_cond_broadcast(&flight_cond);
+	if( !f->ok ) return 0;
+	miss_stats.coalesced += n;
+	return n;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	writeFind	- a write to the backend that overlaps these blocks
+//	writeWait	- wait until there isn't one
+//	writeBegin	- mark blocks as being written, before dropping cache_lock
+//	writeEnd	- and done, with cache_lock back
+//
+//	Write-through and write-around writes go to the backend without
+//	cache_lock. While they're out, overlapping writes wait their turn, the
+//	destager leaves the blocks alone and fills of them aren't cached, as
+//	the backend copy may be either side of the write.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+write_flight* writeFind(uint64_t block,uint32_t count)
+{
+	write_flight* w;
+
+	for(w=write_flights;w;w=w->next)
+		if( (w->block < block+count) && (block < w->block+w->count) ) return w;
+	return NULL;
+}
+
+void writeWait(uint64_t block,uint32_t count)
+{
+	while( writeFind(block,count) ) pthread_cond_wait(&flight_cond,&cache_lock);
+}
+
+void writeBegin(write_flight* w,uint64_t block,uint32_t count)
+{
+	writeWait(block,count);
+	destageWait(block,count);
+	flightInvalidate(block,count);
+	w->block = block;
+	w->count = count;
+	w->next	 = write_flights;
+	write_flights = w;
+}
+
+void writeEnd(write_flight* w)
+{
+	write_flight **pp;
+
+	for(pp=&write_flights;*pp!=w;pp=&(*pp)->next);
+	*pp = w->next;
+	flightInvalidate(w->block,w->count);
+	pthread_cond_broadcast(&flight_cond);
+}
+
+int cacheFill(uint64_t block,char* pbuf,int count)
+{
+	struct timeval	t0,t1,t2;
+	uint8_t			admit[count];
+	int				i,n,ok,inserted = 0;
+	hash_entry		entry;
+	miss_flight		f;
+	miss_flight		**pp;
+	//
+	//	Let anyone else who misses on these blocks wait for us, and drop
+	//	the lock while we're out on the network
+	//
+	memset(&f,0,sizeof(f));
+	f.block	= block;
+	f.count	= count;
+	f.buf	= pbuf;
+	f.next	= flights;
+	flights	= &f;
+	pthread_mutex_unlock(&cache_lock);
+	gettimeofday(&t0,NULL);
+	ok = backendRead(block*NCACHE_BSIZE,pbuf,count*NCACHE_BSIZE);
+	gettimeofday(&t1,NULL);
+	pthread_mutex_lock(&cache_lock);
+	for(pp=&flights;*pp!=&f;pp=&(*pp)->next);
+	*pp = f.next;
+	if(writeFind(block,count)) f.stale = True;
+	//
+	//	Insert whatever gets past admission, a run at a time. Skip the
+	//	lot if it was written to while we were away, it's out of date.
+	//
+	if( ok && f.stale ) miss_stats.stale++;
+	for(i=0;ok && !f.stale && (i<count);i++) {
+		evictMiss(block+i);
+		admit[i] = !indexGet(block+i,&entry) && cacheAdmit(block+i);
+	}
+	for(i=0;ok && !f.stale && (i<count);i+=n) {
+		for(n=0;(i+n<count) && admit[i+n];n++);
+		if(!n) {
+			n = 1;
+			continue;
+		}
+		if(cacheInsert(block+i,pbuf+i*NCACHE_BSIZE,n)) inserted += n;
 	}
+	gettimeofday(&t2,NULL);
+	f.ok	= ok;
+	f.done	= True;
+	pthread_cond_broadcast(&flight_cond);
+	while( f.waiters ) pthread_cond_wait(&flight_cond,&cache_lock);
+	if(!ok) return False;
+
+	miss_stats.fills++;
+	miss_stats.blocks += count;
+	miss_stats.inserted += inserted;
+	miss_stats.backend_usecs += (t1.tv_sec-t0.tv_sec)*1000000ULL+t1.tv_usec-t0.tv_usec;
+	miss_stats.insert_usecs += (t2.tv_sec-t1.tv_sec)*1000000ULL+t2.tv_usec-t1.tv_usec;
+	mode_stats[cache_export.mode].ssd_bytes += inserted*NCACHE_BSIZE;
 	return True;
 }
 
@@ -530,52 +1221,419 @@ int hashNotFound(uint64_t block,uint64_t off,int len)
 	return False;
 }
 
-int cacheRead(uint64_t off,char* pbuf,int len)
+int cacheReadSlot(uint32_t slot,char* pbuf)
+{
+	return cacheReadSlots(slot,pbuf,NULL,1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheReadSlots	- read "n" slots from "slot", data and headers
+//	cacheWriteSlots	- write them
+//
+//	"data" is n*NCACHE_BSIZE and "hdr" n entries (or NULL when reading
+//	if we only want the data). In v2 the data goes straight between the
+//	device and the caller's buffer when it's 4K aligned, which is what
+//	the request and destage buffers are, and the metadata is written
+//	after the data so a crash can only leave a stale entry behind. v1
+//	reads scatter the headers and data with preadv, SLOT_IOV slots a go.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define SLOT_IOV	(IOV_MAX/2)
+
+int cacheReadSlots(uint32_t slot,char* data,cache_entry* hdr,int n)
+{
+	struct timeval	t0,t1;
+	struct iovec	iov[2*SLOT_IOV];
+	cache_entry		junk;
+	char			*buf;
+	cache_meta		*meta;
+	int				size,i,done,m;
+
+	gettimeofday(&t0,NULL);
+	slot_stats.reads += n;
+	if( header.version < CACHE_VERSION ) {
+		for(done=0;done<n;done+=m) {
+			m = n-done < SLOT_IOV ? n-done : SLOT_IOV;
+			for(i=0;i<m;i++) {
+				iov[2*i].iov_base	= hdr ? &hdr[done+i] : &junk;
+				iov[2*i].iov_len	= sizeof(cache_entry);
+				iov[2*i+1].iov_base	= data+(done+i)*NCACHE_BSIZE;
+				iov[2*i+1].iov_len	= NCACHE_BSIZE;
+			}
+			slot_stats.syscalls++;
+			if( preadv(cache,iov,2*m,slotOffset(slot+done)) != m*NCACHE_ESIZE ) {
+				syslog(LOG_ALERT,"Read error, slot=%ld, err=%d",(unsigned long)(slot+done),errno);
+				return False;
+			}
+		}
+	} else {
+		size = n*NCACHE_BSIZE;
+		buf = data;
+		if( (cache_direct != cache) && ((uintptr_t)data & (NCACHE_BSIZE-1)) ) {
+			if( posix_memalign((void**)&buf,NCACHE_BSIZE,size) ) return False;
+			slot_stats.bounced++;
+		}
+		slot_stats.syscalls++;
+		if( pread(cache_direct,buf,size,slotOffset(slot)) != size ) {
+			syslog(LOG_ALERT,"Read error, err=%d",errno);
+			if( buf != data ) free(buf);
+			return False;
+		}
+		if( buf != data ) {
+			memcpy(data,buf,size);
+			free(buf);
+		}
+		if(hdr) {
+			size = n*sizeof(cache_meta);
+			meta = (cache_meta*)malloc(size);
+			slot_stats.syscalls++;
+			if( pread(cache,meta,size,header.meta_offset+(uint64_t)slot*sizeof(cache_meta)) != size ) {
+				syslog(LOG_ALERT,"Metadata read error, err=%d",errno);
+				free(meta);
+				return False;
+			}
+			for(i=0;i<n;i++) {
+				hdr[i].block	= meta[i].block;
+				hdr[i].usecount	= meta[i].usecount;
+				hdr[i].dirty	= meta[i].dirty;
+			}
+			free(meta);
+		}
+	}
+	gettimeofday(&t1,NULL);
+	govSample(0,(t1.tv_sec-t0.tv_sec)*1000000ULL+t1.tv_usec-t0.tv_usec);
+	return True;
+}
+
+int cacheWriteSlots(uint32_t slot,char* data,cache_entry* hdr,int n)
+{
+	char		*buf,*ptr;
+	cache_meta	*meta;
+	int			size,i,ok;
+
+	if( header.version < CACHE_VERSION ) {
+		ptr = buf = (char*)malloc(n*NCACHE_ESIZE);
+		for(i=0;i<n;i++) {
+			memcpy(ptr,&hdr[i],sizeof(cache_entry));
+			memcpy(ptr+sizeof(cache_entry),data+i*NCACHE_BSIZE,NCACHE_BSIZE);
+			ptr += NCACHE_ESIZE;
+		}
+		ok = logWrite(slot,buf,n*NCACHE_ESIZE);
+		free(buf);
+		return ok;
+	}
+	size = n*NCACHE_BSIZE;
+	buf = data;
+	if( (cache_direct != cache) && ((uintptr_t)data & (NCACHE_BSIZE-1)) ) {
+		if( posix_memalign((void**)&buf,NCACHE_BSIZE,size) ) return False;
+		memcpy(buf,data,size);
+		slot_stats.bounced++;
+	}
+	ok = logWrite(slot,buf,size);
+	if( buf != data ) free(buf);
+	if(!ok) return False;
+
+	meta = (cache_meta*)calloc(n,sizeof(cache_meta));
+	for(i=0;i<n;i++) {
+		meta[i].block		= hdr[i].block;
+		meta[i].usecount	= hdr[i].usecount;
+		meta[i].dirty		= hdr[i].dirty;
+	}
+	ok = logWriteAt(cache,header.meta_offset+(uint64_t)slot*sizeof(cache_meta),meta,n*sizeof(cache_meta));
+	slot_stats.meta_writes++;
+	free(meta);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheReadBlocks	- read a request, a run of hits or misses at a time
+//
+//	Hits are looked up until the slots stop being contiguous (writes get
+//	contiguous slots where they can) and each run is a single read. The
+//	lookup that ends a run is kept for the next one; nothing can change
+//	the index in between as we hold cache_lock throughout.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int readSize(int len)
+{
+	int c;
+
+	for(c=0;(c<READ_SIZES-1) && (len >> (c+13));c++);
+	return c;
+}
+
+int cacheReadBlocks(uint64_t off,char* pbuf,int len)
+{
+	hash_entry entry;
+	uint64_t block = off/NCACHE_BSIZE;
+	uint64_t calls;
+	uint32_t first;
+	int blocks = len/NCACHE_BSIZE;
+	int c = readSize(len);
+	int i,n,hit = -1;
+
+	miss_flight* f;
+
+	read_sizes[c].requests++;
+	read_sizes[c].blocks += blocks;
+	for(i=0;i<blocks;i+=n) {
+		n = 1;
+		if( hit < 0 ) hit = indexGet(block+i,&entry);
+		if( hit ) {
+			first = entry.slot;
+			for(;;) {
+				admitRecord(block+i+n-1);
+				if(entry.dirty == USED) evictAccess(block+i+n-1);
+				hit = -1;
+				if( i+n == blocks ) break;
+				hit = indexGet(block+i+n,&entry);
+				if( !hit || (entry.slot != first+n) ) break;
+				n++;
+			}
+			calls = slot_stats.syscalls;
+			if(!cacheReadSlots(first,pbuf+i*NCACHE_BSIZE,NULL,n)) return False;
+			read_sizes[c].runs++;
+			read_sizes[c].syscalls += slot_stats.syscalls-calls;
+			continue;
+		}
+		hit = -1;
+		if( f = flightFind(block+i) ) {
+			if(!(n = flightJoin(f,block+i,blocks-i,pbuf+i*NCACHE_BSIZE))) return False;
+			miss_stats.requested += n;
+			continue;
+		}
+		while( (i+n<blocks) && !indexGet(block+i+n,&entry) && !flightFind(block+i+n) ) n++;
+		if(!cacheFill(block+i,pbuf+i*NCACHE_BSIZE,n)) return False;
+		miss_stats.requested += n;
+	}
+	return True;
+}
+
+int cacheRead(uint64_t off,char* pbuf,int len)
+{
+	struct timeval t0,t1;
+	int ok;
+
+	gettimeofday(&t0,NULL);
+	pthread_mutex_lock(&cache_lock);
+	ok = cacheReadBlocks(off,pbuf,len);
+	gettimeofday(&t1,NULL);
+	latRecord(&read_sizes[readSize(len)].hist,(t1.tv_sec-t0.tv_sec)*1000000ULL+t1.tv_usec-t0.tv_usec);
+	pthread_mutex_unlock(&cache_lock);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheBypassRead	- sequential read straight from the backend
+//
+//	Anything dirty in the cache is newer than the backend copy, so it's
+//	laid over the top. Clean blocks are the same either way. The backend
+//	read goes out without cache_lock, so what's dirty is noted first; one
+//	that's been destaged and evicted by the time we're back may have been
+//	missed by our read, and is read again (rare, so under the lock).
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int cacheBypassRead(uint64_t off,char* pbuf,int len)
+{
+	hash_entry	entry;
+	uint64_t	block = off/NCACHE_BSIZE;
+	int			blocks = len/NCACHE_BSIZE;
+	uint8_t		dirty[blocks];
+	int			i,ok;
+
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;i<blocks;i++) dirty[i] = cache_dirty && indexGet(block+i,&entry) && (entry.dirty != USED);
+	pthread_mutex_unlock(&cache_lock);
+	ok = backendRead(off,pbuf,len);
+	pthread_mutex_lock(&cache_lock);
+	if(ok) {
+		bypass_stats.reads++;
+		bypass_stats.read_bytes += len;
+	}
+	for(i=0;ok && (i<blocks);i++,pbuf+=NCACHE_BSIZE) {
+		if(!indexGet(block+i,&entry)) {
+			if(dirty[i]) ok = backendRead((block+i)*NCACHE_BSIZE,pbuf,NCACHE_BSIZE);
+			else bypass_stats.ssd_saved += NCACHE_BSIZE;
+		} else if( dirty[i] || (entry.dirty != USED) ) ok = cacheReadSlot(entry.slot,pbuf);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheBypassWrite	- sequential write straight to the backend
+//	cacheWriteAround	- write to the backend and drop any cached copies
+//
+//	Every host now has the latest copy, so any cached blocks in the range
+//	(clean or dirty) are stale and get dropped. Called with cache_lock held,
+//	which is dropped while the write is out (see writeBegin), after waiting
+//	for any destage of the same blocks so it can't land after us.
+//	If the write quorum let some hosts lag, the data is kept in the cache,
+//	dirty for just those hosts, until the destager has caught them up. If
+//	there's no room for it the lagging hosts are left to resync instead.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int cacheBypassWrite(uint64_t off,char* sptr,int len)
+{
+	int ok;
+
+	pthread_mutex_lock(&cache_lock);
+	if(ok = cacheWriteAround(off,sptr,len)) {
+		bypass_stats.writes++;
+		bypass_stats.write_bytes += len;
+		bypass_stats.ssd_saved += len;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return ok;
+}
+
+int cacheWriteAround(uint64_t off,char* sptr,int len)
+{
+	write_flight	w;
+	uint8_t			lag;
+	int				ok;
+
+	writeBegin(&w,off/NCACHE_BSIZE,len/NCACHE_BSIZE);
+	pthread_mutex_unlock(&cache_lock);
+	ok = backendWrite(off,sptr,len,&lag);
+	pthread_mutex_lock(&cache_lock);
+	writeEnd(&w);
+	if(!ok) return False;
+	if(lag && cacheStore(off,sptr,len,USED|lag)) return True;
+	cacheInvalidate(off/NCACHE_BSIZE,len/NCACHE_BSIZE);
+	return True;
+}
+
+//	cacheInvalidate - drop any cached copies of a range, clean or dirty
+
+void cacheInvalidate(uint64_t block,int count)
+{
+	hash_entry entry;
+
+	hallocBegin();
+	for(;count>0;count--,block++) {
+		if(!indexGet(block,&entry)) continue;
+		if(entry.dirty == USED) evictRemove(block);
+		else cache_dirty--;
+		indexDel(block);
+		hallocFree(entry.slot,block);
+		bypass_stats.invalidated++;
+	}
+	hallocEnd();
+}
+
+void modeStats()
 {
-	int ret;
-	hash_entry* entry;
-	uint64_t block = off/NCACHE_BSIZE;
-	DB* db = hash_used;
-	char ploc[NCACHE_ESIZE];
+	int i;
+
+	syslog(LOG_INFO,"MODE STATS (default %s)",cache_mode_names[cache_mode]);
+	for(i=0;i<3;i++) {
+		if(!mode_stats[i].writes && !mode_stats[i].ssd_bytes) continue;
+		syslog(LOG_INFO,"%-12s :: writes %lld (%lldMB), avg %lldus, max %lldus, SSD writes %lldMB",
+			   cache_mode_names[i],(unsigned long long)mode_stats[i].writes,
+			   (unsigned long long)mode_stats[i].bytes>>20,
+			   (unsigned long long)(mode_stats[i].writes ? mode_stats[i].usecs/mode_stats[i].writes : 0),
+			   (unsigned long long)mode_stats[i].max_usecs,
+			   (unsigned long long)mode_stats[i].ssd_bytes>>20);
+	}
+}
 
-	key.data = &block;
-	key.size = sizeof(block);
-	
-	while( len > 0 ) {
-		if(hash_used->get(hash_used,NULL,&key,&val,0))
-			if(hash_dirty->get(hash_dirty,NULL,&key,&val,0)) {
-				syslog(LOG_ERR,"** Filling block %lld with zeros",(unsigned long long)block);
-				val.data = NULL;
-			}
-		if(val.data) {
-			entry = (hash_entry*)(val.data);
-			//syslog(LOG_INFO,"Block: %lld, Slot: %ld",(unsigned long long)block,(unsigned long)entry->slot);
-			//entry->usecount++;
-			ret=lseek(cache,data_offset + (NCACHE_ESIZE*entry->slot),SEEK_SET);
-			if(ret==-1) {
-				syslog(LOG_ERR,"Error seeking slot [%lld] for block [%lld]",(unsigned long long)entry->slot,(unsigned long long)(off/NCACHE_BSIZE));
-				return False;
-			}
-			if( read(cache,ploc,NCACHE_ESIZE) != NCACHE_ESIZE ) {
-				syslog(LOG_ALERT,"Read error, err=%d",errno);	
-				return False;									
-			}
-			memcpy(pbuf,ploc+sizeof(cache_entry),NCACHE_BSIZE);
-		} else {
-			memset(pbuf,0,NCACHE_BSIZE);
-		}
-		len -= NCACHE_BSIZE;
-		pbuf += NCACHE_BSIZE;
-		block++;
+void throttleStats()
+{
+	int i;
+
+	syslog(LOG_INFO,"THROTTLE STATS (dirty %d%%, kick at %d%%, limit %d%%, max delay %dms)",
+		   cacheDirtyRatio(),destage_ratio,dirty_limit,throttle_max);
+	for(i=0;i<throttle_count;i++)
+		syslog(LOG_INFO,"%-16s :: writes %lld, delayed %lld, avg delay %lldus, max %lldus, written around (full) %lld",
+			   throttle_stats[i].name,(unsigned long long)throttle_stats[i].writes,
+			   (unsigned long long)throttle_stats[i].delayed,
+			   (unsigned long long)(throttle_stats[i].delayed ? throttle_stats[i].usecs/throttle_stats[i].delayed : 0),
+			   (unsigned long long)throttle_stats[i].max_usecs,(unsigned long long)throttle_stats[i].fallback);
+}
+
+void missStats()
+{
+	syslog(LOG_INFO,"MISS STATS");
+	syslog(LOG_INFO,"Fills %lld, blocks %lld (%.1f/fill), inserted %lld",
+		   (unsigned long long)miss_stats.fills,(unsigned long long)miss_stats.blocks,
+		   miss_stats.fills ? (double)miss_stats.blocks/miss_stats.fills : 0.0,
+		   (unsigned long long)miss_stats.inserted);
+	syslog(LOG_INFO,"Per fill :: backend %lldus, cache insert %lldus, %lld not cached (stale)",
+		   (unsigned long long)(miss_stats.fills ? miss_stats.backend_usecs/miss_stats.fills : 0),
+		   (unsigned long long)(miss_stats.fills ? miss_stats.insert_usecs/miss_stats.fills : 0),
+		   (unsigned long long)miss_stats.stale);
+	syslog(LOG_INFO,"Coalescing %s :: missed %lld, shared %lld, backend read amplification %.2f",
+		   miss_coalesce ? "on" : "off",
+		   (unsigned long long)miss_stats.requested,(unsigned long long)miss_stats.coalesced,
+		   miss_stats.requested ? (double)miss_stats.blocks/miss_stats.requested : 0.0);
+}
+
+void bypassStats()
+{
+	syslog(LOG_INFO,"BYPASS STATS");
+	syslog(LOG_INFO,"Reads %lld (%lldMB), writes %lld (%lldMB), invalidated %lld blocks",
+		   (unsigned long long)bypass_stats.reads,(unsigned long long)bypass_stats.read_bytes>>20,
+		   (unsigned long long)bypass_stats.writes,(unsigned long long)bypass_stats.write_bytes>>20,
+		   (unsigned long long)bypass_stats.invalidated);
+	syslog(LOG_INFO,"SSD writes saved %lldMB",(unsigned long long)bypass_stats.ssd_saved>>20);
+}
+
+void updateStats()
+{
+	uint64_t mb = update_stats.bytes >> 20;
+
+	syslog(LOG_INFO,"INDEX UPDATE STATS");
+	syslog(LOG_INFO,"Writes %lld, runs %lld, blocks %lld (%.1f/run)",
+		   (unsigned long long)update_stats.writes,(unsigned long long)update_stats.runs,
+		   (unsigned long long)update_stats.blocks,
+		   update_stats.runs ? (double)update_stats.blocks/update_stats.runs : 0.0);
+	syslog(LOG_INFO,"Index operations %.1f per write, %.1f per MB, CPU %lldus per MB",
+		   update_stats.writes ? (double)update_stats.ops/update_stats.writes : 0.0,
+		   mb ? (double)update_stats.ops/mb : 0.0,
+		   (unsigned long long)(mb ? update_stats.nsecs/mb/1000 : 0));
+}
+
+void slotStats()
+{
+	int c;
+
+	syslog(LOG_INFO,"SLOT STATS");
+	syslog(LOG_INFO,"Format v%d, %ld byte slots, data %s",
+		   header.version < CACHE_VERSION ? 1 : header.version,(unsigned long)slot_size,
+		   cache_direct != cache ? "O_DIRECT" : "buffered");
+	syslog(LOG_INFO,"Slot reads %lld in %lld syscalls, bounced %lld, metadata writes %lld",
+		   (unsigned long long)slot_stats.reads,(unsigned long long)slot_stats.syscalls,
+		   (unsigned long long)slot_stats.bounced,(unsigned long long)slot_stats.meta_writes);
+	for(c=0;c<READ_SIZES;c++) {
+		if(!read_sizes[c].requests) continue;
+		syslog(LOG_INFO,"%4dK%s reads :: %8lld, %.2f hit runs, %.2f syscalls each, p50 %lldus, p99 %lldus",
+			   4<<c,c==READ_SIZES-1 ? "+" : " ",(unsigned long long)read_sizes[c].requests,
+			   (double)read_sizes[c].runs/read_sizes[c].requests,
+			   (double)read_sizes[c].syscalls/read_sizes[c].requests,
+			   (unsigned long long)latPercentile(&read_sizes[c].hist,50),
+			   (unsigned long long)latPercentile(&read_sizes[c].hist,99));
 	}
-	//SAVE_CACHE(db);
-	return True;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
 //	cacheWrite	- write a new entry into the local cache
 //
+//	How depends on the export's mode;
+//
+//	writeback		- SSD only, blocks stay dirty until destaged
+//	writethrough	- backends first, then a clean copy in the SSD
+//	writearound		- backends only, cached copies are dropped
+//
 ///////////////////////////////////////////////////////////////////////////////
 
 //int gcount=150;
@@ -594,58 +1652,208 @@ void cacheAlignBlock(int *len)
 }
 
 
-int hashUpdate(uint64_t block,uint32_t slot)
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheAllocate	- get a run of slots, evicting clean blocks if we must
+//
+//	Called between hallocBegin / hallocEnd, count is set to zero (and
+//	cache_full set) if there is nothing left to evict.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void cacheAllocate(uint32_t *slot,int *count)
 {
-	hash_entry	new_entry;
-	hash_entry  *entry = NULL;
-	//
-	//	Initialise search key
-	//
-	key.data = &block;
-	key.size = sizeof(block);
-	//
-	//	If it's in the used list, we need to remove it
-	//
-	if(hash_used->get(hash_used,NULL,&key,&val,0) == 0)
-		// FIXME :: error check the delete
-		hash_used->del(hash_used,NULL,&key,0);
-	else if(hash_dirty->get(hash_dirty,NULL,&key,&val,0) != 0) {
-		//
-		//	If it's not in the dirty list, we need a new entry
-		//
-		entry = &new_entry;
-		entry->block 	= block;
-		entry->usecount = 0;
-		val.data 		= entry;
-		val.size 		= sizeof(new_entry);
+	int want = *count;
+
+	if(log_running) logAllocate(slot,count);
+	else hallocAllocate(slot,count);
+	if( reclaim_running && (hallocAvailable() < reclaim_low*cache_entries/100) ) reclaimKick();
+	if(*count) return;
+	reclaim_stats.stalls++;
+	hallocEnd();
+	cacheExpire(EVICT_BATCH);
+	hallocBegin();
+	*count = want;
+	if(log_running) logAllocate(slot,count);
+	else hallocAllocate(slot,count);
+	if( (cache_full = !*count) ) syslog(LOG_ALERT,"Cache full, no clean blocks to evict");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheAdmit	- should a block we've just missed on go into the cache
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int cacheAdmit(uint64_t block)
+{
+	uint64_t victim;
+
+	if( hallocAvailable() || !evictPeek(&victim) ) return admitCheck(block,NULL);
+	return admitCheck(block,&victim);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheInsert	- add clean copies of "count" blocks we don't hold yet
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int cacheInsert(uint64_t block,char* sptr,int count)
+{
+	uint32_t	slot,first;
+	int			n,size;
+	char		*data;
+	cache_entry	*hdr,*iptr;
+	hash_entry	entry;
+
+	hallocBegin();
+	while( count > 0 ) {
+		n = count;
+		cacheAllocate(&slot,&n);
+		if(!n) break;
+		first = slot;
+		data = sptr;
+		size = n;
+		iptr = hdr = (cache_entry*)malloc(sizeof(cache_entry)*n);
+		count -= n;
+		entry.block		= block;
+		entry.slot		= slot;
+		entry.usecount	= 1;
+		entry.dirty		= USED;
+		entry.dtime		= 0;
+		indexPutRun(&entry,n);
+		while( n-- ) {
+			iptr->block 	= block;
+			iptr->dirty 	= USED;
+			iptr->usecount	= 1;
+			iptr++;
+			sptr += NCACHE_BSIZE;
+			evictInsert(block,slot);
+			block++;
+			slot++;
+		}
+		if(!cacheWriteSlots(first,data,hdr,size)) {
+			free(hdr);
+			hallocEnd();
+			return False;
+		}
+		free(hdr);
 	}
-	//
-	//	If it's not a new entry, we need to clear the old slots
-	//	
-	if(!entry) {
-		entry = (hash_entry*)val.data;
-		hallocFree(entry->slot,block);
+	hallocEnd();
+	return count == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	indexGetRun		- look up "count" blocks from "block" in one pass
+//	indexUpdateRun	- point the blocks in "hdr" (consecutive) at slots from
+//					  "slot" in their new states, fill in their usecount
+//
+//	The write path's metadata update. The run is resolved first (one range
+//	lookup with the extent index, hash lookups try the hash the previous
+//	block was in first, index pages were prefetched when the request came
+//	in), every old slot goes back to the allocator in one call, then the
+//	new entries go in, as one extent per state with the extent index. All
+//	the blocks get the same usecount, one more than the highest of those
+//	they replace, which is all destage needs to spot a rewrite.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int indexGetRun(uint64_t block,int count,hash_entry* entry,uint8_t* found)
+{
+	DB			*db = hash_used,*other;
+	uint64_t	b;
+	int			i;
+
+	if(cache_extents) {
+		update_stats.ops++;
+		return extentRange(block,count,entry,found);
+	}
+	for(i=0;i<count;i++) {
+		b = block+i;
+		update_stats.ops++;
+		if(header.paged) {
+			found[i] = pindexGet(b,&entry[i]);
+			continue;
+		}
+		key.data = &b;
+		key.size = sizeof(b);
+		other = db == hash_used ? hash_dirty : hash_used;
+		if( (found[i] = (db->get(db,NULL,&key,&val,0) == 0)) == False ) {
+			update_stats.ops++;
+			if( !(found[i] = (other->get(other,NULL,&key,&val,0) == 0)) ) continue;
+			db = other;
+		}
+		memcpy(&entry[i],val.data,sizeof(hash_entry));
 	}
+	return True;
+}
+
+uint32_t indexUpdateRun(uint32_t slot,cache_entry* hdr,int count)
+{
+	hash_entry	*old = (hash_entry*)malloc(count*sizeof(hash_entry));
+	uint8_t		*found = (uint8_t*)malloc(count);
+	uint32_t	*freed = (uint32_t*)malloc(count*sizeof(uint32_t));
+	uint64_t	*blocks = (uint64_t*)malloc(count*sizeof(uint64_t));
+	uint64_t	block = hdr[0].block;
+	uint32_t	usecount = 0;
+	hash_entry	entry;
+	int			i,j,n,nfree = 0;
 	//
-	//	Update the contents and stick it back in the dirty list
+	//	What's there now, and let go of it
 	//
-	entry->slot		= slot;
-	entry->dirty 	= DIRTY;
-	entry->usecount++;
-	PUT_DIRTY;
+	indexGetRun(block,count,old,found);
+	for(i=0;i<count;i++) {
+		if(!found[i]) continue;
+		if(old[i].usecount > usecount) usecount = old[i].usecount;
+		if(old[i].dirty == USED) evictRemove(block+i);
+		freed[nfree]	= old[i].slot;
+		blocks[nfree++]	= block+i;
+	}
+	hallocFreeList(freed,blocks,nfree);
 	//
-	//	Return the usecount for convenience
+	//	Then the new entries, a run of the same state at a time
 	//
-	return entry->usecount;
+	entry.usecount	= ++usecount;
+	entry.dtime		= time(NULL);
+	for(i=0;i<count;i+=n) {
+		for(n=1;(i+n<count) && (hdr[i+n].dirty == hdr[i].dirty);n++);
+		entry.block	= block+i;
+		entry.slot	= slot+i;
+		entry.dirty	= hdr[i].dirty;
+		if(cache_extents) {
+			for(j=i;j<i+n;j++) cache_dirty += (entry.dirty != USED) - (found[j] && (old[j].dirty != USED));
+			extentPut(&entry,n);
+			update_stats.ops++;
+			continue;
+		}
+		for(j=i;j<i+n;j++,entry.block++,entry.slot++) {
+			indexPut(&entry,found[j] ? old[j].dirty : FREE);
+			update_stats.ops += 1 + (found[j] && ((old[j].dirty == USED) != (entry.dirty == USED)));
+		}
+	}
+	for(i=0;i<count;i++) {
+		hdr[i].usecount = usecount;
+		if(hdr[i].dirty == USED) evictInsert(block+i,slot+i);
+	}
+	update_stats.runs++;
+	update_stats.blocks += count;
+	free(old);
+	free(found);
+	free(freed);
+	free(blocks);
+	return usecount;
 }
 
-int cacheWrite(uint64_t off, char* sptr, int len)
+int cacheStore(uint64_t off, char* sptr, int len, uint8_t state)
 {
 	uint64_t		block = off/NCACHE_BSIZE;
-	uint32_t		slot;
+	uint32_t		slot,first;
 	int				count,size;
-	char			*wbuf,*wptr;
-	cache_entry		*iptr;
+	char			*data;
+	cache_entry		*hdr,*iptr;
+	struct timespec	t0,t1;
 	writeEntry		*e;
 	uint64_t		b = off/NCACHE_BSIZE;
 	int				l = len;
@@ -659,45 +1867,151 @@ int cacheWrite(uint64_t off, char* sptr, int len)
 	//	e->next = writeList;
 	//	writeList = e;
 	//}
-	//
-	//	Write a copy of the block to the mirror file
-	//
-	lseek(mirror,off,SEEK_SET);
-	if( write(mirror,sptr,len) == -1 ) {
-		syslog(LOG_ERR,"Write error = %d",errno);
-		return False;
-	}
+	flightInvalidate(block,(len+NCACHE_BSIZE-1)/NCACHE_BSIZE);
 	cacheAlignBlock(&len);
+	update_stats.writes++;
+	update_stats.bytes += len;
 	hallocBegin();
 	while( len > 0 ) {
 		count = len/NCACHE_BSIZE;
-		hallocAllocate(&slot,&count);
-		lseek(cache,data_offset+NCACHE_ESIZE*slot,SEEK_SET);
-		wptr = wbuf = (char*)malloc(NCACHE_ESIZE*count);
+		cacheAllocate(&slot,&count);
+		if(!count) {
+			hallocEnd();
+			return False;
+		}
+		first = slot;
+		data = sptr;
+		size = count;
+		iptr = hdr = (cache_entry*)malloc(sizeof(cache_entry)*count);
 		len -= NCACHE_BSIZE*count;
 		while( count-- ) {
 			//syslog(LOG_ERR,"Count=%d, Slot=%ld",count,(unsigned long)slot);
-			iptr = (cache_entry*)wptr;
 			iptr->block 	= block;
-			iptr->dirty 	= DIRTY;
-			iptr->usecount	= hashUpdate(block,slot);
-			wptr += sizeof(cache_entry);
-			memcpy(wptr,sptr,NCACHE_BSIZE);
-			wptr += NCACHE_BSIZE;
+			iptr->dirty 	= state == USED ? USED : USED | (state & backendDirtyMask(block));
+			admitRecord(block);
+			iptr++;
 			sptr += NCACHE_BSIZE;
 			block++;
-			slot++;
 		}
-		size = wptr - wbuf;
-		if( write(cache,wbuf,size) != size) {
-			syslog(LOG_ALERT,"Write error, err=%d",errno);	
-			return False;									
-		}																
-		free(wbuf);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID,&t0);
+		indexUpdateRun(first,hdr,size);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID,&t1);
+		update_stats.nsecs += (t1.tv_sec-t0.tv_sec)*1000000000ULL+t1.tv_nsec-t0.tv_nsec;
+		if(!cacheWriteSlots(first,data,hdr,size)) {
+			free(hdr);
+			hallocEnd();
+			return False;
+		}
+		free(hdr);
 	}
 	hallocEnd();
 	return True;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheThrottle	- hold a write-back ack back while the cache is too dirty
+//
+//	Like the kernel's dirty_background_ratio / dirty_ratio. Past
+//	destage_ratio the destager is kicked (it stops waiting for blocks to
+//	age); from half way between that and dirty_limit writes are delayed
+//	in proportion to how far in they are, up to throttle_max at the limit.
+//	Called without cache_lock, the delay is per write.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void cacheThrottle(int len)
+{
+	double		ratio,start;
+	uint64_t	usecs = 0;
+	int			i;
+
+	ratio = cache_entries ? 100.0*cache_dirty/cache_entries : 0;
+	if( ratio >= destage_ratio ) {
+		destageKick();
+		reclaimKick();
+	}
+	start = (destage_ratio+dirty_limit)/2.0;
+	if( (ratio > start) && (dirty_limit > start) ) {
+		usecs = throttle_max*1000ULL;
+		if( ratio < dirty_limit ) usecs = usecs*(ratio-start)/(dirty_limit-start);
+		usleep(usecs);
+	}
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;(i<throttle_count) && strcmp(throttle_stats[i].name,cache_export.name);i++);
+	if( (i == throttle_count) && (throttle_count < MAX_EXPORTS) ) strcpy(throttle_stats[throttle_count++].name,cache_export.name);
+	if( i < throttle_count ) {
+		throttle_stats[i].writes++;
+		if( usecs ) throttle_stats[i].delayed++;
+		throttle_stats[i].usecs += usecs;
+		if( usecs > throttle_stats[i].max_usecs ) throttle_stats[i].max_usecs = usecs;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+//	throttleFallback - count a write that went round a full cache
+
+void throttleFallback()
+{
+	int i;
+
+	for(i=0;(i<throttle_count) && strcmp(throttle_stats[i].name,cache_export.name);i++);
+	if( i < throttle_count ) throttle_stats[i].fallback++;
+}
+
+int cacheWrite(uint64_t off, char* sptr, int len)
+{
+	struct timeval	start,end;
+	write_flight	w;
+	int				mode = cache_export.mode;
+	int				ok;
+	uint8_t			lag;
+	uint64_t		usecs;
+
+	if( mode == CACHE_WB ) cacheThrottle(len);
+	pthread_mutex_lock(&cache_lock);
+	gettimeofday(&start,NULL);
+	//
+	//	A write never fails just because the cache is full of dirty blocks,
+	//	it goes to the backend instead and any part that made it into the
+	//	cache is dropped again
+	//
+	switch(mode) {
+		case CACHE_WT:
+			writeBegin(&w,off/NCACHE_BSIZE,len/NCACHE_BSIZE);
+			pthread_mutex_unlock(&cache_lock);
+			ok = backendWrite(off,sptr,len,&lag);
+			pthread_mutex_lock(&cache_lock);
+			writeEnd(&w);
+			//
+			//	The backend has the new data whatever happens here, so if
+			//	it didn't all make it into the cache none of it may stay
+			//
+			if( ok && !cacheStore(off,sptr,len,USED|lag) ) {
+				cacheInvalidate(off/NCACHE_BSIZE,len/NCACHE_BSIZE);
+				if( (ok = cache_full) ) throttleFallback();
+			}
+			break;
+		case CACHE_WA:
+			ok = cacheWriteAround(off,sptr,len);
+			break;
+		default:
+			writeWait(off/NCACHE_BSIZE,len/NCACHE_BSIZE);
+			if( !(ok = cacheStore(off,sptr,len,DIRTY)) && cache_full ) {
+				ok = cacheWriteAround(off,sptr,len);
+				throttleFallback();
+			}
+	}
+	gettimeofday(&end,NULL);
+	usecs = (end.tv_sec-start.tv_sec)*1000000ULL+end.tv_usec-start.tv_usec;
+	mode_stats[mode].writes++;
+	mode_stats[mode].bytes += len;
+	if(mode != CACHE_WA) mode_stats[mode].ssd_bytes += len;
+	mode_stats[mode].usecs += usecs;
+	if(usecs > mode_stats[mode].max_usecs) mode_stats[mode].max_usecs = usecs;
+	pthread_mutex_unlock(&cache_lock);
+	return ok;
+}
 	
 	
 /*			
@@ -867,64 +2181,147 @@ int cacheList()
 		printf("+----------+----------+----+--------+\n");	
 		return True;
 	}
+	int cacheListPage(hash_entry* entry,void* arg)
+	{
+		printf("| %8lld | %8lld | %2d | %6d |\n",
+			   (unsigned long long)entry->slot,
+			   (unsigned long long)entry->block,
+			   entry->dirty, entry->usecount);
+		return True;
+	}
 	syslog(LOG_INFO,"CACHE LISTING");
-	return cacheListHash(hash_index,"Used") && cacheListHash(hash_dirty,"Dirty");	
+	if(header.paged) {
+		printf("Paged index entries ...\n");
+		printf("+----------+----------+----+--------+\n");
+		printf("| %8s | %8s | %2s | %-6s |\n","Slot","Block","Fl","UseCnt");
+		printf("+----------+----------+----+--------+\n");
+		pindexWalk(cacheListPage,NULL);
+		printf("+----------+----------+----+--------+\n");
+		return True;
+	}
+	if(cache_extents) {
+		printf("Extent index entries ...\n");
+		printf("+----------+----------+----+--------+\n");
+		printf("| %8s | %8s | %2s | %-6s |\n","Slot","Block","Fl","UseCnt");
+		printf("+----------+----------+----+--------+\n");
+		extentWalk(cacheListPage,NULL);
+		printf("+----------+----------+----+--------+\n");
+		return True;
+	}
+	return cacheListHash(hash_used,"Used") && cacheListHash(hash_dirty,"Dirty");	
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-//	cacheFlush - mark a dirty block as flushed
+//	cacheFlush - mark a dirty block as flushed to host (1 based)
+//	cacheClean - the same, for the copy of the block we destaged
+//
+//	"slot" and "usecount" are what the block looked like when its data was
+//	read for destage. If it has been rewritten since, it stays dirty and
+//	the newer copy goes out next time round. Called with cache_lock held.
 //
 ///////////////////////////////////////////////////////////////////////////////
 
 int cacheFlush(uint64_t block,int host)
 {
-	/*
-	hash_entry* entry;
-	key.data = &block;
-	key.size = sizeof(block);
-	uint8_t mask = 254;
-	
+	hash_entry	entry;
+	int			ok;
+
+	pthread_mutex_lock(&cache_lock);
+	ok = indexGet(block,&entry) && cacheClean(block,host,entry.slot,entry.usecount);
+	pthread_mutex_unlock(&cache_lock);
+	if(!ok) syslog(LOG_ERR,"Attempt to flush uncached or clean block [%lld]",(unsigned long long)block);
+	return ok;
+}
+
+int cacheClean(uint64_t block,int host,uint32_t slot,uint32_t usecount)
+{
+	hash_entry	entry;
+	cache_entry	index;
+	cache_meta	meta;
+	uint8_t		was;
+
 	if((host<1)||(host>header.hcount)) {
 		syslog(LOG_ERR,"Invalid host number (%d) in flush",host);
 		return False;
 	}
-	if( hash_dirty->get(hash_dirty,NULL,&key,&val,0) !=0 ) {
-		syslog(LOG_ERR,"Attempt to flush uncached block [%lld]",(unsigned long long)block);
-		return False;
-	}
-	entry = (hash_entry*)(val.data);
+	if(!indexGet(block,&entry)) return False;
+	if( (entry.slot != slot) || (entry.usecount != usecount) || (entry.dirty == USED) ) return False;
+	was = entry.dirty;
+	entry.dirty &= ~(1<<host);
+	if(!indexPut(&entry,was)) return False;
+	if(entry.dirty != USED) return True;
 	//
-	while( host-- ) {
-		mask = mask << 1;
-		mask += 1;
-	}
-	entry->dirty = entry->dirty & mask;
+	//	Clean on every host, it can be evicted now; update the slot header
+	//	so a re-index after a crash doesn't destage it again. Not with the
+	//	log layout, which never writes in place; destaging it twice after
+	//	a crash does no harm.
 	//
-	if(entry->dirty == USED) {
-		if( hash_dirty->del(hash_dirty,NULL,&key,0) != 0 ) {
-			syslog(LOG_ALERT,"Error removing block to dirty list");
-			return False;
-		}
-		if( hash_used->put(hash_used,NULL,&key,&val,0) !=0) {
-			syslog(LOG_ALERT,"Error moving block to used list");
-			return False;
+	evictInsert(block,slot);
+	if(log_running) return True;
+	if( header.version >= CACHE_VERSION ) {
+		memset(&meta,0,sizeof(meta));
+		meta.block		= block;
+		meta.dirty		= USED;
+		meta.usecount	= entry.usecount;
+		slot_stats.meta_writes++;
+		return logWriteAt(cache,header.meta_offset+(uint64_t)slot*sizeof(cache_meta),&meta,sizeof(meta));
+	}
+	index.block		= block;
+	index.dirty		= USED;
+	index.usecount	= entry.usecount;
+	return logWrite(slot,&index,sizeof(index));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	cacheDirtyWalk	- call fn for every dirty block
+//	cacheDirtyRatio	- percentage of the cache that's dirty
+//
+//	Called with cache_lock, which is let go every DIRTY_WALK_BATCH entries
+//	so foreground requests aren't held up behind the whole index. BDB
+//	keeps the cursor in place across changes made meanwhile, but what fn
+//	is handed may be out of date by the time the caller acts on it.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define DIRTY_WALK_BATCH	4096		// entries looked at per cache_lock
+
+int cacheDirtyWalk(int (*fn)(hash_entry*,void*),void* arg)
+{
+	uint32_t seen = 0;
+
+	int dirtyPage(hash_entry* entry,void* arg)
+	{
+		int ret = entry->dirty == USED ? True : fn(entry,arg);
+
+		if( ret && !(++seen % DIRTY_WALK_BATCH) ) {
+			pthread_mutex_unlock(&cache_lock);
+			sched_yield();
+			pthread_mutex_lock(&cache_lock);
 		}
-		// Update on disk !!
-		cache_entry index;
-		index.block = block;
-		index.dirty = USED;
-		index.usecount = entry->usecount;
-		SEEK_BLOCK(entry->slot,"WRITE");
-		WRITE_INDEX(entry->slot,&index);
-		return True;
+		return ret;
 	}
-	if( hash_dirty->put(hash_dirty,NULL,&key,&val,0) !=0) {
-		syslog(LOG_ALERT,"Error updating dirty flag");
+	DBC		*cursor;
+	DBT		k,v;
+	int		ret = True;
+
+	if(header.paged) return pindexWalk(dirtyPage,arg);
+	if(cache_extents) return extentWalk(dirtyPage,arg);
+	if( hash_dirty->cursor(hash_dirty,NULL,&cursor,0) != 0) {
+		syslog(LOG_ALERT,"Unable to create cursor in cacheDirtyWalk");
 		return False;
 	}
-	*/
-	return True;
+	memset(&k,0,sizeof(k));
+	memset(&v,0,sizeof(v));
+	while( ret && (cursor->c_get(cursor,&k,&v,DB_NEXT) == 0) ) ret = dirtyPage((hash_entry*)v.data,arg);
+	cursor->c_close(cursor);
+	return ret;
+}
+
+int cacheDirtyRatio()
+{
+	return cache_entries ? (int)(cache_dirty*100/cache_entries) : 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -940,10 +2337,19 @@ int cacheReIndex()
 	int 			count,i,size;
 	uint32_t		slot=0;
 	cache_entry*	index = (cache_entry*)buffer;
-	DB*				db;
+	cache_entry*	table = NULL;
 	int				used = 0,dirty = 0;
 	
-	DATA_SEEK(0,"REBUILD");
+	if(header.paged && !pindexClear()) return False;
+	//
+	//	v2 keeps every slot's header in the metadata region, so there's
+	//	no need to walk the data
+	//
+	if( header.version >= CACHE_VERSION ) {
+		if(!(table = cacheReadTable())) return False;
+	} else {
+		DATA_SEEK(0,"REBUILD");
+	}
 
 	printf("Rebuilding Index for Cache Device (%lldM)\n",(unsigned long long)(cache_device.size/1024/1024));
 	printf("["); for(i=0;i<40;i++) printf(" "); printf("]\r\%c[C",27);
@@ -951,7 +2357,8 @@ int cacheReIndex()
 	count=0;
 	while( slot < cache_entries )
 	{
-		if( read(cache,&buffer,sizeof(buffer)) != sizeof(buffer)) {
+		if(table) index = &table[slot];
+		else if( read(cache,&buffer,sizeof(buffer)) != sizeof(buffer)) {
 			printf("\nRead Error, errno=%d\n",errno);
 			return False;
 		}
@@ -968,10 +2375,11 @@ int cacheReIndex()
 
 		switch(index->dirty) {
 			case USED:
-				db = hash_used; used++;
+				used++;
+				evictInsert(index->block,slot);
 				break;
 			default:
-				db = hash_dirty; dirty++;
+				dirty++;
 				break;
 		}
 		hash_entry entry;
@@ -979,18 +2387,15 @@ int cacheReIndex()
 		entry.block 	= index->block;
 		entry.dirty 	= index->dirty;
 		entry.usecount	= index->usecount;
+		entry.dtime		= 0;
 			
-		val.data = &entry;
-		val.size = sizeof(hash_entry);
-		key.data = &entry.block;
-		key.size = sizeof(entry.block);
-			
-		if(db->put(db,NULL,&key,&val,0) !=0) {
+		if(!indexPut(&entry,FREE)) {
 			syslog(LOG_ALERT,"Unable to insert entry into HASH");
 			return False;
 		}		
 		slot++;
 	}
+	free(table);
 	printf("\nOk\n");
 	syslog(LOG_INFO,"Loaded %d used, %d dirty, free list size = %ld",used,dirty,freeq_next-freeq);	
 	return True;
@@ -998,42 +2403,54 @@ int cacheReIndex()
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-//	cacheExpire	- Expire entries based on LRU
+//	cacheReclaim	- evict up to "units" clean blocks, returns how many
+//	cacheExpire		- Expire clean entries chosen by the eviction policy
+//
+//	Victims are sorted by slot before they're freed, so runs of adjacent
+//	slots are coalesced by hallocFree into extents the allocator can hand
+//	out whole.
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-int cacheExpire(int units)
+typedef struct reclaim_victim {
+
+	uint64_t	block;
+	uint32_t	slot;
+
+} reclaim_victim;
+
+int reclaimCompare(const void* a,const void* b)
 {
-	DBC *cursor;
-	uint32_t slots[100];
-	uint32_t next_slot=0;
-	hash_entry* entry;
-	int ret;
-	int count = units;
+	uint32_t x = ((reclaim_victim*)a)->slot,y = ((reclaim_victim*)b)->slot;
+	return x < y ? -1 : x > y;
+}
 
-	if( hash_index->cursor(hash_index,NULL,&cursor,0) != 0) {
-		syslog(LOG_ALERT,"Unable to allocate Cursor!");
-		return False;
-	}
-	while( count-- ) {
-		if( (ret = cursor->c_get(cursor,&key,&val,DB_FIRST)) !=0 ) break;
-		entry = (hash_entry*)(val.data);
-		printf("Expiring %08lld - %08lld :: %d :: Use=%d\n",
-			   (unsigned long long)entry->slot,
-			   (unsigned long long)entry->block,
-			   entry->dirty, entry->usecount);
+int cacheReclaim(int units)
+{
+	reclaim_victim	*v = (reclaim_victim*)malloc(units*sizeof(reclaim_victim));
+	int				i,n = 0,count = 0;
 
-		*freeq_next++ = entry->slot;
-		key.data = &entry->block;
-		key.size = sizeof(entry->block);
-		if( (ret = hash_used->del(hash_used,NULL,&key,0)) !=0 ) {
-			syslog(LOG_ALERT,"Error expiring key from DB");
-			break;
+	while( (n < units) && evictVictim(&v[n].block,&v[n].slot) ) n++;
+	qsort(v,n,sizeof(reclaim_victim),reclaimCompare);
+	hallocBegin();
+	for(i=0;i<n;i++) {
+		if(!indexDel(v[i].block)) {
+			syslog(LOG_ALERT,"Error expiring block [%lld] from index",(unsigned long long)v[i].block);
+			continue;
 		}
-		free(val.data);
+		hallocFree(v[i].slot,v[i].block);
+		count++;
 	}
-	cursor->c_close(cursor);
-	if( !units && !ret) return True;
+	hallocEnd();
+	free(v);
+	return count;
+}
+
+int cacheExpire(int units)
+{
+	int count = cacheReclaim(units);
+
+	if( count == units ) return True;
 	syslog(LOG_ALERT,"Only able to expire %d blocks (of %d)",count,units);
 	return False;
 }
@@ -1130,8 +2547,126 @@ void cacheStats()
 		printf("Pages on F/List ... %ld\n",(unsigned long)stats->bt_free);
 	}
 	
-	hash_stats(hash_used,"USED");
-	hash_stats(hash_dirty,"DIRTY");
-	btree_stats(hash_index,"- LFU -");
+	pthread_mutex_lock(&cache_lock);
+	slotStats();
+	updateStats();
+	evictStats();
+	admitStats();
+	modeStats();
+	throttleStats();
+	reclaimStats();
+	hallocStats();
+	logStats();
+	missStats();
+	bypassStats();
+	destageStats();
+	backendStats();
+	resyncStats();
+	govStats();
+	if(header.paged) pindexStats();
+	else if(cache_extents) extentStats();
+	else {
+		hash_stats(hash_used,"USED");
+		hash_stats(hash_dirty,"DIRTY");
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+//	reclaimThread	- keep free slots between reclaim_low and reclaim_high
+//	reclaimKick		- free space is getting low, don't wait for the tick
+//	reclaimStart	- start the reclaimer
+//	reclaimStop		- stop it
+//
+//	Works in batches of RECLAIM_BATCH, letting go of cache_lock between
+//	them. If there's nothing clean to evict it waits for the destager.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void* reclaimThread(void* arg)
+{
+	struct timespec	ts;
+	struct timeval	start,end;
+	uint64_t		low,high;
+	int				n,below = False;
+
+	pthread_mutex_lock(&cache_lock);
+	while( reclaim_running ) {
+		low = reclaim_low*cache_entries/100;
+		high = reclaim_high*cache_entries/100;
+		if( hallocAvailable() >= low ) {
+			below = False;
+			clock_gettime(CLOCK_REALTIME,&ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&reclaim_cond,&cache_lock,&ts);
+			continue;
+		}
+		if( !below ) reclaim_stats.lows++;
+		below = True;
+		gettimeofday(&start,NULL);
+		n = 1;
+		while( reclaim_running && n && (hallocAvailable() < high) ) {
+			n = cacheReclaim(high-hallocAvailable() < RECLAIM_BATCH ? high-hallocAvailable() : RECLAIM_BATCH);
+			reclaim_stats.blocks += n;
+			pthread_mutex_unlock(&cache_lock);
+			sched_yield();					// the mutex isn't fair, let the queue in
+			pthread_mutex_lock(&cache_lock);
+		}
+		gettimeofday(&end,NULL);
+		reclaim_stats.runs++;
+		reclaim_stats.usecs += (end.tv_sec-start.tv_sec)*1000000ULL+end.tv_usec-start.tv_usec;
+		if( hallocAvailable() >= high ) {
+			reclaim_stats.highs++;
+			below = False;
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME,&ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&reclaim_cond,&cache_lock,&ts);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+void reclaimKick()
+{
+	pthread_cond_signal(&reclaim_cond);
+}
+
+int reclaimStart()
+{
+	if(reclaim_running) return True;
+	if( reclaim_high <= reclaim_low ) reclaim_high = reclaim_low+1;
+	reclaim_running = True;
+	if( pthread_create(&reclaim_thread,NULL,reclaimThread,NULL) != 0 ) {
+		syslog(LOG_ALERT,"Error creating reclaim thread, err=%d",errno);
+		reclaim_running = False;
+		return False;
+	}
+	syslog(LOG_INFO,"Reclaim started, keeping %d%% to %d%% of the cache free",reclaim_low,reclaim_high);
+	return True;
+}
+
+void reclaimStop()
+{
+	if(!reclaim_running) return;
+	pthread_mutex_lock(&cache_lock);
+	reclaim_running = False;
+	pthread_cond_broadcast(&reclaim_cond);
+	pthread_mutex_unlock(&cache_lock);
+	pthread_join(reclaim_thread,NULL);
+}
 
-}
\ No newline at end of file
+void reclaimStats()
+{
+	syslog(LOG_INFO,"RECLAIM STATS");
+	syslog(LOG_INFO,"Free %lld slots (%.1f%%), watermarks %d%% / %d%%, fell below low %lld, back to high %lld",
+		   (unsigned long long)hallocAvailable(),cache_entries ? 100.0*hallocAvailable()/cache_entries : 0.0,
+		   reclaim_low,reclaim_high,(unsigned long long)reclaim_stats.lows,(unsigned long long)reclaim_stats.highs);
+	syslog(LOG_INFO,"Runs %lld, blocks %lld (%lldMB), %.1fMB/s, writes that evicted for themselves %lld",
+		   (unsigned long long)reclaim_stats.runs,(unsigned long long)reclaim_stats.blocks,
+		   (unsigned long long)reclaim_stats.blocks*NCACHE_BSIZE>>20,
+		   reclaim_stats.usecs ? (double)reclaim_stats.blocks*NCACHE_BSIZE/reclaim_stats.usecs : 0.0,
+		   (unsigned long long)reclaim_stats.stalls);
+}
@@ -0,0 +1,375 @@
+/*
+ *      nbd-destage.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Background destage of dirty cache blocks to the backend hosts.
+ *
+ *	Each host gets its own small pool of threads. When a host's queue is
+ *	empty (and nothing is in flight for it) one of its threads scans the
+ *	dirty index for blocks that host hasn't seen, sorts them by offset and
+ *	cuts them into runs of contiguous blocks, each sent as one write. On
+ *	ack the host's bit is cleared, and once every host has a block it
+ *	becomes clean and can be evicted.
+ *
+ *	Blocks are left alone until they've not been written for destage_delay
+ *	seconds (flashcache's fallow_delay), unless more than destage_ratio
+ *	percent of the cache is dirty. A scan that finds nothing old enough
+ *	notes when the oldest block it passed over will be, and the host isn't
+ *	scanned again until then (or destageKick). Everything except the
+ *	backend write itself runs under cache_lock, though the scan lets it go
+ *	now and then (see cacheDirtyWalk). Each run goes through the governor
+ *	(nbd-governor.c) before it's read back from the cache.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "nbd.h"
+
+#define DESTAGE_RUN		64		// most blocks in one backend write (256K)
+#define DESTAGE_SCAN	16384	// most blocks queued by one scan
+#define DESTAGE_THREADS	8		// most threads per host
+
+typedef struct destage_run {
+
+	uint64_t	block;
+	uint32_t	count;
+	uint32_t	slot[DESTAGE_RUN];
+	uint32_t	usecount[DESTAGE_RUN];	// to spot blocks rewritten since the scan
+
+} destage_run;
+
+typedef struct destage_host {
+
+	int				host;			// 1 based, bit "host" in DIRTY
+	pthread_t		threads[DESTAGE_THREADS];
+	destage_run*	runs;			// queue from the last scan
+	int				nruns,next;
+	destage_run*	active[DESTAGE_THREADS];
+	int				inflight;
+	int				scanning;		// one thread at a time
+	uint32_t		due;			// don't scan again before this (time())
+	uint32_t		scanned;		// when we last did
+	uint32_t		kicks;			// destage_kicks as of then
+	uint64_t		scans,writes,blocks,usecs,failed;
+
+} destage_host;
+
+int				destage_threads = 2;	// per host
+int				destage_delay	= 300;	// seconds a block must be idle
+int				destage_ratio	= 20;	// dirty % above which age is ignored
+
+destage_host	destage_hosts[MAX_HOSTS];
+int				destage_count	= 0;
+int				destage_running	= False;
+uint64_t		destage_skipped	= 0;	// rewritten before the ack came back
+uint32_t		destage_kicks	= 0;	// bumped by destageKick
+pthread_cond_t	destage_cond	= PTHREAD_COND_INITIALIZER;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	destageScan	- queue up runs of dirty blocks for one host
+//	destageDue	- is it time for a host's next scan
+//
+//	A scan that queues nothing sets "due" to when the oldest block it
+//	skipped comes of age; anything dirtied since it started can't be due
+//	any sooner than a full destage_delay after that.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int destageCompare(const void* a,const void* b)
+{
+	uint64_t x = ((hash_entry*)a)->block,y = ((hash_entry*)b)->block;
+	return x < y ? -1 : x > y;
+}
+
+int destageScan(destage_host* h)
+{
+	hash_entry		*list;
+	destage_run		*r = NULL;
+	uint8_t			bit = 1<<h->host;
+	uint32_t		now = time(NULL);
+	uint32_t		oldest = now;
+	int				pressure = cacheDirtyRatio() >= destage_ratio;
+	int				n = 0,i;
+
+	int pick(hash_entry* e,void* arg)
+	{
+		if( !(e->dirty & bit) ) return True;
+		if( !pressure && ((e->dtime > now) || (now - e->dtime < destage_delay)) ) {
+			if( e->dtime < oldest ) oldest = e->dtime;
+			return True;
+		}
+		list[n++] = *e;
+		return n < DESTAGE_SCAN;
+	}
+
+	free(h->runs);
+	h->runs = NULL;
+	h->nruns = h->next = 0;
+	h->scanned = now;
+	h->kicks = destage_kicks;
+	h->due = now+destage_delay;
+	if(!cache_dirty) return False;
+	list = (hash_entry*)malloc(DESTAGE_SCAN*sizeof(hash_entry));
+	h->scanning = True;
+	cacheDirtyWalk(pick,NULL);
+	h->scanning = False;
+	h->scans++;
+	if(!n) {
+		h->due = pressure ? now+1 : oldest+destage_delay;
+		free(list);
+		return False;
+	}
+	h->due = 0;
+	qsort(list,n,sizeof(hash_entry),destageCompare);
+	h->runs = (destage_run*)malloc(n*sizeof(destage_run));
+	for(i=0;i<n;i++) {
+		if( !r || (r->count == DESTAGE_RUN) || (list[i].block != r->block+r->count) ) {
+			r = &h->runs[h->nruns++];
+			r->block = list[i].block;
+			r->count = 0;
+		}
+		r->slot[r->count] = list[i].slot;
+		r->usecount[r->count++] = list[i].usecount;
+	}
+	free(list);
+	return True;
+}
+
+int destageDue(destage_host* h,uint32_t now)
+{
+	if( h->inflight || h->scanning ) return False;
+	return (now >= h->due) || ((h->kicks != destage_kicks) && (now != h->scanned));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	destageLoad	- read a run's data back from the cache
+//
+//	Anything rewritten since the scan has a new slot (and a new usecount),
+//	so the run is cut short at the first block that's changed, or that a
+//	foreground write is sending to the backend right now. Leading changed
+//	blocks are skipped, the rest will be picked up next scan.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+char* destageLoad(destage_run* r)
+{
+	hash_entry	entry;
+	char		*buf;
+	uint32_t	i,n;
+
+	int fresh(uint32_t i)
+	{
+		return	indexGet(r->block+i,&entry) && (entry.slot == r->slot[i]) &&
+				(entry.usecount == r->usecount[i]) && !writeFind(r->block+i,1);
+	}
+
+	for(i=0;(i<r->count) && !fresh(i);i++) destage_skipped++;
+	if( i ) {
+		r->block += i;
+		r->count -= i;
+		memmove(r->slot,r->slot+i,r->count*sizeof(uint32_t));
+		memmove(r->usecount,r->usecount+i,r->count*sizeof(uint32_t));
+	}
+	for(i=1;(i<r->count) && fresh(i);i++);
+	r->count = i < r->count ? i : r->count;
+	if(!r->count) return NULL;
+
+	buf = (char*)valloc(r->count*NCACHE_BSIZE);
+	for(i=0;i<r->count;i+=n) {
+		for(n=1;(i+n<r->count) && (r->slot[i+n] == r->slot[i]+n);n++);
+		if(!cacheReadSlots(r->slot[i],buf+i*NCACHE_BSIZE,NULL,n)) {
+			free(buf);
+			return NULL;
+		}
+	}
+	return buf;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	destageThread	- worker, one of destage_threads per host
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void* destageThread(void* arg)
+{
+	destage_host	*h = (destage_host*)arg;
+	destage_run		run;
+	struct timespec	ts;
+	struct timeval	start,end;
+	uint32_t		now;
+	char			*buf;
+	int				i,me,ok;
+
+	pthread_mutex_lock(&cache_lock);
+	while( destage_running ) {
+		if( h->next == h->nruns ) {
+			now = time(NULL);
+			if( !destageDue(h,now) || !destageScan(h) ) {
+				clock_gettime(CLOCK_REALTIME,&ts);
+				if( h->inflight || h->scanning || (h->kicks != destage_kicks) || (h->due <= now) ) ts.tv_sec++;
+				else ts.tv_sec += h->due-now;
+				pthread_cond_timedwait(&destage_cond,&cache_lock,&ts);
+				continue;
+			}
+		}
+		run = h->runs[h->next++];
+		pthread_mutex_unlock(&cache_lock);
+		govEnter(GOV_DESTAGE,h->host-1,run.count*NCACHE_BSIZE);
+		pthread_mutex_lock(&cache_lock);
+		if(!(buf = destageLoad(&run))) {
+			govExit(GOV_DESTAGE,h->host-1,0);
+			continue;
+		}
+		for(me=0;h->active[me];me++);
+		h->active[me] = &run;
+		h->inflight++;
+		pthread_mutex_unlock(&cache_lock);
+
+		gettimeofday(&start,NULL);
+		ok = backendWriteHost(h->host-1,run.block*NCACHE_BSIZE,buf,run.count*NCACHE_BSIZE);
+		gettimeofday(&end,NULL);
+		govExit(GOV_DESTAGE,h->host-1,run.count*NCACHE_BSIZE);
+		free(buf);
+
+		pthread_mutex_lock(&cache_lock);
+		h->active[me] = NULL;
+		h->inflight--;
+		if(ok) {
+			h->writes++;
+			h->blocks += run.count;
+			h->usecs += (end.tv_sec-start.tv_sec)*1000000ULL+end.tv_usec-start.tv_usec;
+			for(i=0;i<run.count;i++)
+				if(!cacheClean(run.block+i,h->host,run.slot[i],run.usecount[i])) destage_skipped++;
+		} else {
+			h->failed++;
+			h->next = h->nruns;		// rescan once the host is back
+			h->due = time(NULL)+1;
+		}
+		pthread_cond_broadcast(&destage_cond);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	destageWait	- wait for any in-flight destage touching these blocks
+//
+//	Foreground writes that go straight to the backend must not be
+//	overtaken by an older copy of the same blocks. Called with cache_lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void destageWait(uint64_t block,uint32_t count)
+{
+	destage_run	*r;
+	int			h,i,busy;
+
+	do {
+		busy = False;
+		for(h=0;(h<destage_count) && !busy;h++) {
+			for(i=0;i<DESTAGE_THREADS;i++) {
+				r = destage_hosts[h].active[i];
+				if( r && (r->block < block+count) && (block < r->block+r->count) ) busy = True;
+			}
+		}
+		if(busy) pthread_cond_wait(&destage_cond,&cache_lock);
+	} while( busy );
+}
+
+//	destageKick - the cache is getting dirty, scan now rather than when due
+
+void destageKick()
+{
+	__sync_fetch_and_add(&destage_kicks,1);
+	pthread_cond_broadcast(&destage_cond);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	destageStart	- start the thread pools, one per backend host
+//	destageStop		- stop them, waits for in-flight writes
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int destageStart()
+{
+	destage_host	*h;
+	int				i,t;
+
+	if(destage_running) return True;
+	if( destage_threads > DESTAGE_THREADS ) destage_threads = DESTAGE_THREADS;
+	destage_running = True;
+	destage_count = backend_count;
+	for(i=0;i<destage_count;i++) {
+		h = &destage_hosts[i];
+		memset(h,0,sizeof(destage_host));
+		h->host = i+1;
+		for(t=0;t<destage_threads;t++) {
+			if( pthread_create(&h->threads[t],NULL,destageThread,h) != 0 ) {
+				syslog(LOG_ALERT,"Error creating destage thread, err=%d",errno);
+				destageStop();
+				return False;
+			}
+		}
+	}
+	syslog(LOG_INFO,"Destage started, %d hosts x %d threads, delay %ds, ratio %d%%",
+		   destage_count,destage_threads,destage_delay,destage_ratio);
+	return True;
+}
+
+void destageStop()
+{
+	int i,t;
+
+	if(!destage_running) return;
+	pthread_mutex_lock(&cache_lock);
+	destage_running = False;
+	pthread_cond_broadcast(&destage_cond);
+	pthread_mutex_unlock(&cache_lock);
+	for(i=0;i<destage_count;i++) {
+		for(t=0;t<destage_threads;t++)
+			if(destage_hosts[i].threads[t]) pthread_join(destage_hosts[i].threads[t],NULL);
+		free(destage_hosts[i].runs);
+		destage_hosts[i].runs = NULL;
+	}
+	syslog(LOG_INFO,"Destage stopped");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	destageStats	- log per host destage figures
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void destageStats()
+{
+	destage_host	*h;
+	int				i;
+
+	syslog(LOG_INFO,"DESTAGE STATS");
+	syslog(LOG_INFO,"Dirty blocks %lld (%d%%), delay %ds, ratio %d%%, skipped (rewritten) %lld",
+		   (unsigned long long)cache_dirty,cacheDirtyRatio(),destage_delay,destage_ratio,
+		   (unsigned long long)destage_skipped);
+	for(i=0;i<destage_count;i++) {
+		h = &destage_hosts[i];
+		syslog(LOG_INFO,"Host %d :: scans %lld, writes %lld, blocks %lld (%lldMB), avg %lldK/write, %lldus/write, failed %lld",
+			   h->host,(unsigned long long)h->scans,(unsigned long long)h->writes,
+			   (unsigned long long)h->blocks,(unsigned long long)h->blocks*NCACHE_BSIZE>>20,
+			   (unsigned long long)(h->writes ? h->blocks*NCACHE_BSIZE/1024/h->writes : 0),
+			   (unsigned long long)(h->writes ? h->usecs/h->writes : 0),
+			   (unsigned long long)h->failed);
+	}
+}
@@ -0,0 +1,685 @@
+/*
+ *      nbd-ec.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Reed-Solomon erasure coded volumes, k data + m parity shards.
+ *
+ *	Stripe units are laid out in rows of k data units, plus m parity units
+ *	worked out over GF(2^8) from a systematic Cauchy matrix, so any k of
+ *	the k+m units in a row will rebuild the rest. Shards rotate by one host
+ *	per row so the parity traffic is spread over every host.
+ *
+ *	Small writes update parity by delta (P' = P + c.(D ^ D')), which only
+ *	needs the old data and parity for the range being written. If a row's
+ *	write fails part way its parity can't be trusted, so the row is marked
+ *	suspect and its parity rebuilt from scratch on the next write to it.
+ *	Writes need every shard; reads go to the data shard and fall back to
+ *	rebuilding it from any k of the others.
+ *
+ *	The region multiply kernels use PSHUFB nibble tables (SSSE3 or AVX2)
+ *	when the CPU has them, with a table driven scalar fallback.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <immintrin.h>
+#include "nbd.h"
+
+#define EC_LOCKS	64		// row locks, hashed by row
+#define EC_SUSPECT	1024	// most rows awaiting a parity rebuild
+#define EC_ROW		MAX_HOSTS	// most pieces of one row in a write
+
+int				ec_k = 4;			// data shards
+int				ec_m = 0;			// parity shards, whatever hosts are left
+int				ec_n = 0;
+
+uint8_t			gf_exp[512];
+uint8_t			gf_log[256];
+uint8_t			gf_mul[256][256];
+uint8_t			gf_nib[256][2][16];	// low / high nibble products for PSHUFB
+uint8_t			ec_matrix[MAX_HOSTS*MAX_HOSTS];	// (k+m) x k, identity on top
+
+void			(*gf_muladd)(uint8_t,uint8_t*,uint8_t*,uint32_t);
+char*			gf_kernel = "scalar";
+
+int				ec_ready = False;
+pthread_mutex_t	ec_locks[EC_LOCKS];
+pthread_mutex_t	ec_slock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t		ec_suspect[EC_SUSPECT];
+int				ec_nsuspect = 0;
+
+struct {
+
+	uint64_t	reads;
+	uint64_t	degraded;		// pieces rebuilt from the other shards
+	uint64_t	writes;
+	uint64_t	full;			// whole rows, no reads needed
+	uint64_t	delta;			// read-modify-write of part of a row
+	uint64_t	rebuilt;		// suspect rows re-encoded in full
+	uint64_t	failed;
+
+} ec_stats;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	Galois field primitives, polynomial 0x11d
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void gfInit()
+{
+	int i,j,x = 1;
+
+	for(i=0;i<255;i++) {
+		gf_exp[i] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if( x & 0x100 ) x ^= 0x11d;
+	}
+	for(i=255;i<512;i++) gf_exp[i] = gf_exp[i-255];
+	for(i=0;i<256;i++)
+		for(j=0;j<256;j++)
+			gf_mul[i][j] = i && j ? gf_exp[gf_log[i]+gf_log[j]] : 0;
+	for(i=0;i<256;i++)
+		for(j=0;j<16;j++) {
+			gf_nib[i][0][j] = gf_mul[i][j];
+			gf_nib[i][1][j] = gf_mul[i][j<<4];
+		}
+}
+
+uint8_t gfInv(uint8_t a)
+{
+	return gf_exp[255-gf_log[a]];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	gfMulAdd	- dst ^= c.src over a region, one version per instruction set
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void gfMulAddScalar(uint8_t c,uint8_t* src,uint8_t* dst,uint32_t len)
+{
+	uint8_t		*t = gf_mul[c];
+	uint32_t	i;
+
+	if( !c ) return;
+	if( c == 1 ) {
+		for(i=0;i+8<=len;i+=8) *(uint64_t*)(dst+i) ^= *(uint64_t*)(src+i);
+		for(;i<len;i++) dst[i] ^= src[i];
+		return;
+	}
+	for(i=0;i<len;i++) dst[i] ^= t[src[i]];
+}
+
+__attribute__((target("ssse3")))
+void gfMulAddSSSE3(uint8_t c,uint8_t* src,uint8_t* dst,uint32_t len)
+{
+	__m128i		lo = _mm_loadu_si128((__m128i*)gf_nib[c][0]);
+	__m128i		hi = _mm_loadu_si128((__m128i*)gf_nib[c][1]);
+	__m128i		mask = _mm_set1_epi8(0x0f);
+	__m128i		s,l,h;
+	uint32_t	i;
+
+	if( !c ) return;
+	for(i=0;i+16<=len;i+=16) {
+		s = _mm_loadu_si128((__m128i*)(src+i));
+		l = _mm_shuffle_epi8(lo,_mm_and_si128(s,mask));
+		h = _mm_shuffle_epi8(hi,_mm_and_si128(_mm_srli_epi64(s,4),mask));
+		s = _mm_loadu_si128((__m128i*)(dst+i));
+		_mm_storeu_si128((__m128i*)(dst+i),_mm_xor_si128(s,_mm_xor_si128(l,h)));
+	}
+	gfMulAddScalar(c,src+i,dst+i,len-i);
+}
+
+__attribute__((target("avx2")))
+void gfMulAddAVX2(uint8_t c,uint8_t* src,uint8_t* dst,uint32_t len)
+{
+	__m256i		lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)gf_nib[c][0]));
+	__m256i		hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)gf_nib[c][1]));
+	__m256i		mask = _mm256_set1_epi8(0x0f);
+	__m256i		s,l,h;
+	uint32_t	i;
+
+	if( !c ) return;
+	for(i=0;i+32<=len;i+=32) {
+		s = _mm256_loadu_si256((__m256i*)(src+i));
+		l = _mm256_shuffle_epi8(lo,_mm256_and_si256(s,mask));
+		h = _mm256_shuffle_epi8(hi,_mm256_and_si256(_mm256_srli_epi64(s,4),mask));
+		s = _mm256_loadu_si256((__m256i*)(dst+i));
+		_mm256_storeu_si256((__m256i*)(dst+i),_mm256_xor_si256(s,_mm256_xor_si256(l,h)));
+	}
+	gfMulAddScalar(c,src+i,dst+i,len-i);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecInvert	- invert an n x n matrix over GF(2^8), False if singular
+//	ecEncode	- work out the m parity regions from k data regions
+//	ecDecode	- rebuild data shard "want" from k others ("have")
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ecInvert(uint8_t* a,uint8_t* inv,int n)
+{
+	uint8_t	t,c;
+	int		i,j,r;
+
+	memset(inv,0,n*n);
+	for(i=0;i<n;i++) inv[i*n+i] = 1;
+	for(i=0;i<n;i++) {
+		for(r=i;(r<n) && !a[r*n+i];r++);
+		if( r == n ) return False;
+		for(j=0;j<n;j++) {
+			t = a[i*n+j]; a[i*n+j] = a[r*n+j]; a[r*n+j] = t;
+			t = inv[i*n+j]; inv[i*n+j] = inv[r*n+j]; inv[r*n+j] = t;
+		}
+		c = gfInv(a[i*n+i]);
+		for(j=0;j<n;j++) {
+			a[i*n+j] = gf_mul[c][a[i*n+j]];
+			inv[i*n+j] = gf_mul[c][inv[i*n+j]];
+		}
+		for(r=0;r<n;r++) {
+			if( (r == i) || !(c = a[r*n+i]) ) continue;
+			for(j=0;j<n;j++) {
+				a[r*n+j] ^= gf_mul[c][a[i*n+j]];
+				inv[r*n+j] ^= gf_mul[c][inv[i*n+j]];
+			}
+		}
+	}
+	return True;
+}
+
+void ecEncode(uint8_t** data,uint8_t** parity,uint32_t len)
+{
+	int p,d;
+
+	for(p=0;p<ec_m;p++) {
+		memset(parity[p],0,len);
+		for(d=0;d<ec_k;d++) gf_muladd(ec_matrix[(ec_k+p)*ec_k+d],data[d],parity[p],len);
+	}
+}
+
+int ecDecode(int* have,uint8_t** src,int want,uint8_t* dst,uint32_t len)
+{
+	uint8_t	a[MAX_HOSTS*MAX_HOSTS],inv[MAX_HOSTS*MAX_HOSTS];
+	int		i;
+
+	for(i=0;i<ec_k;i++) memcpy(&a[i*ec_k],&ec_matrix[have[i]*ec_k],ec_k);
+	if( !ecInvert(a,inv,ec_k) ) return False;
+	memset(dst,0,len);
+	for(i=0;i<ec_k;i++) gf_muladd(inv[want*ec_k+i],src[i],dst,len);
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecInit	- tables, kernel and coding matrix for k data + m parity
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ecInit(int k,int m)
+{
+	int i,p,d;
+
+	if( (k < 1) || (m < 1) || (k+m > MAX_HOSTS) ) {
+		syslog(LOG_ALERT,"Can't erasure code %d+%d shards",k,m);
+		return False;
+	}
+	if( !ec_ready ) {
+		gfInit();
+		for(i=0;i<EC_LOCKS;i++) pthread_mutex_init(&ec_locks[i],NULL);
+		gf_muladd = gfMulAddScalar;
+		__builtin_cpu_init();
+		if( __builtin_cpu_supports("ssse3") ) {
+			gf_muladd = gfMulAddSSSE3;
+			gf_kernel = "ssse3";
+		}
+		if( __builtin_cpu_supports("avx2") ) {
+			gf_muladd = gfMulAddAVX2;
+			gf_kernel = "avx2";
+		}
+		ec_ready = True;
+	}
+	ec_k = k;
+	ec_m = m;
+	ec_n = k+m;
+	memset(ec_matrix,0,sizeof(ec_matrix));
+	for(d=0;d<k;d++) ec_matrix[d*k+d] = 1;
+	for(p=0;p<m;p++)
+		for(d=0;d<k;d++) ec_matrix[(k+p)*k+d] = gfInv((k+p)^d);	// Cauchy, 1/(x+y)
+	syslog(LOG_INFO,"Erasure coding %d+%d, %s kernel",k,m,gf_kernel);
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecHost		- host holding shard "shard" of a row
+//	ecSuspect	- is this row's parity suspect, optionally marking it so
+//	ecTrust		- the row has been re-encoded
+//	ecDirtyMask	- DIRTY bits for a block, just its data host
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ecHost(uint64_t row,int shard)
+{
+	return (shard+row)%ec_n;
+}
+
+int ecSuspect(uint64_t row,int set)
+{
+	int i,found = False;
+
+	pthread_mutex_lock(&ec_slock);
+	for(i=0;(i<ec_nsuspect) && !found;i++) found = ec_suspect[i] == row;
+	if( set && !found ) {
+		if( ec_nsuspect < EC_SUSPECT ) ec_suspect[ec_nsuspect++] = row;
+		else syslog(LOG_ALERT,"Too many suspect rows, row %lld parity may be stale",(unsigned long long)row);
+	}
+	pthread_mutex_unlock(&ec_slock);
+	return found;
+}
+
+void ecTrust(uint64_t row)
+{
+	int i;
+
+	pthread_mutex_lock(&ec_slock);
+	for(i=0;i<ec_nsuspect;i++)
+		if( ec_suspect[i] == row ) ec_suspect[i--] = ec_suspect[--ec_nsuspect];
+	pthread_mutex_unlock(&ec_slock);
+}
+
+uint8_t ecDirtyMask(uint64_t block)
+{
+	uint64_t unit = stripe_unit*1024ULL/NCACHE_BSIZE,u = block/unit;
+
+	return 1 | (1 << (ecHost(u/ec_k,u%ec_k)+1));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecWait		- wait for a batch of requests, True if they all worked
+//	ecRebuild	- rebuild part of a data shard from any k other shards
+//	ecFetch		- read part of a data shard, rebuilding it if need be
+//
+//	"hoff" is the offset on the host; every shard of a row lives at the
+//	same offset on its own host.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ecWait(backend_req** r,int* host,int n)
+{
+	int i,ok = True;
+
+	for(i=0;i<n;i++)
+		if( !backendWait(host[i],r[i]) ) ok = False;
+	return ok;
+}
+
+int ecRebuild(uint64_t row,int want,uint64_t hoff,uint32_t len,char* dst)
+{
+	backend_req	*r[MAX_HOSTS];
+	uint8_t		*buf[MAX_HOSTS],*src[MAX_HOSTS];
+	int			host[MAX_HOSTS],shard[MAX_HOSTS],have[MAX_HOSTS];
+	int			i,n,s = 0,got = 0,ok;
+
+	if( ecSuspect(row,False) )
+		syslog(LOG_ALERT,"Rebuilding from row %lld with suspect parity",(unsigned long long)row);
+	for(i=0;i<ec_n;i++) buf[i] = (uint8_t*)malloc(len);
+	while( got < ec_k ) {
+		//
+		//	Ask for as many shards as we're still short of, if any of
+		//	them fail go round again with the ones we've not tried
+		//
+		for(n=0;(got+n < ec_k) && (s < ec_n);s++) {
+			if( s == want ) continue;
+			shard[n] = s;
+			host[n] = ecHost(row,s);
+			r[n] = backendSubmit(host[n],NBD_READ,hoff,(char*)buf[s],len,NULL);
+			n++;
+		}
+		if( !n ) break;
+		for(i=0;i<n;i++) {
+			if( !backendWait(host[i],r[i]) ) continue;
+			have[got] = shard[i];
+			src[got++] = buf[shard[i]];
+		}
+	}
+	ok = (got == ec_k) && ecDecode(have,src,want,(uint8_t*)dst,len);
+	for(i=0;i<ec_n;i++) free(buf[i]);
+	pthread_mutex_lock(&ec_slock);
+	ec_stats.degraded++;
+	pthread_mutex_unlock(&ec_slock);
+	if( !ok ) syslog(LOG_ALERT,"Unable to rebuild row %lld shard %d, only %d shards",
+					 (unsigned long long)row,want,got);
+	return ok;
+}
+
+int ecFetch(uint64_t row,int shard,uint64_t hoff,uint32_t len,char* dst)
+{
+	return backendRequest(ecHost(row,shard),NBD_READ,hoff,dst,len) || ecRebuild(row,shard,hoff,len,dst);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecRead	- read a range of the volume, degraded if need be
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ecRead(uint64_t off,char* buf,uint32_t len)
+{
+	backend_chunk	*chunk;
+	backend_req		**r;
+	uint64_t		unit = stripe_unit*1024ULL;
+	int				*host;
+	int				i,n,ok = True;
+
+	n = backendChunks(off,len,&chunk);
+	r = (backend_req**)malloc(n*sizeof(backend_req*));
+	host = (int*)malloc(n*sizeof(int));
+	for(i=0;i<n;i++) {
+		host[i] = ecHost(chunk[i].hoff/unit,chunk[i].col);
+		r[i] = backendSubmit(host[i],NBD_READ,chunk[i].hoff,buf+chunk[i].boff,chunk[i].len,NULL);
+	}
+	for(i=0;i<n;i++)
+		if( !backendWait(host[i],r[i]) &&
+			!ecRebuild(chunk[i].hoff/unit,chunk[i].col,chunk[i].hoff,chunk[i].len,buf+chunk[i].boff) ) ok = False;
+	free(r);
+	free(host);
+	free(chunk);
+	pthread_mutex_lock(&ec_slock);
+	ec_stats.reads++;
+	pthread_mutex_unlock(&ec_slock);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecWriteRow	- write the pieces of one row, with its parity
+//
+//	A whole row is encoded straight from the new data. Otherwise the old
+//	data and parity for the range are read back and the parity patched
+//	with the difference, or for a suspect row every data unit is read and
+//	the parity re-encoded for the full unit.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ecWriteRow(uint64_t row,backend_chunk* chunk,int n,char* buf)
+{
+	uint64_t	unit = stripe_unit*1024ULL,base = row*unit;
+	uint32_t	lo = unit,hi = 0,plen,total = 0,at;
+	uint8_t		*parity[MAX_HOSTS],*data[MAX_HOSTS],*rowbuf = NULL,*old = NULL;
+	backend_req	*r[2*MAX_HOSTS+EC_ROW];
+	int			host[2*MAX_HOSTS+EC_ROW];
+	int			i,p,nr = 0,full = n == ec_k,suspect,ok = True;
+
+	for(i=0;i<n;i++) {
+		if( chunk[i].hoff-base < lo ) lo = chunk[i].hoff-base;
+		if( chunk[i].hoff-base+chunk[i].len > hi ) hi = chunk[i].hoff-base+chunk[i].len;
+		if( chunk[i].len != unit ) full = False;
+		total += chunk[i].len;
+	}
+	suspect = !full && ecSuspect(row,False);
+	if( full || suspect ) {
+		lo = 0;
+		hi = unit;
+	}
+	plen = hi-lo;
+	for(p=0;p<ec_m;p++) parity[p] = (uint8_t*)malloc(plen);
+
+	if( full ) {
+		for(i=0;i<n;i++) data[chunk[i].col] = (uint8_t*)buf+chunk[i].boff;
+		ecEncode(data,parity,unit);
+		pthread_mutex_lock(&ec_slock);
+		ec_stats.full++;
+		pthread_mutex_unlock(&ec_slock);
+	} else if( suspect ) {
+		rowbuf = (uint8_t*)malloc(ec_k*unit);
+		for(i=0;i<ec_k;i++) data[i] = rowbuf+i*unit;
+		for(i=0;(i<ec_k) && ok;i++) ok = ecFetch(row,i,base,unit,(char*)data[i]);
+		if( ok ) {
+			for(i=0;i<n;i++) memcpy(data[chunk[i].col]+chunk[i].hoff-base,buf+chunk[i].boff,chunk[i].len);
+			ecEncode(data,parity,unit);
+		}
+		pthread_mutex_lock(&ec_slock);
+		ec_stats.rebuilt++;
+		pthread_mutex_unlock(&ec_slock);
+	} else {
+		old = (uint8_t*)malloc(total);
+		for(p=0;p<ec_m;p++) {
+			host[nr] = ecHost(row,ec_k+p);
+			r[nr] = backendSubmit(host[nr],NBD_READ,base+lo,(char*)parity[p],plen,NULL);
+			nr++;
+		}
+		for(i=0,at=0;i<n;at+=chunk[i++].len) {
+			host[nr] = ecHost(row,chunk[i].col);
+			r[nr] = backendSubmit(host[nr],NBD_READ,chunk[i].hoff,(char*)old+at,chunk[i].len,NULL);
+			nr++;
+		}
+		for(i=0;i<ec_m;i++) if( !backendWait(host[i],r[i]) ) ok = False;
+		for(i=0,at=0;i<n;at+=chunk[i++].len)
+			if( !backendWait(host[ec_m+i],r[ec_m+i]) &&
+				!ecRebuild(row,chunk[i].col,chunk[i].hoff,chunk[i].len,(char*)old+at) ) ok = False;
+		//
+		//	old ^= new gives the change to the data, fold it into each parity
+		//
+		for(i=0,at=0;ok && (i<n);at+=chunk[i++].len) {
+			gf_muladd(1,(uint8_t*)buf+chunk[i].boff,old+at,chunk[i].len);
+			for(p=0;p<ec_m;p++)
+				gf_muladd(ec_matrix[(ec_k+p)*ec_k+chunk[i].col],old+at,parity[p]+chunk[i].hoff-base-lo,chunk[i].len);
+		}
+		pthread_mutex_lock(&ec_slock);
+		ec_stats.delta++;
+		pthread_mutex_unlock(&ec_slock);
+	}
+
+	nr = 0;
+	if( ok ) {
+		for(i=0;i<n;i++) {
+			host[nr] = ecHost(row,chunk[i].col);
+			r[nr] = backendSubmit(host[nr],NBD_WRITE,chunk[i].hoff,buf+chunk[i].boff,chunk[i].len,NULL);
+			nr++;
+		}
+		for(p=0;p<ec_m;p++) {
+			host[nr] = ecHost(row,ec_k+p);
+			r[nr] = backendSubmit(host[nr],NBD_WRITE,base+lo,(char*)parity[p],plen,NULL);
+			nr++;
+		}
+		ok = ecWait(r,host,nr);
+	}
+	if( !ok ) {
+		ecSuspect(row,True);
+		pthread_mutex_lock(&ec_slock);
+		ec_stats.failed++;
+		pthread_mutex_unlock(&ec_slock);
+	} else if( suspect ) ecTrust(row);
+	for(p=0;p<ec_m;p++) free(parity[p]);
+	free(rowbuf);
+	free(old);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecWrite		- write a range of the volume, row by row
+//	ecWriteHost	- write the parts of a range whose data lives on "host"
+//
+//	Rows are locked (hashed, in order) so two writers can't interleave a
+//	parity update on the same row.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ecWrite(uint64_t off,char* buf,uint32_t len)
+{
+	backend_chunk	*chunk;
+	uint64_t		unit = stripe_unit*1024ULL;
+	uint64_t		first,last;
+	uint8_t			locked[EC_LOCKS];
+	int				i,j,n,ok = True;
+
+	n = backendChunks(off,len,&chunk);
+	first = chunk[0].hoff/unit;
+	last = chunk[n-1].hoff/unit;
+	memset(locked,0,sizeof(locked));
+	for(i=0;(i<EC_LOCKS) && (first+i<=last);i++) locked[(first+i)%EC_LOCKS] = True;
+	for(i=0;i<EC_LOCKS;i++) if(locked[i]) pthread_mutex_lock(&ec_locks[i]);
+
+	for(i=0;i<n;i=j) {
+		for(j=i+1;(j<n) && (chunk[j].hoff/unit == chunk[i].hoff/unit);j++);
+		if( !ecWriteRow(chunk[i].hoff/unit,&chunk[i],j-i,buf) ) ok = False;
+	}
+	for(i=0;i<EC_LOCKS;i++) if(locked[i]) pthread_mutex_unlock(&ec_locks[i]);
+	free(chunk);
+	pthread_mutex_lock(&ec_slock);
+	ec_stats.writes++;
+	pthread_mutex_unlock(&ec_slock);
+	return ok;
+}
+
+int ecWriteHost(int host,uint64_t off,char* buf,uint32_t len)
+{
+	backend_chunk	*chunk;
+	uint64_t		unit = stripe_unit*1024ULL;
+	int				i,n,ok = True;
+
+	n = backendChunks(off,len,&chunk);
+	for(i=0;i<n;i++)
+		if( (ecHost(chunk[i].hoff/unit,chunk[i].col) == host) &&
+			!ecWrite(off+chunk[i].boff,buf+chunk[i].boff,chunk[i].len) ) ok = False;
+	free(chunk);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecResync	- work out what "host" should hold for a range of its space
+//
+//	Data shards are rebuilt from the others, parity is re-encoded from the
+//	data (read straight, never rebuilt, as that could use the stale copy
+//	we're replacing). Each row is locked against writers while we do it.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ecResync(int host,uint64_t hoff,char* buf,uint32_t len)
+{
+	uint64_t	unit = stripe_unit*1024ULL,row;
+	uint32_t	size,at = 0;
+	uint8_t		*data;
+	int			d,shard,ok = True;
+
+	data = (uint8_t*)malloc(unit);
+	while( ok && (at < len) ) {
+		row = (hoff+at)/unit;
+		size = unit-(hoff+at)%unit < len-at ? unit-(hoff+at)%unit : len-at;
+		shard = (host+ec_n-row%ec_n)%ec_n;
+		pthread_mutex_lock(&ec_locks[row%EC_LOCKS]);
+		if( shard < ec_k ) ok = ecRebuild(row,shard,hoff+at,size,buf+at);
+		else {
+			memset(buf+at,0,size);
+			for(d=0;ok && (d<ec_k);d++) {
+				ok = backendRequest(ecHost(row,d),NBD_READ,hoff+at,(char*)data,size);
+				if( ok ) gf_muladd(ec_matrix[shard*ec_k+d],data,(uint8_t*)buf+at,size);
+			}
+		}
+		pthread_mutex_unlock(&ec_locks[row%EC_LOCKS]);
+		at += size;
+	}
+	free(data);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecStats	- log erasure coding counters
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void ecStats()
+{
+	syslog(LOG_INFO,"EC STATS (%d+%d, %s)",ec_k,ec_m,gf_kernel);
+	syslog(LOG_INFO,"Reads %lld, degraded pieces %lld, writes %lld, failed %lld, suspect rows %d",
+		   (unsigned long long)ec_stats.reads,(unsigned long long)ec_stats.degraded,
+		   (unsigned long long)ec_stats.writes,(unsigned long long)ec_stats.failed,ec_nsuspect);
+	syslog(LOG_INFO,"Rows written whole %lld, by delta %lld, re-encoded %lld",
+		   (unsigned long long)ec_stats.full,(unsigned long long)ec_stats.delta,
+		   (unsigned long long)ec_stats.rebuilt);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	ecBench	- encode / decode speed of each kernel the CPU can run
+//
+//	Run from the command line, results go to stdout. Rates are data bytes
+//	(k x shard) per second on one core.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void ecBench(int k,int m)
+{
+	void		(*kernels[3])(uint8_t,uint8_t*,uint8_t*,uint32_t) = { gfMulAddScalar , gfMulAddSSSE3 , gfMulAddAVX2 };
+	char*		names[3] = { "scalar" , "ssse3" , "avx2" };
+	int			have_isa[3];
+	uint8_t		*data[MAX_HOSTS],*parity[MAX_HOSTS],*src[MAX_HOSTS],*out;
+	uint32_t	len = 1<<20;
+	int			have[MAX_HOSTS];
+	int			i,j,loops;
+	double		secs,enc,dec;
+	struct timeval t0,t1;
+
+	if( !ecInit(k,m) ) {
+		printf("Can't erasure code %d+%d\n",k,m);
+		return;
+	}
+	for(i=0;i<k;i++) {
+		data[i] = (uint8_t*)malloc(len);
+		for(j=0;j<len;j++) data[i][j] = rand();
+	}
+	for(i=0;i<m;i++) parity[i] = (uint8_t*)malloc(len);
+	out = (uint8_t*)malloc(len);
+	//
+	//	Lose data shard 0, rebuild it from the other data and parity 0
+	//
+	for(i=0;i<k-1;i++) {
+		have[i] = i+1;
+		src[i] = data[i+1];
+	}
+	have[k-1] = k;
+	src[k-1] = parity[0];
+
+	have_isa[0] = True;
+	have_isa[1] = __builtin_cpu_supports("ssse3");
+	have_isa[2] = __builtin_cpu_supports("avx2");
+	printf("Erasure coding %d+%d, %dK shards\n",k,m,len>>10);
+	for(i=0;i<3;i++) {
+		if( !have_isa[i] ) continue;
+		gf_muladd = kernels[i];
+		gettimeofday(&t0,NULL);
+		for(loops=0,secs=0;secs<1;loops++) {
+			ecEncode(data,parity,len);
+			gettimeofday(&t1,NULL);
+			secs = (t1.tv_sec-t0.tv_sec)+(t1.tv_usec-t0.tv_usec)/1e6;
+		}
+		enc = (double)loops*k*len/secs/1e9;
+		gettimeofday(&t0,NULL);
+		for(loops=0,secs=0;secs<1;loops++) {
+			ecDecode(have,src,0,out,len);
+			gettimeofday(&t1,NULL);
+			secs = (t1.tv_sec-t0.tv_sec)+(t1.tv_usec-t0.tv_usec)/1e6;
+		}
+		dec = (double)loops*k*len/secs/1e9;
+		printf("%-8s encode %6.2f GB/s, decode %6.2f GB/s, rebuild %s\n",names[i],enc,dec,
+			   memcmp(out,data[0],len) ? "WRONG" : "ok");
+	}
+	for(i=0;i<k;i++) free(data[i]);
+	for(i=0;i<m;i++) free(parity[i]);
+	free(out);
+}
@@ -0,0 +1,347 @@
+/*
+ *      nbd-evict.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Eviction engine for clean (USED) cache blocks, either ARC or 2Q.
+ *
+ *	Only clean blocks are tracked, dirty blocks can't be thrown away until
+ *	they have been flushed to every host. Everything is O(1) per access;
+ *	a node pool indexed by uint32_t, a chained hash on block number and
+ *	four doubly linked lists (T1/T2 resident, B1/B2 ghosts). 2Q uses T1 as
+ *	A1in, T2 as Am and B1 as A1out.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include "nbd.h"
+
+#define NIL 0xFFFFFFFF
+
+enum { L_NONE = 0, L_T1, L_T2, L_B1, L_B2, L_MAX };
+
+typedef struct evict_node {
+
+	uint64_t	block;
+	uint32_t	slot;
+	uint32_t	prev,next;	// list links
+	uint32_t	hnext;		// hash chain
+	uint8_t		list;
+
+} evict_node;
+
+typedef struct evict_list {
+
+	uint32_t	head,tail;	// head is MRU
+	uint32_t	size;
+
+} evict_list;
+
+int evict_policy = EVICT_ARC;
+char* evict_names[] = { "ARC" , "2Q" };
+
+struct {
+
+	evict_node*	nodes;
+	uint32_t*	buckets;
+	uint32_t	mask;
+	uint32_t	free;			// free node list
+	uint32_t	capacity;		// c, cache size in blocks
+	uint32_t	p;				// ARC target size for T1
+	evict_list	list[L_MAX];
+	time_t		start;
+
+} evict;
+
+struct {
+
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	ghost_hits;
+	uint64_t	inserts;
+	uint64_t	evictions;
+
+} evict_stats[2];
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	List and hash primitives
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void evictUnlink(uint32_t n)
+{
+	evict_node* node = &evict.nodes[n];
+	evict_list* list = &evict.list[node->list];
+
+	if(node->prev != NIL) evict.nodes[node->prev].next = node->next;
+	else list->head = node->next;
+	if(node->next != NIL) evict.nodes[node->next].prev = node->prev;
+	else list->tail = node->prev;
+	list->size--;
+	node->list = L_NONE;
+}
+
+void evictPush(uint32_t n,int l)
+{
+	evict_node* node = &evict.nodes[n];
+	evict_list* list = &evict.list[l];
+
+	if(node->list) evictUnlink(n);
+	node->list = l;
+	node->prev = NIL;
+	node->next = list->head;
+	if(list->head != NIL) evict.nodes[list->head].prev = n;
+	else list->tail = n;
+	list->head = n;
+	list->size++;
+}
+
+uint32_t evictFind(uint64_t block)
+{
+	uint32_t n = evict.buckets[block & evict.mask];
+	while( (n != NIL) && (evict.nodes[n].block != block) ) n = evict.nodes[n].hnext;
+	return n;
+}
+
+void evictRelease(uint32_t n)
+{
+	uint32_t *pp = &evict.buckets[evict.nodes[n].block & evict.mask];
+
+	while( *pp != n ) pp = &evict.nodes[*pp].hnext;
+	*pp = evict.nodes[n].hnext;
+	if(evict.nodes[n].list) evictUnlink(n);
+	evict.nodes[n].hnext = evict.free;
+	evict.free = n;
+}
+
+uint32_t evictNew(uint64_t block,uint32_t slot)
+{
+	uint32_t n = evict.free;
+
+	if( n == NIL ) {	// can't happen while the ghosts are trimmed
+		syslog(LOG_ALERT,"Eviction node pool exhausted");
+		return NIL;
+	}
+	evict.free = evict.nodes[n].hnext;
+	evict.nodes[n].block = block;
+	evict.nodes[n].slot  = slot;
+	evict.nodes[n].list  = L_NONE;
+	evict.nodes[n].hnext = evict.buckets[block & evict.mask];
+	evict.buckets[block & evict.mask] = n;
+	return n;
+}
+
+void evictTrim()
+{
+	uint32_t c = evict.capacity;
+
+	if( evict_policy == EVICT_2Q ) {
+		while( evict.list[L_B1].size > c/2 ) evictRelease(evict.list[L_B1].tail);
+		return;
+	}
+	while( (evict.list[L_T1].size+evict.list[L_B1].size > c) && evict.list[L_B1].size )
+		evictRelease(evict.list[L_B1].tail);
+	while( (evict.list[L_T1].size+evict.list[L_T2].size+evict.list[L_B1].size+evict.list[L_B2].size > 2*c) && evict.list[L_B2].size )
+		evictRelease(evict.list[L_B2].tail);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	evictInit	- size the engine for "capacity" cache blocks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int evictInit(uint32_t capacity)
+{
+	uint32_t i,nodes = 2*capacity+1,buckets = 1;
+
+	while( buckets < nodes ) buckets <<= 1;
+	memset(&evict,0,sizeof(evict));
+	memset(&evict_stats,0,sizeof(evict_stats));
+	evict.nodes		= (evict_node*)malloc(nodes*sizeof(evict_node));
+	evict.buckets	= (uint32_t*)malloc(buckets*sizeof(uint32_t));
+	if( !evict.nodes || !evict.buckets ) {
+		syslog(LOG_ALERT,"Unable to allocate eviction engine for %ld blocks",(unsigned long)capacity);
+		return False;
+	}
+	evict.capacity	= capacity;
+	evict.mask		= buckets-1;
+	evict.start		= time(NULL);
+	for(i=0;i<buckets;i++) evict.buckets[i] = NIL;
+	for(i=0;i<nodes;i++) evict.nodes[i].hnext = i+1 < nodes ? i+1 : NIL;
+	for(i=0;i<L_MAX;i++) evict.list[i].head = evict.list[i].tail = NIL;
+	evict.free = 0;
+	syslog(LOG_INFO,"Eviction policy %s, %ld blocks",evict_names[evict_policy],(unsigned long)capacity);
+	return True;
+}
+
+void evictClose()
+{
+	free(evict.nodes);
+	free(evict.buckets);
+	evict.nodes = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	evictInsert	- a block has become clean (USED) and may now be evicted
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void evictInsert(uint64_t block,uint32_t slot)
+{
+	uint32_t	n = evictFind(block);
+	uint32_t	b1,b2,d;
+
+	evict_stats[evict_policy].inserts++;
+	if( n == NIL ) {
+		if( (n = evictNew(block,slot)) == NIL ) return;
+		evictPush(n,L_T1);
+		evictTrim();
+		return;
+	}
+	evict.nodes[n].slot = slot;
+	b1 = evict.list[L_B1].size;
+	b2 = evict.list[L_B2].size;
+	switch(evict.nodes[n].list) {
+		case L_B1:
+			evict_stats[evict_policy].ghost_hits++;
+			if( evict_policy == EVICT_ARC ) {
+				d = b1 >= b2 ? 1 : b2/b1;
+				evict.p = evict.p+d > evict.capacity ? evict.capacity : evict.p+d;
+			}
+			break;
+		case L_B2:
+			evict_stats[evict_policy].ghost_hits++;
+			d = b2 >= b1 ? 1 : b1/b2;
+			evict.p = evict.p > d ? evict.p-d : 0;
+			break;
+		case L_T1:
+			if( evict_policy == EVICT_2Q ) return;
+	}
+	evictPush(n,L_T2);
+	evictTrim();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	evictAccess	- a clean block has been read from the cache
+//	evictMiss	- a read missed the cache altogether
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void evictAccess(uint64_t block)
+{
+	uint32_t n = evictFind(block);
+
+	if( (n == NIL) || (evict.nodes[n].list > L_T2) ) {
+		evict_stats[evict_policy].misses++;
+		return;
+	}
+	evict_stats[evict_policy].hits++;
+	if( (evict_policy == EVICT_2Q) && (evict.nodes[n].list == L_T1) ) return;
+	evictPush(n,L_T2);
+}
+
+void evictMiss(uint64_t block)
+{
+	evict_stats[evict_policy].misses++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	evictRemove	- a block has been dirtied or dropped, stop tracking it
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void evictRemove(uint64_t block)
+{
+	uint32_t n = evictFind(block);
+
+	if( (n != NIL) && (evict.nodes[n].list <= L_T2) ) evictRelease(n);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	evictVictim	- pick the next block to throw out, False if there isn't one
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int evictFrom()
+{
+	uint32_t t1 = evict.list[L_T1].size,t2 = evict.list[L_T2].size;
+
+	if( !t1 && !t2 ) return L_NONE;
+	if( evict_policy == EVICT_2Q )
+		return (t1 > evict.capacity/4) || !t2 ? L_T1 : L_T2;
+	return t1 && ((t1 > evict.p) || !t2) ? L_T1 : L_T2;
+}
+
+int evictVictim(uint64_t* block,uint32_t* slot)
+{
+	int			from = evictFrom();
+	uint32_t	n;
+
+	if( from == L_NONE ) return False;
+	n = evict.list[from].tail;
+	*block = evict.nodes[n].block;
+	*slot  = evict.nodes[n].slot;
+	if( (evict_policy == EVICT_2Q) && (from == L_T2) ) evictRelease(n);
+	else evictPush(n,from == L_T1 ? L_B1 : L_B2);
+	evictTrim();
+	evict_stats[evict_policy].evictions++;
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	evictPeek	- which block would evictVictim pick, without evicting it
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int evictPeek(uint64_t* block)
+{
+	int from = evictFrom();
+
+	if( from == L_NONE ) return False;
+	*block = evict.nodes[evict.list[from].tail].block;
+	return True;
+}
+
+uint32_t evictClean()
+{
+	return evict.list[L_T1].size+evict.list[L_T2].size;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	evictStats	- log hit ratio and eviction rate for each policy
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void evictStats()
+{
+	time_t	secs = time(NULL)-evict.start;
+	int		i;
+
+	syslog(LOG_INFO,"EVICT STATS (%s)",evict_names[evict_policy]);
+	syslog(LOG_INFO,"Resident %ld/%ld, ghosts %ld/%ld, p=%ld, capacity %ld",
+		   (unsigned long)evict.list[L_T1].size,(unsigned long)evict.list[L_T2].size,
+		   (unsigned long)evict.list[L_B1].size,(unsigned long)evict.list[L_B2].size,
+		   (unsigned long)evict.p,(unsigned long)evict.capacity);
+	for(i=0;i<2;i++) {
+		uint64_t total = evict_stats[i].hits+evict_stats[i].misses;
+		if(!total && !evict_stats[i].evictions) continue;
+		syslog(LOG_INFO,"%-3s :: hit ratio %.2f%% (%lld/%lld), ghost hits %lld, evictions %lld (%.1f/s)",
+			   evict_names[i],total ? 100.0*evict_stats[i].hits/total : 0.0,
+			   (unsigned long long)evict_stats[i].hits,(unsigned long long)total,
+			   (unsigned long long)evict_stats[i].ghost_hits,
+			   (unsigned long long)evict_stats[i].evictions,
+			   secs ? (double)evict_stats[i].evictions/secs : 0.0);
+	}
+}
@@ -0,0 +1,378 @@
+/*
+ *      nbd-extent.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Extent block index (optional, -E), in place of the two block hashes.
+ *
+ *	Writes and read fills mostly get runs of contiguous slots, so rather
+ *	than an entry per 4K block the index holds extents; a run of blocks in
+ *	a run of slots, all with the same state and usecount. They live in an
+ *	in-memory BTREE keyed on the first block, a lookup is a DB_SET_RANGE
+ *	and a step back. Storing a run carves it out of whatever it overlaps
+ *	(splitting extents that stick out either side) and then merges it with
+ *	the extents either side if they carry on where it leaves off.
+ *
+ *	The rest of the cache still sees per-block hash_entry's; extentGet
+ *	makes one up and extentWalk hands them out a block at a time.
+ *
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <db.h>
+#include "nbd.h"
+
+typedef struct cache_extent {
+
+	uint64_t	block;					// first block
+	uint32_t	count;					// blocks
+	uint32_t	slot;					// slot of the first block
+	uint32_t	usecount;
+	uint32_t	dtime;
+	uint8_t		dirty;
+
+} cache_extent;
+
+int			cache_extents = False;		// index extents rather than blocks
+DB*			extent_db;
+
+struct {
+
+	uint64_t	extents;				// in the index now
+	uint64_t	blocks;
+	uint64_t	runs;					// extentPut calls
+	uint64_t	run_blocks;				// blocks they stored
+	uint64_t	splits;
+	uint64_t	merges;
+	uint64_t	gets,puts,dels;			// BTREE operations
+
+} extent_stats;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	BTREE helpers
+//
+//	extentCompare	- order keys as block numbers, not bytes
+//	extentBefore	- the extent starting at or before "block"
+//	extentFrom		- the extent starting at or after "block"
+//	extentStore		- write an extent back (new or changed)
+//	extentRemove	- delete the extent starting at "block"
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int extentCompare(DB* db,const DBT* a,const DBT* b)
+{
+	uint64_t x = *(uint64_t*)a->data;
+	uint64_t y = *(uint64_t*)b->data;
+
+	return x < y ? -1 : x > y;
+}
+
+int extentSeek(uint64_t block,cache_extent* ext,int before)
+{
+	DBC	*cursor;
+	DBT	k,v;
+	int	ret;
+
+	memset(&k,0,sizeof(k));
+	memset(&v,0,sizeof(v));
+	k.data = &block;
+	k.size = sizeof(block);
+	extent_stats.gets++;
+	if( extent_db->cursor(extent_db,NULL,&cursor,0) != 0 ) {
+		syslog(LOG_ALERT,"Unable to create extent cursor");
+		return False;
+	}
+	ret = cursor->c_get(cursor,&k,&v,DB_SET_RANGE);
+	if( before && ((ret != 0) || (*(uint64_t*)k.data != block)) )
+		ret = cursor->c_get(cursor,&k,&v,DB_PREV);		// or the last one if SET_RANGE ran off the end
+	if( ret == 0 ) memcpy(ext,v.data,sizeof(cache_extent));
+	cursor->c_close(cursor);
+	return ret == 0;
+}
+
+int extentBefore(uint64_t block,cache_extent* ext)
+{
+	return extentSeek(block,ext,True);
+}
+
+int extentFrom(uint64_t block,cache_extent* ext)
+{
+	return extentSeek(block,ext,False);
+}
+
+int extentStore(cache_extent* ext)
+{
+	DBT k,v;
+
+	memset(&k,0,sizeof(k));
+	memset(&v,0,sizeof(v));
+	k.data = &ext->block;
+	k.size = sizeof(ext->block);
+	v.data = ext;
+	v.size = sizeof(cache_extent);
+	extent_stats.puts++;
+	if( extent_db->put(extent_db,NULL,&k,&v,0) != 0 ) {
+		syslog(LOG_ALERT,"ERR :: extentStore :: block [%lld]",(unsigned long long)ext->block);
+		return False;
+	}
+	return True;
+}
+
+int extentRemove(uint64_t block)
+{
+	DBT k;
+
+	memset(&k,0,sizeof(k));
+	k.data = &block;
+	k.size = sizeof(block);
+	extent_stats.dels++;
+	return extent_db->del(extent_db,NULL,&k,0) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	extentOpen	- create the (in-memory) BTREE
+//	extentClose	- and throw it away
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int extentOpen(uint64_t cachesize)
+{
+	if( db_create(&extent_db,NULL,0) != 0 ) {
+		syslog(LOG_ALERT,"Unable to create extent DB handle");
+		return False;
+	}
+	extent_db->set_bt_compare(extent_db,extentCompare);
+	extent_db->set_cachesize(extent_db,0,cachesize,0);
+	if( extent_db->open(extent_db,NULL,NULL,NULL,DB_BTREE,DB_CREATE,0777) != 0 ) {
+		syslog(LOG_ALERT,"Unable to open extent DB, err=%d",errno);
+		return False;
+	}
+	memset(&extent_stats,0,sizeof(extent_stats));
+	syslog(LOG_INFO,"Extent index, %.2fM of BDB cache",(double)cachesize/1024/1024);
+	return True;
+}
+
+void extentClose()
+{
+	if(!extent_db) return;
+	extent_db->close(extent_db,0);
+	extent_db = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	extentGet	- look up a block, made up into a hash_entry
+//	extentDel	- take "count" blocks out of the index
+//	extentPut	- "count" blocks from entry->block, in slots from entry->slot
+//	extentRange	- look up "count" blocks at once, found[i] if block+i is there
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int extentGet(uint64_t block,hash_entry* entry)
+{
+	cache_extent ext;
+
+	if( !extentBefore(block,&ext) || (block >= ext.block+ext.count) ) return False;
+	entry->block	= block;
+	entry->slot		= ext.slot+(uint32_t)(block-ext.block);
+	entry->usecount	= ext.usecount;
+	entry->dirty	= ext.dirty;
+	entry->dtime	= ext.dtime;
+	return True;
+}
+
+int extentDel(uint64_t block,uint32_t count)
+{
+	cache_extent	ext;
+	uint64_t		end = block+count,last;
+	int				ok = True;
+	//
+	//	extentTail - put back what's left of "ext" past the end of the range
+	//
+	int extentTail()
+	{
+		ext.slot	+= (uint32_t)(end-ext.block);
+		ext.block	 = end;
+		ext.count	 = last-end;
+		extent_stats.extents++;
+		extent_stats.splits++;
+		extent_stats.blocks += ext.count;
+		return extentStore(&ext);
+	}
+	//
+	//	Anything that covers "block" but starts before it keeps its front
+	//
+	if( extentBefore(block,&ext) && (ext.block < block) && (ext.block+ext.count > block) ) {
+		last = ext.block+ext.count;
+		ext.count = block-ext.block;
+		ok &= extentStore(&ext);
+		extent_stats.splits++;
+		extent_stats.blocks -= last-block;
+		if( last > end ) return ok & extentTail();
+	}
+	//
+	//	Then the ones that start inside the range go, keeping any tail
+	//
+	while( ok && extentFrom(block,&ext) && (ext.block < end) ) {
+		last = ext.block+ext.count;
+		ok &= extentRemove(ext.block);
+		extent_stats.extents--;
+		extent_stats.blocks -= ext.count;
+		if( last > end ) return ok & extentTail();
+	}
+	return ok;
+}
+
+int extentPut(hash_entry* entry,uint32_t count)
+{
+	int mergeable(cache_extent* a,cache_extent* b)
+	{
+		return	(a->block+a->count == b->block) && (a->slot+a->count == b->slot) &&
+				(a->dirty == b->dirty) && (a->usecount == b->usecount);
+	}
+	cache_extent	ext,left,right;
+
+	if(!extentDel(entry->block,count)) return False;
+	ext.block		= entry->block;
+	ext.count		= count;
+	ext.slot		= entry->slot;
+	ext.usecount	= entry->usecount;
+	ext.dirty		= entry->dirty;
+	ext.dtime		= entry->dtime;
+	extent_stats.runs++;
+	extent_stats.run_blocks += count;
+	extent_stats.blocks += count;
+	extent_stats.extents++;
+
+	if( ext.block && extentBefore(ext.block-1,&left) && mergeable(&left,&ext) ) {
+		left.count += ext.count;
+		if( ext.dtime > left.dtime ) left.dtime = ext.dtime;
+		ext = left;
+		extent_stats.extents--;
+		extent_stats.merges++;
+	}
+	if( extentFrom(ext.block+ext.count,&right) && mergeable(&ext,&right) ) {
+		if(!extentRemove(right.block)) return False;
+		ext.count += right.count;
+		if( right.dtime > ext.dtime ) ext.dtime = right.dtime;
+		extent_stats.extents--;
+		extent_stats.merges++;
+	}
+	return extentStore(&ext);
+}
+
+int extentRange(uint64_t block,uint32_t count,hash_entry* entry,uint8_t* found)
+{
+	DBC				*cursor;
+	DBT				k,v;
+	cache_extent	ext;
+	uint64_t		end = block+count,start = block,b;
+	int				ret;
+	//
+	//	extentFill - copy out the blocks of "ext" that are in the range
+	//
+	void extentFill()
+	{
+		for(b=ext.block > block ? ext.block : block;(b < ext.block+ext.count) && (b < end);b++) {
+			entry[b-block].block	= b;
+			entry[b-block].slot		= ext.slot+(uint32_t)(b-ext.block);
+			entry[b-block].usecount	= ext.usecount;
+			entry[b-block].dirty	= ext.dirty;
+			entry[b-block].dtime	= ext.dtime;
+			found[b-block]			= True;
+		}
+	}
+	//
+	memset(found,0,count);
+	if( extentBefore(block,&ext) && (ext.block+ext.count > block) ) {
+		extentFill();
+		start = ext.block+ext.count;
+	}
+	if( start >= end ) return True;
+	if( extent_db->cursor(extent_db,NULL,&cursor,0) != 0 ) {
+		syslog(LOG_ALERT,"Unable to create cursor in extentRange");
+		return False;
+	}
+	memset(&k,0,sizeof(k));
+	memset(&v,0,sizeof(v));
+	k.data = &start;
+	k.size = sizeof(start);
+	extent_stats.gets++;
+	ret = cursor->c_get(cursor,&k,&v,DB_SET_RANGE);
+	while( (ret == 0) && (*(uint64_t*)k.data < end) ) {
+		memcpy(&ext,v.data,sizeof(ext));
+		extentFill();
+		ret = cursor->c_get(cursor,&k,&v,DB_NEXT);
+	}
+	cursor->c_close(cursor);
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	extentWalk	- call "fn" for every block in the index, in block order
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int extentWalk(int (*fn)(hash_entry*,void*),void* arg)
+{
+	DBC				*cursor;
+	DBT				k,v;
+	cache_extent	ext;
+	hash_entry		entry;
+	uint32_t		i;
+	int				ret = True;
+
+	if( extent_db->cursor(extent_db,NULL,&cursor,0) != 0 ) {
+		syslog(LOG_ALERT,"Unable to create cursor in extentWalk");
+		return False;
+	}
+	memset(&k,0,sizeof(k));
+	memset(&v,0,sizeof(v));
+	while( ret && (cursor->c_get(cursor,&k,&v,DB_NEXT) == 0) ) {
+		memcpy(&ext,v.data,sizeof(ext));
+		entry.usecount	= ext.usecount;
+		entry.dirty		= ext.dirty;
+		entry.dtime		= ext.dtime;
+		for(i=0;ret && (i<ext.count);i++) {
+			entry.block	= ext.block+i;
+			entry.slot	= ext.slot+i;
+			ret = fn(&entry,arg);
+		}
+	}
+	cursor->c_close(cursor);
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	extentStats	- log the size of the index and what it cost to keep
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void extentStats()
+{
+	uint64_t mb = extent_stats.run_blocks*NCACHE_BSIZE/1024/1024;
+
+	syslog(LOG_INFO,"EXTENT STATS");
+	syslog(LOG_INFO,"Extents %lld for %lld blocks (%.1f/extent), %lldK of entries (%lldK as block entries)",
+		   (unsigned long long)extent_stats.extents,(unsigned long long)extent_stats.blocks,
+		   extent_stats.extents ? (double)extent_stats.blocks/extent_stats.extents : 0.0,
+		   (unsigned long long)(extent_stats.extents*(sizeof(uint64_t)+sizeof(cache_extent))/1024),
+		   (unsigned long long)(extent_stats.blocks*(sizeof(uint64_t)+sizeof(hash_entry))/1024));
+	syslog(LOG_INFO,"Stored %lld runs, %lld blocks (%.1f/run), %lld splits, %lld merges",
+		   (unsigned long long)extent_stats.runs,(unsigned long long)extent_stats.run_blocks,
+		   extent_stats.runs ? (double)extent_stats.run_blocks/extent_stats.runs : 0.0,
+		   (unsigned long long)extent_stats.splits,(unsigned long long)extent_stats.merges);
+	syslog(LOG_INFO,"BTREE gets %lld, puts %lld, dels %lld, %.1f operations per MB stored",
+		   (unsigned long long)extent_stats.gets,(unsigned long long)extent_stats.puts,
+		   (unsigned long long)extent_stats.dels,
+		   mb ? (double)(extent_stats.gets+extent_stats.puts+extent_stats.dels)/mb : 0.0);
+}
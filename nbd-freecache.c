@@ -1,119 +1,377 @@
+/*
+ *      nbd-freecache.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Free space manager for the cache slots.
+ *
+ *	A bitmap with a bit per slot (set = free) and two summary bitmaps
+ *	with a bit per bitmap word, one for words with any free slot and one
+ *	for words that are entirely free. Frees just set bits, so neighbours
+ *	coalesce by themselves and nothing is ever malloc'd per extent.
+ *
+ *	Allocation is next-fit from a hint (where the last allocation ended)
+ *	so the blocks of one request, and of a sequential stream, land next
+ *	to each other. Runs within a word are found 64 slots at a time with
+ *	shift-and, runs over many words from the summaries. If there's no run
+ *	as long as asked for we settle for the longest one the scan passed,
+ *	or look again for a shorter one, and the caller comes back for the
+ *	rest.
+ *
+ */
+
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
+#include <stdint.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include "nbd.h"
 
-#define MAX_CHUNK 256
+uint64_t	*hmap;				// a bit per slot, set if free
+uint64_t	*hany;				// a bit per hmap word, set if it has a free slot
+uint64_t	*hfull;				// a bit per hmap word, set if it's all free
+uint32_t	hslots,hwords;
+uint64_t	hfree;				// free slots
+uint32_t	hhint;				// next-fit, where to start looking
 
-typedef struct hallocEntry {
-	
-	uint32_t start;
-	struct hallocEntry *next;
-	
-} hallocEntry;
+#define HALLOC_WINDOW	1024		// words to look through before settling for less
 
-hallocEntry *hstore[MAX_CHUNK];
-uint32_t hstart,hlast,hentries;
-uint64_t hblock;
+struct {
 
-void hallocStats()
+	uint64_t		allocs;
+	uint64_t		slots;
+	uint64_t		partial;		// got less than asked for
+	uint64_t		failed;
+	uint64_t		frees;
+	uint64_t		nsecs,max_nsecs;
+	latency_hist	hist;			// allocation time, nsecs
+
+} halloc_stats;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	hallocSummary	- bring the summary bits for word "w" up to date
+//	hallocMark		- set (free) or clear (allocate) a run of slots
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void hallocSummary(uint32_t w)
 {
-	int i,j;
-	hallocEntry *p;
-	syslog(LOG_INFO,"HALLOC STATS");
-	for(i=0;i<MAX_CHUNK;i++) {
-		if(hstore[i]) {
-			p = hstore[i];
-			j=0;
-			while(p) { j++; p=p->next; }
-			
-			syslog(LOG_INFO,"%3d Blocks :: Start @ %8ld , %8d instances\n",
-				   i,(unsigned long)hstore[i]->start,j);
-		}
+	uint64_t bit = 1ULL << (w&63);
+
+	if( hmap[w] ) hany[w>>6] |= bit;
+	else hany[w>>6] &= ~bit;
+	if( hmap[w] == ~0ULL ) hfull[w>>6] |= bit;
+	else hfull[w>>6] &= ~bit;
+}
+
+void hallocMark(uint32_t slot,uint32_t count,int free)
+{
+	uint32_t	w,bits;
+	uint64_t	mask;
+
+	while( count ) {
+		w = slot>>6;
+		bits = 64-(slot&63) < count ? 64-(slot&63) : count;
+		mask = (bits == 64 ? ~0ULL : ((1ULL << bits)-1)) << (slot&63);
+		if( free ) hmap[w] |= mask;
+		else hmap[w] &= ~mask;
+		hallocSummary(w);
+		slot += bits;
+		count -= bits;
 	}
 }
 
-void hallocFlush(int i,uint32_t start)
+///////////////////////////////////////////////////////////////////////////////
+//
+//	hallocScan	- first run of "n" free slots in words [lo,hi), -1 if none
+//
+//	On a miss *best/*best_at are the longest run seen that crosses a word
+//	boundary, so the caller can take that rather than scanning again. Once
+//	*budget words have been looked at we give up as soon as we have one.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int64_t hallocScan(uint32_t lo,uint32_t hi,uint32_t n,uint32_t* best,uint32_t* best_at,uint32_t* budget)
 {
-	hallocEntry *entry = (hallocEntry*)malloc(sizeof(hallocEntry));
-	entry->start = start;
-	entry->next = !hstore[i]?NULL:hstore[i];
-	hstore[i] = entry;
+	uint64_t	x,y,bits;
+	uint32_t	w = lo,run = 0,start = 0,s,l,t;
+
+	while( w < hi ) {
+		if( *budget ) (*budget)--;
+		else if( *best ) return -1;
+		bits = hany[w>>6] >> (w&63);
+		if( !bits ) {				// nothing free in the rest of this summary word
+			run = 0;
+			w = (w|63)+1;
+			continue;
+		}
+		if( !(bits & 1) ) {
+			run = 0;
+			w += __builtin_ctzll(bits);
+			continue;
+		}
+		x = hmap[w];
+		if( x == ~0ULL ) {
+			if( !run ) start = w*64;
+			run += 64;
+			if( run >= n ) return start;
+			if( run > *best ) {
+				*best = run;
+				*best_at = start;
+			}
+			w++;
+			continue;
+		}
+		t = __builtin_ctzll(~x);		// free slots at the bottom carry on a run
+		if( run && (run+t >= n) ) return start;
+		if( run+t > *best ) {
+			*best = run+t;
+			*best_at = run ? start : w*64;
+		}
+		if( n <= 64 ) {
+			for(y=x,l=1;l<n;l+=s) {
+				s = l < n-l ? l : n-l;
+				y &= y >> s;
+			}
+			if( y ) return w*64+__builtin_ctzll(y);
+		}
+		run = __builtin_clzll(~x);		// and the ones at the top start one
+		start = w*64+64-run;
+		w++;
+	}
+	return -1;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//	hallocAllocate	- get a run of up to *count slots, *count = 0 if full
+//	hallocFree		- give a slot back
+//	hallocFreeList	- give "n" back, runs of consecutive slots marked together
+//	hallocAvailable	- free slots
+//	hallocBegin/End	- bracket a batch of frees (kept for the callers)
+//
+///////////////////////////////////////////////////////////////////////////////
+
 void hallocAllocate(uint32_t *slot,int *count)
 {
-	int i = *count;
-	hallocEntry *entry;
-	
-	//syslog(LOG_INFO,"halloc, requested %d",*count);	
-	assert(*count<MAX_CHUNK); // make sure we're not asking too much
-	while( !hstore[i] && (i<MAX_CHUNK)) i++;
-	if(i==MAX_CHUNK) while( !hstore[i] && (i>0)) i--;
-
-	if(!hstore[i]) { syslog(LOG_ALERT,"Ran out of cache"); assert(0); }
-	
-	entry = hstore[i];
-	hstore[i] = entry->next;
-	*slot = entry->start;
-	
-	if(*count>=i) *count = i;
-	else hallocFlush(i-*count,entry->start + *count);
-	free(entry);
-	//syslog(LOG_INFO,"halloc, split %ld, %d",(unsigned long)*slot,*count);	
+	struct timespec	t0,t1;
+	uint32_t		n = *count,hw,hi,best,best_at,budget;
+	int64_t			at = -1;
+	uint64_t		nsecs;
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	if( n > hfree ) n = hfree;
+	while( n && (at == -1) ) {
+		hw = hhint < hslots ? hhint>>6 : 0;
+		hi = hw+(n+63)/64+1 < hwords ? hw+(n+63)/64+1 : hwords;	// far enough to catch a run over the hint
+		best = 0;
+		budget = HALLOC_WINDOW;
+		if( ((at = hallocScan(hw,hwords,n,&best,&best_at,&budget)) == -1) && hw && (budget || !best) )
+			at = hallocScan(0,hi,n,&best,&best_at,&budget);
+		if( (at != -1) && (at+n > hslots) ) at = -1;	// ran into the tail of the last word
+		if( at != -1 ) break;
+		if( best && ((best >= 64) || (best >= n/2) || !budget) ) {	// settle for the longest we passed
+			at = best_at;
+			n = best;
+		} else n = n > 64 ? 64 : n/2;					// the rest are inside single words
+	}
+	if( at == -1 ) {
+		halloc_stats.failed++;
+		*count = 0;
+		return;
+	}
+	hallocMark(at,n,False);
+	hfree -= n;
+	hhint = at+n;
+	if( n < *count ) halloc_stats.partial++;
+	*slot = at;
+	*count = n;
+
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	nsecs = (t1.tv_sec-t0.tv_sec)*1000000000ULL+t1.tv_nsec-t0.tv_nsec;
+	halloc_stats.allocs++;
+	halloc_stats.slots += n;
+	halloc_stats.nsecs += nsecs;
+	if( nsecs > halloc_stats.max_nsecs ) halloc_stats.max_nsecs = nsecs;
+	latRecord(&halloc_stats.hist,nsecs);
 }
 
 void hallocFree(uint32_t slot,uint64_t block)
 {
-	if( (slot != hlast+1) || (hentries == MAX_CHUNK-1) ) {
-		if( hentries ) {
-			//hallocFlush(hentries,hstart);
-			syslog(LOG_INFO,"hallocFree, slot %ld, entries %ld, block %lld",
-				   (unsigned long)hstart,(unsigned long)hentries,
-				   (unsigned long long)hblock);
+	if( (slot >= hslots) || ((hmap[slot>>6] >> (slot&63)) & 1) ) {
+		syslog(LOG_ALERT,"Freeing slot %ld twice (block %lld)",(unsigned long)slot,(unsigned long long)block);
+		return;
+	}
+	hallocMark(slot,1,True);
+	hfree++;
+	halloc_stats.frees++;
+}
+
+void hallocFreeList(uint32_t* slots,uint64_t* blocks,int n)
+{
+	int i,j;
+
+	for(i=0;i<n;i=j) {
+		for(j=i+1;(j<n) && (slots[j] == slots[j-1]+1);j++);
+		if( (slots[i]+(uint64_t)(j-i) > hslots) || hallocCount(slots[i],j-i) ) {
+			for(;i<j;i++) hallocFree(slots[i],blocks[i]);		// let hallocFree complain
+			continue;
 		}
-		hstart = slot; hentries = 0; hblock = block;
+		hallocMark(slots[i],j-i,True);
+		hfree += j-i;
+		halloc_stats.frees += j-i;
 	}
-	hentries++;
-	hlast = slot;
+}
+
+uint64_t hallocAvailable()
+{
+	return hfree;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	hallocCount	- free slots in a range
+//	hallocTake	- allocate a particular range, which must be free
+//
+///////////////////////////////////////////////////////////////////////////////
+
+uint32_t hallocCount(uint32_t slot,uint32_t count)
+{
+	uint32_t	n = 0,bits;
+	uint64_t	mask;
+
+	while( count ) {
+		bits = 64-(slot&63) < count ? 64-(slot&63) : count;
+		mask = (bits == 64 ? ~0ULL : ((1ULL << bits)-1)) << (slot&63);
+		n += __builtin_popcountll(hmap[slot>>6] & mask);
+		slot += bits;
+		count -= bits;
+	}
+	return n;
+}
+
+int hallocTake(uint32_t slot,int count)
+{
+	if( (slot+count > hslots) || (hallocCount(slot,count) != count) ) {
+		syslog(LOG_ALERT,"Taking slots %ld-%ld that aren't free",(unsigned long)slot,(unsigned long)(slot+count-1));
+		return False;
+	}
+	hallocMark(slot,count,False);
+	hfree -= count;
+	halloc_stats.allocs++;
+	halloc_stats.slots += count;
+	return True;
 }
 
 void hallocBegin()
 {
-	hstart = 0; hlast = -1; hentries = 0;
 }
 
 void hallocEnd()
 {
-	if(hentries) {
-			syslog(LOG_INFO,"hallocFree, slot %ld, entries %ld, block %lld",
-				   (unsigned long)hstart,(unsigned long)hentries,
-				   (unsigned long long)hblock);		
-	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	hallocLoad	- build the maps from the on-disk slot table
+//	hallocInit	- empty maps for "count" slots, all free
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void hallocInit(uint32_t count)
+{
+	free(hmap);
+	free(hany);
+	free(hfull);
+	hslots	= count;
+	hwords	= (count+63)/64;
+	hmap	= (uint64_t*)calloc(hwords,sizeof(uint64_t));
+	hany	= (uint64_t*)calloc((hwords+63)/64,sizeof(uint64_t));
+	hfull	= (uint64_t*)calloc((hwords+63)/64,sizeof(uint64_t));
+	hfree	= 0;
+	hhint	= 0;
+	memset(&halloc_stats,0,sizeof(halloc_stats));
 }
 
 void hallocLoad(void* base,int count)
 {
+	cache_entry	*ptr = (cache_entry*)base;
+	uint32_t	slot,start = 0;
+
 	syslog(LOG_INFO,"Max Slot = %d",count);
-	
-	uint32_t slot, last = 0 , start = 0 ,entries = 0;
-	int i; for(i=0;i<MAX_CHUNK;i++) { hstore[i]=NULL; }
-	
-	cache_entry *ptr = (cache_entry*)base;
-	for(slot=0;slot<count;slot++) {
-		if(!ptr->dirty) {
-			if( (slot != last+1) || (entries==(MAX_CHUNK-1))) { // new chain
-				if( entries ) {
-					hallocFlush(entries,start);
-				}
-				start = slot; entries = 0;
-			}
-			entries++;
-			last = slot;
+	hallocInit(count);
+	for(slot=0;slot<=count;slot++) {
+		if( (slot < count) && !ptr[slot].dirty ) continue;
+		if( slot > start ) {
+			hallocMark(start,slot-start,True);
+			hfree += slot-start;
 		}
-		ptr++;
+		start = slot+1;
 	}
-	hallocFlush(entries,start);
 	hallocStats();
 }
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	hallocExtents	- walk the free extents, log2 size histogram + largest
+//	hallocStats		- log allocation cost and fragmentation
+//
+//	Fragmentation is 1 - largest extent / free space, 0 when the free space
+//	is all in one piece.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t hallocExtents(uint64_t* hist,int buckets,uint64_t* largest)
+{
+	uint64_t	extents = 0,run = 0;
+	uint32_t	slot;
+	int			b;
+
+	void extent()
+	{
+		for(b=0;(b<buckets-1) && (run >> (b+1));b++);
+		if(hist) hist[b]++;
+		if( run > *largest ) *largest = run;
+		extents++;
+		run = 0;
+	}
+
+	*largest = 0;
+	if(hist) memset(hist,0,buckets*sizeof(uint64_t));
+	for(slot=0;slot<hslots;slot++) {
+		if( !(slot&63) && !hmap[slot>>6] ) {		// nothing free in this word
+			if(run) extent();
+			slot += 63;
+			continue;
+		}
+		if( (hmap[slot>>6] >> (slot&63)) & 1 ) run++;
+		else if(run) extent();
+	}
+	if(run) extent();
+	return extents;
+}
+
+void hallocStats()
+{
+	uint64_t	hist[HALLOC_BUCKETS],largest,extents;
+	int			i;
+
+	extents = hallocExtents(hist,HALLOC_BUCKETS,&largest);
+	syslog(LOG_INFO,"HALLOC STATS");
+	syslog(LOG_INFO,"Free %lld of %ld slots in %lld extents, largest %lld, fragmentation %.3f",
+		   (unsigned long long)hfree,(unsigned long)hslots,(unsigned long long)extents,
+		   (unsigned long long)largest,hfree ? 1.0-(double)largest/hfree : 0.0);
+	syslog(LOG_INFO,"Allocations %lld (%lld slots, %.1f/alloc), partial %lld, failed %lld, frees %lld",
+		   (unsigned long long)halloc_stats.allocs,(unsigned long long)halloc_stats.slots,
+		   halloc_stats.allocs ? (double)halloc_stats.slots/halloc_stats.allocs : 0.0,
+		   (unsigned long long)halloc_stats.partial,(unsigned long long)halloc_stats.failed,
+		   (unsigned long long)halloc_stats.frees);
+	syslog(LOG_INFO,"Allocation avg %lldns, p50 %lldns, p99 %lldns, max %lldns",
+		   (unsigned long long)(halloc_stats.allocs ? halloc_stats.nsecs/halloc_stats.allocs : 0),
+		   (unsigned long long)latPercentile(&halloc_stats.hist,50),
+		   (unsigned long long)latPercentile(&halloc_stats.hist,99),
+		   (unsigned long long)halloc_stats.max_nsecs);
+	for(i=0;i<HALLOC_BUCKETS;i++)
+		if(hist[i]) syslog(LOG_INFO,"%6lld+ slots :: %8lld extents",1ULL<<i,(unsigned long long)hist[i]);
+}
@@ -0,0 +1,302 @@
+/*
+ *      nbd-governor.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Governor for background IO (destage, log cleaning, resync, scrub, cache
+ *	warming).
+ *
+ *	Background work asks before it starts (govEnter) and says when it's
+ *	done (govExit). Each target, the cache SSD and every backend host, has
+ *	a limit on background requests in flight and a background bandwidth.
+ *	Foreground requests report their latency as they complete, and every
+ *	tick the governor compares each target's foreground p99 against its
+ *	SLO; over it the limits are halved, under it (with background work
+ *	waiting) they go up a step at a time, AIMD style.
+ *
+ *	Classes have a fixed priority, a class can't start on a target while
+ *	a higher one is waiting for it. With the governor off (-G 0) nothing
+ *	is held back but the foreground latency is still measured, so the
+ *	two can be compared.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "nbd.h"
+
+#define GOV_TARGETS		(MAX_HOSTS+1)	// SSD then the hosts
+#define GOV_TICK		250				// ms between adjustments
+#define GOV_SAMPLES		16				// fewest samples worth acting on
+#define GOV_MAX			64				// most background requests per target
+#define GOV_MIN_RATE	1				// MB/s, never throttled below
+#define GOV_MAX_RATE	1024			// MB/s, limit starts here
+#define GOV_STEP		4				// MB/s added per good tick
+
+typedef struct gov_target {
+
+	int				limit;						// background requests allowed
+	int				inflight;
+	uint64_t		rate;						// background MB/s allowed
+	struct timeval	next;						// when the next byte may go
+	int				waiting[GOV_CLASSES];
+	latency_hist	window;						// foreground, since the last tick
+	latency_hist	hist;						// foreground, since we started
+	uint64_t		p99;						// as of the last tick
+	uint64_t		ups,downs;
+
+} gov_target;
+
+int				gov_enabled		= True;
+int				gov_slo_ssd		= 2000;		// usecs, foreground p99 on the SSD
+int				gov_slo_host	= 20000;	// usecs, foreground p99 on a host
+char*			gov_class_names[] = { "destage" , "clean" , "resync" , "scrub" , "warm" };
+int				gov_class_ssd[] = { True , True , False , False , True };	// does the class use the SSD
+
+gov_target		gov_targets[GOV_TARGETS];
+int				gov_count		= 0;
+int				gov_running		= False;
+pthread_t		gov_thread;
+pthread_mutex_t	gov_lock		= PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	gov_cond		= PTHREAD_COND_INITIALIZER;
+__thread int	gov_current		= 0;		// class+1 of the work this thread is doing
+
+struct {
+
+	uint64_t	entries;
+	uint64_t	bytes;
+	uint64_t	waited;				// usecs spent in govEnter
+	int			inflight;
+
+} gov_stats[GOV_CLASSES];
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	govSample		- a foreground request on "target" took "usecs"
+//	govBackground	- is the calling thread doing background work
+//
+//	Target 0 is the SSD, host h (0 based) is target h+1.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void govSample(int target,uint64_t usecs)
+{
+	if( gov_current || (target >= GOV_TARGETS) ) return;
+	pthread_mutex_lock(&gov_lock);
+	latRecord(&gov_targets[target].window,usecs);
+	latRecord(&gov_targets[target].hist,usecs);
+	pthread_mutex_unlock(&gov_lock);
+}
+
+int govBackground()
+{
+	return gov_current != 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	govEnter	- wait for room for "bytes" of class "cls" work on "host"
+//	govExit		- that work is done
+//
+//	"host" is 0 based, -1 for work that only touches the SSD. Bandwidth is
+//	booked up front, the wait for it happens outside the lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int govBlocked(gov_target* t,int cls)
+{
+	int c;
+
+	if( t->inflight >= t->limit ) return True;
+	for(c=0;c<cls;c++) if( t->waiting[c] ) return True;
+	return False;
+}
+
+void govBook(gov_target* t,uint32_t bytes,struct timeval* now,struct timeval* at)
+{
+	uint64_t usecs = (uint64_t)bytes*1000000ULL/(t->rate*1048576ULL);
+
+	if( timercmp(&t->next,now,<) ) t->next = *now;
+	if( timercmp(&t->next,at,>) ) *at = t->next;
+	t->next.tv_usec += usecs%1000000;
+	t->next.tv_sec += usecs/1000000+t->next.tv_usec/1000000;
+	t->next.tv_usec %= 1000000;
+}
+
+void govEnter(int cls,int host,uint32_t bytes)
+{
+	gov_target		*ssd = gov_class_ssd[cls] ? &gov_targets[0] : NULL;
+	gov_target		*t = host >= 0 ? &gov_targets[host+1] : NULL;
+	struct timeval	start,now,at;
+	int64_t			usecs;
+
+	gov_current = cls+1;
+	gettimeofday(&start,NULL);
+	pthread_mutex_lock(&gov_lock);
+	if( gov_running && gov_enabled ) {
+		if(ssd) ssd->waiting[cls]++;
+		if(t) t->waiting[cls]++;
+		while( gov_running && ((ssd && govBlocked(ssd,cls)) || (t && govBlocked(t,cls))) )
+			pthread_cond_wait(&gov_cond,&gov_lock);
+		if(ssd) ssd->waiting[cls]--;
+		if(t) t->waiting[cls]--;
+	}
+	if(ssd) ssd->inflight++;
+	if(t) t->inflight++;
+	gov_stats[cls].entries++;
+	gov_stats[cls].inflight++;
+	gettimeofday(&now,NULL);
+	at = now;
+	if( gov_running && gov_enabled ) {
+		if(ssd) govBook(ssd,bytes,&now,&at);
+		if(t) govBook(t,bytes,&now,&at);
+	}
+	pthread_cond_broadcast(&gov_cond);
+	pthread_mutex_unlock(&gov_lock);
+
+	usecs = (at.tv_sec-now.tv_sec)*1000000LL+at.tv_usec-now.tv_usec;
+	if( usecs > 0 ) usleep(usecs);
+	gettimeofday(&now,NULL);
+	pthread_mutex_lock(&gov_lock);
+	gov_stats[cls].waited += (now.tv_sec-start.tv_sec)*1000000ULL+now.tv_usec-start.tv_usec;
+	pthread_mutex_unlock(&gov_lock);
+}
+
+void govExit(int cls,int host,uint32_t bytes)
+{
+	pthread_mutex_lock(&gov_lock);
+	if( gov_class_ssd[cls] ) gov_targets[0].inflight--;
+	if( host >= 0 ) gov_targets[host+1].inflight--;
+	gov_stats[cls].bytes += bytes;
+	gov_stats[cls].inflight--;
+	pthread_cond_broadcast(&gov_cond);
+	pthread_mutex_unlock(&gov_lock);
+	gov_current = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	govTick		- adjust every target from its foreground latency
+//	govThread	- runs govTick every GOV_TICK ms
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void govTick()
+{
+	gov_target	*t;
+	int			i,c,slo,wanted;
+
+	for(i=0;i<gov_count;i++) {
+		t = &gov_targets[i];
+		slo = i ? gov_slo_host : gov_slo_ssd;
+		for(c=wanted=0;c<GOV_CLASSES;c++) wanted |= t->waiting[c];
+		wanted |= t->inflight >= t->limit;
+		if( t->window.count >= GOV_SAMPLES ) t->p99 = latPercentile(&t->window,99);
+		if( (t->window.count >= GOV_SAMPLES) && (t->p99 > slo) ) {
+			t->limit = t->limit > 1 ? t->limit/2 : 1;
+			t->rate = t->rate/2 > GOV_MIN_RATE ? t->rate/2 : GOV_MIN_RATE;
+			t->downs++;
+		} else if( wanted ) {
+			if( t->limit < GOV_MAX ) t->limit++;
+			t->rate = t->rate+GOV_STEP < GOV_MAX_RATE ? t->rate+GOV_STEP : GOV_MAX_RATE;
+			t->ups++;
+		}
+		memset(&t->window,0,sizeof(latency_hist));
+	}
+	pthread_cond_broadcast(&gov_cond);
+}
+
+void* govThread(void* arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&gov_lock);
+	while( gov_running ) {
+		clock_gettime(CLOCK_REALTIME,&ts);
+		ts.tv_nsec += GOV_TICK*1000000L;
+		ts.tv_sec += ts.tv_nsec/1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&gov_cond,&gov_lock,&ts);
+		if( gov_running ) govTick();
+	}
+	pthread_mutex_unlock(&gov_lock);
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	govStart	- set up a target per host and start adjusting
+//	govStop		- stop, anyone waiting is let go
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int govStart()
+{
+	int i;
+
+	if(gov_running) return True;
+	pthread_mutex_lock(&gov_lock);
+	gov_count = backend_count+1;
+	for(i=0;i<gov_count;i++) {
+		memset(&gov_targets[i],0,sizeof(gov_target));
+		gov_targets[i].limit = GOV_MAX/4;
+		gov_targets[i].rate = GOV_MAX_RATE/4;
+	}
+	gov_running = True;
+	pthread_mutex_unlock(&gov_lock);
+	if( pthread_create(&gov_thread,NULL,govThread,NULL) != 0 ) {
+		syslog(LOG_ALERT,"Error creating governor thread, err=%d",errno);
+		gov_running = False;
+		return False;
+	}
+	syslog(LOG_INFO,"Governor %s, SLO p99 SSD %dus, hosts %dus",gov_enabled ? "on" : "off (measuring only)",
+		   gov_slo_ssd,gov_slo_host);
+	return True;
+}
+
+void govStop()
+{
+	if(!gov_running) return;
+	pthread_mutex_lock(&gov_lock);
+	gov_running = False;
+	pthread_cond_broadcast(&gov_cond);
+	pthread_mutex_unlock(&gov_lock);
+	pthread_join(gov_thread,NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	govStats	- log foreground latency and background limits
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void govStats()
+{
+	gov_target	*t;
+	int			i;
+
+	pthread_mutex_lock(&gov_lock);
+	syslog(LOG_INFO,"GOVERNOR STATS (%s)",gov_enabled ? "on" : "off");
+	for(i=0;i<gov_count;i++) {
+		t = &gov_targets[i];
+		syslog(LOG_INFO,"%-16s :: foreground p50 %lldus, p99 %lldus (SLO %dus), limit %d (%d in flight), %lldMB/s, up %lld, down %lld",
+			   i ? backends[i-1].name : "SSD",
+			   (unsigned long long)latPercentile(&t->hist,50),(unsigned long long)latPercentile(&t->hist,99),
+			   i ? gov_slo_host : gov_slo_ssd,t->limit,t->inflight,(unsigned long long)t->rate,
+			   (unsigned long long)t->ups,(unsigned long long)t->downs);
+	}
+	for(i=0;i<GOV_CLASSES;i++) {
+		if(!gov_stats[i].entries) continue;
+		syslog(LOG_INFO,"%-8s :: requests %lld (%lldMB), avg wait %lldus, in flight %d",gov_class_names[i],
+			   (unsigned long long)gov_stats[i].entries,(unsigned long long)gov_stats[i].bytes>>20,
+			   (unsigned long long)gov_stats[i].waited/gov_stats[i].entries,gov_stats[i].inflight);
+	}
+	pthread_mutex_unlock(&gov_lock);
+}
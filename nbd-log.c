@@ -0,0 +1,383 @@
+/*
+ *      nbd-log.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Log structured layout for the cache device (optional, -S).
+ *
+ *	The slots are split into segments of log_segment MB. Every write, data
+ *	and slot headers together, goes to the head of the log, the next slots
+ *	of the open segment, and when that's full the next empty segment is
+ *	opened. However random the guest writes are the SSD sees them land one
+ *	after another, and a segment is written from end to end before any of
+ *	its slots are used again, which is what its FTL wants.
+ *
+ *	Freed slots leave holes. The cleaner keeps log_reserve segments empty
+ *	by taking the segment with the least live data (if that's below
+ *	log_clean %) and emptying it; dirty blocks are copied to the head of
+ *	the log, clean ones are dropped as the backend has them anyway. With
+ *	no empty segment at all, writes fall back to any free slots.
+ *
+ *	All slot writes go through logWrite, log or not, so the sizes and
+ *	sequentiality of what the SSD sees can be compared. With format v2
+ *	the slot headers live in the metadata region and are still written
+ *	in place there, only the data goes to the log.
+ *
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "nbd.h"
+
+#define USED	1
+
+#define LOG_BATCH	256					// slots the cleaner reads per cache_lock
+#define LOG_SIZES	24					// write size histogram, log2 bytes
+
+extern uint64_t	cache_entries;
+extern uint32_t	slot_size;
+
+int				log_segment		= 0;	// MB per segment, 0 = log layout off
+int				log_clean		= 50;	// % live, below this a segment is worth cleaning
+int				log_reserve		= 4;	// empty segments the cleaner tries to keep
+int				log_running		= False;
+uint32_t		log_slots;				// slots per segment
+uint32_t		log_segments;
+uint32_t		log_head,log_end;		// next slot to write, end of the open segment
+uint32_t		log_next;				// where to look for the next empty segment
+uint32_t		log_empty;				// empty segments, as of the last count
+uint64_t		log_last;				// device offset the last write ended at
+pthread_t		log_thread;
+pthread_cond_t	log_cond = PTHREAD_COND_INITIALIZER;
+
+struct {
+
+	uint64_t	writes;
+	uint64_t	bytes;
+	uint64_t	sequential;				// started where the last one ended
+	uint64_t	sizes[LOG_SIZES];
+
+} ssd_stats;
+
+struct {
+
+	uint64_t	opened;					// segments written from empty
+	uint64_t	fallback;				// allocations with no empty segment
+	uint64_t	cleaned;
+	uint64_t	live;					// live slots in segments as they were picked
+	uint64_t	moved;					// dirty blocks copied to the head
+	uint64_t	dropped;				// clean blocks let go
+	uint64_t	read_bytes;
+	uint64_t	write_bytes;			// by the cleaner, also counted in ssd_stats
+	uint64_t	stuck;					// nowhere to clean into
+	uint64_t	usecs;
+
+} log_stats;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	logWrite	- write "size" bytes at "slot", counting what the SSD sees
+//	logWriteAt	- the same at a device offset (v2 metadata)
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int logWrite(uint32_t slot,void* buf,int size)
+{
+	return logWriteAt(cache_direct,slotOffset(slot),buf,size);
+}
+
+int logWriteAt(int fd,uint64_t off,void* buf,int size)
+{
+	int			b;
+
+	if( pwrite(fd,buf,size,off) != size ) {
+		syslog(LOG_ALERT,"Write error, off=%lld,err=%d",(unsigned long long)off,errno);
+		return False;
+	}
+	ssd_stats.writes++;
+	ssd_stats.bytes += size;
+	if( off == log_last ) ssd_stats.sequential++;
+	log_last = off+size;
+	for(b=0;(b<LOG_SIZES-1) && (size >> (b+1));b++);
+	ssd_stats.sizes[b]++;
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	logOpen		- make the next empty segment the head of the log
+//	logTake		- slots from the head of the log, *count = 0 if there's none
+//	logAllocate	- the same, falling back to any free slots
+//
+//	Called with cache_lock held.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int logOpen()
+{
+	uint32_t i,seg;
+
+	for(i=0;i<log_segments;i++) {
+		seg = (log_next+i)%log_segments;
+		if( hallocCount(seg*log_slots,log_slots) != log_slots ) continue;
+		log_head = seg*log_slots;
+		log_end = log_head+log_slots;
+		log_next = seg+1;
+		log_stats.opened++;
+		pthread_cond_signal(&log_cond);
+		return True;
+	}
+	return False;
+}
+
+void logTake(uint32_t *slot,int *count)
+{
+	if( (log_head == log_end) && !logOpen() ) {
+		*count = 0;
+		return;
+	}
+	if( *count > log_end-log_head ) *count = log_end-log_head;
+	if( !hallocTake(log_head,*count) ) {
+		log_head = log_end;
+		*count = 0;
+		return;
+	}
+	*slot = log_head;
+	log_head += *count;
+}
+
+void logAllocate(uint32_t *slot,int *count)
+{
+	int want = *count;
+
+	logTake(slot,count);
+	if(*count) return;
+	log_stats.fallback++;
+	*count = want;
+	hallocAllocate(slot,count);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	logVictim	- count the empty segments, return the one to clean next
+//	logClean	- empty a segment, False if we ran out of room to do it
+//
+//	Works through the segment LOG_BATCH slots at a time, letting go of
+//	cache_lock (and asking the governor) in between. A slot is live if
+//	the index still points at it. Moving a dirty block changes its slot,
+//	so a destage of it in flight won't clean it, it goes again next time.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+uint32_t logVictim(uint32_t* live)
+{
+	uint32_t	seg,n,open = log_head < log_end ? log_head/log_slots : log_segments;
+	uint32_t	victim = log_segments;
+
+	log_empty = 0;
+	*live = log_slots;
+	for(seg=0;seg<log_segments;seg++) {
+		if( seg == open ) continue;
+		n = log_slots-hallocCount(seg*log_slots,log_slots);
+		if( !n ) log_empty++;
+		else if( n < *live ) {
+			*live = n;
+			victim = seg;
+		}
+	}
+	if( (uint64_t)*live*100 >= (uint64_t)log_clean*log_slots ) return log_segments;
+	return victim;
+}
+
+int logClean(uint32_t seg)
+{
+	char		*rbuf = (char*)valloc(LOG_BATCH*NCACHE_BSIZE);
+	char		*wbuf = (char*)valloc(LOG_BATCH*NCACHE_BSIZE);
+	cache_entry	rhdr[LOG_BATCH],whdr[LOG_BATCH],*index;
+	hash_entry	entry,moving[LOG_BATCH];
+	uint32_t	from[LOG_BATCH];
+	uint32_t	first = seg*log_slots,slot,to,n,i,j;
+	int			count,got,ok = True;
+
+	for(slot=first;ok && log_running && (slot<first+log_slots);slot+=n) {
+		n = first+log_slots-slot < LOG_BATCH ? first+log_slots-slot : LOG_BATCH;
+		if( hallocCount(slot,n) == n ) continue;
+		pthread_mutex_unlock(&cache_lock);
+		govEnter(GOV_CLEAN,-1,n*slot_size);
+		pthread_mutex_lock(&cache_lock);
+		if( !cacheReadSlots(slot,rbuf,rhdr,n) ) {
+			syslog(LOG_ALERT,"Cleaner read error, slot=%d",(int)slot);
+			pthread_mutex_unlock(&cache_lock);
+			govExit(GOV_CLEAN,-1,0);
+			pthread_mutex_lock(&cache_lock);
+			ok = False;
+			break;
+		}
+		log_stats.read_bytes += n*slot_size;
+		//
+		//	Drop what's clean, line up what's dirty
+		//
+		count = 0;
+		for(i=0;i<n;i++) {
+			if( hallocCount(slot+i,1) ) continue;
+			index = &rhdr[i];
+			if( !indexGet(index->block,&entry) || (entry.slot != slot+i) ) continue;
+			if( entry.dirty == USED ) {
+				evictRemove(entry.block);
+				indexDel(entry.block);
+				hallocFree(slot+i,entry.block);
+				log_stats.dropped++;
+				continue;
+			}
+			from[count] = i;
+			moving[count++] = entry;
+		}
+		//
+		//	And copy the dirty ones to the head of the log
+		//
+		for(i=0;ok && (i<count);i+=got) {
+			got = count-i;
+			logTake(&to,&got);
+			if(!got) {
+				log_stats.stuck++;
+				ok = False;
+				break;
+			}
+			for(j=0;j<got;j++) {
+				whdr[j].block		= moving[i+j].block;
+				whdr[j].dirty		= moving[i+j].dirty;
+				whdr[j].usecount	= moving[i+j].usecount;
+				memcpy(wbuf+j*NCACHE_BSIZE,rbuf+from[i+j]*NCACHE_BSIZE,NCACHE_BSIZE);
+			}
+			if(!cacheWriteSlots(to,wbuf,whdr,got)) {
+				for(j=0;j<got;j++) hallocFree(to+j,moving[i+j].block);
+				ok = False;
+				break;
+			}
+			for(j=0;j<got;j++) {
+				moving[i+j].slot = to+j;
+				indexPut(&moving[i+j],moving[i+j].dirty);
+				hallocFree(slot+from[i+j],moving[i+j].block);
+			}
+			log_stats.moved += got;
+			log_stats.write_bytes += got*slot_size;
+		}
+		pthread_mutex_unlock(&cache_lock);
+		govExit(GOV_CLEAN,-1,n*slot_size);
+		pthread_mutex_lock(&cache_lock);
+	}
+	free(rbuf);
+	free(wbuf);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	logThread	- the cleaner, keeps log_reserve segments empty
+//	logStart	- split the cache into segments and start the cleaner
+//	logStop		- stop it, writes go back to the free space allocator
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void* logThread(void* arg)
+{
+	struct timespec	ts;
+	struct timeval	start,end;
+	uint32_t		seg,live;
+	int				ok;
+
+	pthread_mutex_lock(&cache_lock);
+	while( log_running ) {
+		seg = logVictim(&live);
+		if( (log_empty < log_reserve) && (seg < log_segments) ) {
+			gettimeofday(&start,NULL);
+			log_stats.live += live;
+			if( (ok = logClean(seg)) ) log_stats.cleaned++;
+			gettimeofday(&end,NULL);
+			log_stats.usecs += (end.tv_sec-start.tv_sec)*1000000ULL+end.tv_usec-start.tv_usec;
+			if(ok) continue;
+		}
+		clock_gettime(CLOCK_REALTIME,&ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&log_cond,&cache_lock,&ts);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+int logStart()
+{
+	if( !log_segment || log_running ) return True;
+	log_slots = (uint64_t)log_segment*1024*1024/slot_size;
+	log_segments = log_slots ? cache_entries/log_slots : 0;
+	if( log_segments < log_reserve+2 ) {
+		syslog(LOG_ERR,"Cache is too small for %dMB segments, log layout off",log_segment);
+		return False;
+	}
+	log_head = log_end = log_next = 0;
+	log_running = True;
+	if( pthread_create(&log_thread,NULL,logThread,NULL) != 0 ) {
+		syslog(LOG_ALERT,"Error creating cleaner thread, err=%d",errno);
+		log_running = False;
+		return False;
+	}
+	syslog(LOG_INFO,"Log layout, %ld segments of %dMB (%ld slots), cleaning below %d%% live, keeping %d empty",
+		   (unsigned long)log_segments,log_segment,(unsigned long)log_slots,log_clean,log_reserve);
+	return True;
+}
+
+void logStop()
+{
+	if(!log_running) return;
+	pthread_mutex_lock(&cache_lock);
+	log_running = False;
+	log_head = log_end;
+	pthread_cond_broadcast(&log_cond);
+	pthread_mutex_unlock(&cache_lock);
+	pthread_join(log_thread,NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	logStats	- log SSD write sizes and what the cleaner has cost
+//
+//	Write amplification here is at our level, cleaner copies over what
+//	was written for the clients; the FTL adds its own on top.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void logStats()
+{
+	uint64_t	user = ssd_stats.bytes-log_stats.write_bytes;
+	uint32_t	live;
+	int			i;
+
+	syslog(LOG_INFO,"SSD WRITE STATS");
+	syslog(LOG_INFO,"Writes %lld (%lldMB), avg %lld bytes, sequential %.1f%%",
+		   (unsigned long long)ssd_stats.writes,(unsigned long long)ssd_stats.bytes>>20,
+		   (unsigned long long)(ssd_stats.writes ? ssd_stats.bytes/ssd_stats.writes : 0),
+		   ssd_stats.writes ? 100.0*ssd_stats.sequential/ssd_stats.writes : 0.0);
+	for(i=0;i<LOG_SIZES;i++)
+		if(ssd_stats.sizes[i]) syslog(LOG_INFO,"%8lld+ bytes :: %8lld writes",1ULL<<i,(unsigned long long)ssd_stats.sizes[i]);
+	if(!log_running) return;
+	logVictim(&live);
+	syslog(LOG_INFO,"LOG STATS");
+	syslog(LOG_INFO,"Segments %ld of %dMB, %ld empty, opened %lld, allocations with no empty segment %lld",
+		   (unsigned long)log_segments,log_segment,(unsigned long)log_empty,
+		   (unsigned long long)log_stats.opened,(unsigned long long)log_stats.fallback);
+	syslog(LOG_INFO,"Cleaned %lld segments (%.1f%% live), moved %lld dirty, dropped %lld clean, stuck %lld, %lldms",
+		   (unsigned long long)log_stats.cleaned,
+		   log_stats.cleaned ? 100.0*log_stats.live/log_stats.cleaned/log_slots : 0.0,
+		   (unsigned long long)log_stats.moved,(unsigned long long)log_stats.dropped,
+		   (unsigned long long)log_stats.stuck,(unsigned long long)log_stats.usecs/1000);
+	syslog(LOG_INFO,"Cleaner read %lldMB, wrote %lldMB, write amplification %.2f",
+		   (unsigned long long)log_stats.read_bytes>>20,(unsigned long long)log_stats.write_bytes>>20,
+		   user ? (double)ssd_stats.bytes/user : 1.0);
+}
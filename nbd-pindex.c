@@ -0,0 +1,625 @@
+/*
+ *      nbd-pindex.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Paged block index for caches that are too big to index in RAM.
+ *
+ *	The index lives on the cache device as a table of 4K pages, each page
+ *	holding PINDEX_EPP entries. Blocks hash (in runs of PINDEX_RUN blocks so
+ *	a request normally touches one page) to a home page and overflow into
+ *	the pages that follow it. Only "pindex_budget" MB of pages are held in
+ *	RAM (CLOCK replacement), and a prefetch thread pulls in the pages that
+ *	a queued request is going to need before the request gets to them.
+ *
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include "nbd.h"
+
+#define PINDEX_QSIZE	1024	// prefetch queue length
+#define PINDEX_CHUNK	64		// pages per read when walking the index
+
+typedef struct pindex_frame {
+
+	uint32_t		page;		// index page held in this frame
+	int32_t			next;		// next frame in the same bucket
+	uint8_t			valid;
+	uint8_t			dirty;
+	uint8_t			ref;		// CLOCK reference bit
+	uint8_t			prefetched;	// loaded by prefetch, not yet used
+	pindex_page*	data;
+
+} pindex_frame;
+
+int pindex_budget = 64;			// RAM for index pages (MB)
+
+struct {
+
+	int				fd;			// cache device
+	uint64_t		base;		// offset of page 0
+	uint32_t		pages;		// pages in the index
+	pindex_frame*	frames;		// in-memory page cache
+	uint32_t		nframes;
+	int32_t*		buckets;	// page -> frame hash
+	uint32_t		mask;
+	uint32_t		hand;		// CLOCK hand
+	char*			memory;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	pthread_t		thread;
+	int				running;
+	uint32_t		queue[PINDEX_QSIZE];
+	int				qhead,qtail;
+
+} pindex;
+
+struct {
+
+	uint64_t	lookups;
+	uint64_t	page_hits;
+	uint64_t	page_misses;
+	uint64_t	prefetched;
+	uint64_t	prefetch_hits;
+	uint64_t	writebacks;
+	uint64_t	lat_ns;
+	uint64_t	lat_max;
+	uint64_t	hist[64];	// lookup latency, log2(ns) buckets
+
+} pindex_stats;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	Page cache helpers, all called with pindex.lock held
+//
+///////////////////////////////////////////////////////////////////////////////
+
+uint32_t pindexHome(uint64_t block)
+{
+	uint64_t h = (block/PINDEX_RUN) * 0x9E3779B97F4A7C15ULL;
+	return (uint32_t)((h>>32) % pindex.pages);
+}
+
+int32_t pindexFind(uint32_t page)
+{
+	int32_t f = pindex.buckets[page & pindex.mask];
+	while( (f != -1) && (pindex.frames[f].page != page) ) f = pindex.frames[f].next;
+	return f;
+}
+
+int pindexWriteBack(pindex_frame* frame)
+{
+	if( pwrite(pindex.fd,frame->data,PINDEX_PSIZE,pindex.base+(uint64_t)frame->page*PINDEX_PSIZE) != PINDEX_PSIZE ) {
+		syslog(LOG_ALERT,"Index page write error, page=%ld, err=%d",(unsigned long)frame->page,errno);
+		return False;
+	}
+	frame->dirty = 0;
+	pindex_stats.writebacks++;
+	return True;
+}
+
+int32_t pindexVictim()
+{
+	int32_t f,*pp;
+	pindex_frame* frame;
+
+	for(;;) {
+		f = pindex.hand;
+		pindex.hand = (pindex.hand+1) % pindex.nframes;
+		frame = &pindex.frames[f];
+		if(!frame->valid) return f;
+		if(frame->ref) { frame->ref = 0; continue; }
+		if(frame->dirty && !pindexWriteBack(frame)) continue;
+		pp = &pindex.buckets[frame->page & pindex.mask];
+		while( *pp != f ) pp = &pindex.frames[*pp].next;
+		*pp = frame->next;
+		frame->valid = 0;
+		return f;
+	}
+}
+
+void pindexInstall(int32_t f,uint32_t page)
+{
+	pindex_frame* frame = &pindex.frames[f];
+
+	frame->page 		= page;
+	frame->valid		= 1;
+	frame->dirty		= 0;
+	frame->ref			= 1;
+	frame->prefetched	= 0;
+	frame->next			= pindex.buckets[page & pindex.mask];
+	pindex.buckets[page & pindex.mask] = f;
+}
+
+pindex_page* pindexLoad(uint32_t page,int dirty)
+{
+	int32_t f = pindexFind(page);
+
+	if( f != -1 ) {
+		pindex_stats.page_hits++;
+		if(pindex.frames[f].prefetched) {
+			pindex_stats.prefetch_hits++;
+			pindex.frames[f].prefetched = 0;
+		}
+	} else {
+		pindex_stats.page_misses++;
+		f = pindexVictim();
+		if( pread(pindex.fd,pindex.frames[f].data,PINDEX_PSIZE,pindex.base+(uint64_t)page*PINDEX_PSIZE) != PINDEX_PSIZE ) {
+			syslog(LOG_ALERT,"Index page read error, page=%ld, err=%d",(unsigned long)page,errno);
+			return NULL;
+		}
+		pindexInstall(f,page);
+	}
+	pindex.frames[f].ref = 1;
+	if(dirty) pindex.frames[f].dirty = 1;
+	return pindex.frames[f].data;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexFrames	- (re)allocate the in-memory page cache
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int pindexFrames(uint32_t nframes)
+{
+	uint32_t i,buckets = 1;
+
+	if(nframes > pindex.pages) nframes = pindex.pages;
+	if(nframes < 16) nframes = 16;
+	while( buckets < nframes ) buckets <<= 1;
+
+	pthread_mutex_lock(&pindex.lock);
+	if(pindex.frames) {
+		for(i=0;i<pindex.nframes;i++)
+			if(pindex.frames[i].valid && pindex.frames[i].dirty) pindexWriteBack(&pindex.frames[i]);
+		free(pindex.frames);
+		free(pindex.buckets);
+		free(pindex.memory);
+	}
+	pindex.nframes	= nframes;
+	pindex.mask		= buckets-1;
+	pindex.hand		= 0;
+	pindex.frames	= (pindex_frame*)calloc(nframes,sizeof(pindex_frame));
+	pindex.buckets	= (int32_t*)malloc(buckets*sizeof(int32_t));
+	if( !pindex.frames || !pindex.buckets || posix_memalign((void**)&pindex.memory,PINDEX_PSIZE,(size_t)nframes*PINDEX_PSIZE) ) {
+		syslog(LOG_ALERT,"Unable to allocate %ld index frames",(unsigned long)nframes);
+		pthread_mutex_unlock(&pindex.lock);
+		return False;
+	}
+	for(i=0;i<buckets;i++) pindex.buckets[i] = -1;
+	for(i=0;i<nframes;i++) pindex.frames[i].data = (pindex_page*)(pindex.memory+(size_t)i*PINDEX_PSIZE);
+	pthread_mutex_unlock(&pindex.lock);
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexPrefetcher	- thread to load index pages ahead of the request
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void* pindexPrefetcher(void* arg)
+{
+	char*		buffer;
+	uint32_t	page;
+	int32_t		f;
+
+	if(posix_memalign((void**)&buffer,PINDEX_PSIZE,PINDEX_PSIZE)) return NULL;
+	pthread_mutex_lock(&pindex.lock);
+	while( pindex.running ) {
+		if( pindex.qhead == pindex.qtail ) {
+			pthread_cond_wait(&pindex.wake,&pindex.lock);
+			continue;
+		}
+		page = pindex.queue[pindex.qtail];
+		pindex.qtail = (pindex.qtail+1) % PINDEX_QSIZE;
+		if( pindexFind(page) != -1 ) continue;
+		//
+		//	Do the read without the lock so lookups aren't held up
+		//
+		pthread_mutex_unlock(&pindex.lock);
+		f = pread(pindex.fd,buffer,PINDEX_PSIZE,pindex.base+(uint64_t)page*PINDEX_PSIZE);
+		pthread_mutex_lock(&pindex.lock);
+		if( (f != PINDEX_PSIZE) || (pindexFind(page) != -1) ) continue;
+		f = pindexVictim();
+		memcpy(pindex.frames[f].data,buffer,PINDEX_PSIZE);
+		pindexInstall(f,page);
+		pindex.frames[f].prefetched = 1;
+		pindex_stats.prefetched++;
+	}
+	pthread_mutex_unlock(&pindex.lock);
+	free(buffer);
+	return NULL;
+}
+
+void pindexPrefetch(uint64_t block,int count)
+{
+	uint64_t	end = block+count;
+	uint32_t	page,last = PINDEX_TOMB;
+	int			next;
+
+	pthread_mutex_lock(&pindex.lock);
+	while( block < end ) {
+		page = pindexHome(block);
+		next = (pindex.qhead+1) % PINDEX_QSIZE;
+		if( (page != last) && (next != pindex.qtail) && (pindexFind(page) == -1) ) {
+			pindex.queue[pindex.qhead] = page;
+			pindex.qhead = next;
+			last = page;
+		}
+		block = (block/PINDEX_RUN+1)*PINDEX_RUN;
+	}
+	pthread_cond_signal(&pindex.wake);
+	pthread_mutex_unlock(&pindex.lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexOpen		- attach to the index region of the cache device
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int pindexOpen(int fd,uint64_t base,uint32_t pages)
+{
+	memset(&pindex,0,sizeof(pindex));
+	memset(&pindex_stats,0,sizeof(pindex_stats));
+	pindex.fd		= fd;
+	pindex.base		= base;
+	pindex.pages	= pages;
+	pthread_mutex_init(&pindex.lock,NULL);
+	pthread_cond_init(&pindex.wake,NULL);
+
+	if(!pindexFrames((uint32_t)((uint64_t)pindex_budget*1024*1024/PINDEX_PSIZE))) return False;
+	pindex.running = True;
+	if( pthread_create(&pindex.thread,NULL,pindexPrefetcher,NULL) != 0 ) {
+		syslog(LOG_ALERT,"Unable to start index prefetch thread, err=%d",errno);
+		pindex.running = False;
+	}
+	syslog(LOG_INFO,"Paged index :: %ld pages (%ldM), %ld in RAM (%ldM)",
+		   (unsigned long)pages,(unsigned long)((uint64_t)pages*PINDEX_PSIZE/1024/1024),
+		   (unsigned long)pindex.nframes,(unsigned long)((uint64_t)pindex.nframes*PINDEX_PSIZE/1024/1024));
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexSync		- write all dirty index pages back to the device
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void pindexSync()
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pindex.lock);
+	for(i=0;i<pindex.nframes;i++)
+		if(pindex.frames[i].valid && pindex.frames[i].dirty) pindexWriteBack(&pindex.frames[i]);
+	pthread_mutex_unlock(&pindex.lock);
+}
+
+void pindexClose()
+{
+	if(!pindex.frames) return;
+	if(pindex.running) {
+		pthread_mutex_lock(&pindex.lock);
+		pindex.running = False;
+		pthread_cond_signal(&pindex.wake);
+		pthread_mutex_unlock(&pindex.lock);
+		pthread_join(pindex.thread,NULL);
+	}
+	pindexSync();
+	free(pindex.frames);
+	free(pindex.buckets);
+	free(pindex.memory);
+	pindex.frames = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexClear		- empty the index (used by format and re-index)
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int pindexClear()
+{
+	char		zeros[PINDEX_PSIZE*PINDEX_CHUNK];
+	uint32_t	page,count,i;
+
+	memset(zeros,0,sizeof(zeros));
+	pthread_mutex_lock(&pindex.lock);
+	for(page=0;page<pindex.pages;page+=count) {
+		count = pindex.pages-page > PINDEX_CHUNK ? PINDEX_CHUNK : pindex.pages-page;
+		if( pwrite(pindex.fd,zeros,count*PINDEX_PSIZE,pindex.base+(uint64_t)page*PINDEX_PSIZE) != count*PINDEX_PSIZE ) {
+			syslog(LOG_ALERT,"Unable to clear index, page=%ld, err=%d",(unsigned long)page,errno);
+			pthread_mutex_unlock(&pindex.lock);
+			return False;
+		}
+	}
+	for(i=0;i<=pindex.mask;i++) pindex.buckets[i] = -1;
+	for(i=0;i<pindex.nframes;i++) pindex.frames[i].valid = 0;
+	pthread_mutex_unlock(&pindex.lock);
+	return True;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexGet		- look up a block, copy out the entry if found
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int pindexGet(uint64_t block,hash_entry* entry)
+{
+	struct timespec	t0,t1;
+	pindex_page*	pg;
+	pindex_entry*	e;
+	uint32_t		page,n,i;
+	uint64_t		ns;
+	int				found = False;
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	pthread_mutex_lock(&pindex.lock);
+	page = pindexHome(block);
+	for(n=0;n<pindex.pages && !found;n++) {
+		if(!(pg = pindexLoad(page,False))) break;
+		for(i=0;i<pg->count;i++) {
+			e = &pg->entry[i];
+			if( e->key == block+1 ) {
+				entry->block	= block;
+				entry->slot		= e->slot;
+				entry->usecount	= e->usecount;
+				entry->dirty	= e->dirty;
+				entry->dtime	= e->dtime;
+				found = True;
+				break;
+			}
+		}
+		if(pg->count < PINDEX_EPP) break;
+		page = (page+1) % pindex.pages;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	ns = (t1.tv_sec-t0.tv_sec)*1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	pindex_stats.lookups++;
+	pindex_stats.lat_ns += ns;
+	if(ns > pindex_stats.lat_max) pindex_stats.lat_max = ns;
+	pindex_stats.hist[ns ? 64-__builtin_clzll(ns) : 0]++;
+	pthread_mutex_unlock(&pindex.lock);
+	return found;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexPut		- insert or update an entry
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int pindexPut(hash_entry* entry)
+{
+	pindex_page*	pg;
+	pindex_entry*	e;
+	uint32_t		page,n,i;
+	int64_t			tomb_page = -1;
+	uint32_t		tomb_idx = 0;
+
+	pthread_mutex_lock(&pindex.lock);
+	page = pindexHome(entry->block);
+	for(n=0;n<pindex.pages;n++) {
+		if(!(pg = pindexLoad(page,False))) goto fail;
+		for(i=0;i<pg->count;i++) {
+			e = &pg->entry[i];
+			if( e->key == entry->block+1 ) {
+				tomb_page = page;
+				tomb_idx = i;
+				goto store;
+			}
+			if( !e->key && (tomb_page == -1) ) {
+				tomb_page = page;
+				tomb_idx = i;
+			}
+		}
+		if(pg->count < PINDEX_EPP) break;
+		page = (page+1) % pindex.pages;
+	}
+	if( tomb_page == -1 ) {
+		if( n == pindex.pages ) {
+			syslog(LOG_ALERT,"Paged index is full, block [%lld]",(unsigned long long)entry->block);
+			goto fail;
+		}
+		tomb_page = page;
+		tomb_idx = pg->count;
+	}
+store:
+	//
+	//	Re-load, the page we want may have been pushed out while probing
+	//
+	if(!(pg = pindexLoad((uint32_t)tomb_page,True))) goto fail;
+	if( tomb_idx == pg->count ) pg->count++;
+	e = &pg->entry[tomb_idx];
+	e->key		= entry->block+1;
+	e->slot		= entry->slot;
+	e->usecount	= entry->usecount;
+	e->dirty	= entry->dirty;
+	e->dtime	= entry->dtime;
+	pthread_mutex_unlock(&pindex.lock);
+	return True;
+fail:
+	pthread_mutex_unlock(&pindex.lock);
+	return False;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexDel		- remove an entry, leaving a tombstone
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int pindexDel(uint64_t block)
+{
+	pindex_page*	pg;
+	uint32_t		page,n,i;
+
+	pthread_mutex_lock(&pindex.lock);
+	page = pindexHome(block);
+	for(n=0;n<pindex.pages;n++) {
+		if(!(pg = pindexLoad(page,False))) break;
+		for(i=0;i<pg->count;i++) {
+			if( pg->entry[i].key == block+1 ) {
+				pindexLoad(page,True);
+				pg->entry[i].key	= 0;
+				pg->entry[i].slot	= PINDEX_TOMB;
+				pthread_mutex_unlock(&pindex.lock);
+				return True;
+			}
+		}
+		if(pg->count < PINDEX_EPP) break;
+		page = (page+1) % pindex.pages;
+	}
+	pthread_mutex_unlock(&pindex.lock);
+	return False;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexWalk		- call fn() for every live entry, straight off the device
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int pindexWalk(int (*fn)(hash_entry*,void*),void* arg)
+{
+	char*			buffer;
+	pindex_page*	pg;
+	pindex_entry*	e;
+	hash_entry		entry;
+	uint32_t		page,count,p,i;
+	int				ret = True;
+
+	pindexSync();
+	if(posix_memalign((void**)&buffer,PINDEX_PSIZE,PINDEX_PSIZE*PINDEX_CHUNK)) return False;
+	for(page=0;(page<pindex.pages) && ret;page+=count) {
+		count = pindex.pages-page > PINDEX_CHUNK ? PINDEX_CHUNK : pindex.pages-page;
+		if( pread(pindex.fd,buffer,count*PINDEX_PSIZE,pindex.base+(uint64_t)page*PINDEX_PSIZE) != count*PINDEX_PSIZE ) {
+			syslog(LOG_ALERT,"Unable to read index, page=%ld, err=%d",(unsigned long)page,errno);
+			ret = False;
+			break;
+		}
+		for(p=0;(p<count) && ret;p++) {
+			pg = (pindex_page*)(buffer+p*PINDEX_PSIZE);
+			for(i=0;(i<pg->count) && (i<PINDEX_EPP);i++) {
+				e = &pg->entry[i];
+				if(!e->key) continue;
+				entry.block		= e->key-1;
+				entry.slot		= e->slot;
+				entry.usecount	= e->usecount;
+				entry.dirty		= e->dirty;
+				entry.dtime		= e->dtime;
+				if(!(ret = fn(&entry,arg))) break;
+			}
+		}
+	}
+	free(buffer);
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexStats		- log page cache and lookup latency figures
+//
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t pindexPercentile(double q)
+{
+	uint64_t	want = (uint64_t)(pindex_stats.lookups*q);
+	uint64_t	seen = 0;
+	int			i;
+
+	for(i=0;i<64;i++) {
+		seen += pindex_stats.hist[i];
+		if( seen > want ) return i ? 1ULL<<i : 0;
+	}
+	return pindex_stats.lat_max;
+}
+
+void pindexStats()
+{
+	uint64_t pages = pindex_stats.page_hits+pindex_stats.page_misses;
+
+	syslog(LOG_INFO,"PINDEX STATS");
+	syslog(LOG_INFO,"Pages %ld, in RAM %ld (1:%ld)",(unsigned long)pindex.pages,
+		   (unsigned long)pindex.nframes,(unsigned long)(pindex.pages/pindex.nframes));
+	syslog(LOG_INFO,"Lookups %lld, page hit %.2f%%, prefetched %lld (%lld used), writebacks %lld",
+		   (unsigned long long)pindex_stats.lookups,
+		   pages ? 100.0*pindex_stats.page_hits/pages : 0.0,
+		   (unsigned long long)pindex_stats.prefetched,
+		   (unsigned long long)pindex_stats.prefetch_hits,
+		   (unsigned long long)pindex_stats.writebacks);
+	syslog(LOG_INFO,"Lookup latency avg %lldns, p50 < %lldns, p99 < %lldns, max %lldns",
+		   (unsigned long long)(pindex_stats.lookups ? pindex_stats.lat_ns/pindex_stats.lookups : 0),
+		   (unsigned long long)pindexPercentile(0.50),
+		   (unsigned long long)pindexPercentile(0.99),
+		   (unsigned long long)pindex_stats.lat_max);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	pindexBench		- lookup latency at a range of RAM to index ratios
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define PINDEX_SAMPLE 65536
+
+int pindexSample(hash_entry* entry,void* arg)
+{
+	uint64_t*	sample = (uint64_t*)arg;
+	uint64_t	n = sample[0]++;
+
+	if( n < PINDEX_SAMPLE ) sample[n+1] = entry->block;
+	else if( (n = random() % (n+1)) < PINDEX_SAMPLE ) sample[n+1] = entry->block;
+	return True;
+}
+
+void pindexBench(int count)
+{
+	uint64_t*	sample = (uint64_t*)malloc((PINDEX_SAMPLE+1)*sizeof(uint64_t));
+	uint32_t	nframes = pindex.nframes;
+	uint64_t	nsample,pages;
+	hash_entry	entry;
+	int			ratio,i;
+
+	sample[0] = 0;
+	pindexWalk(pindexSample,sample);
+	nsample = sample[0] < PINDEX_SAMPLE ? sample[0] : PINDEX_SAMPLE;
+	if(!nsample) {
+		printf("Index is empty, nothing to look up\n");
+		free(sample);
+		return;
+	}
+	printf("Index pages %ld (%ldM), %lld sampled keys, %d lookups per ratio\n",
+		   (unsigned long)pindex.pages,(unsigned long)((uint64_t)pindex.pages*PINDEX_PSIZE/1024/1024),
+		   (unsigned long long)nsample,count);
+	printf("+--------+----------+---------+---------+---------+---------+\n");
+	printf("| %6s | %8s | %7s | %7s | %7s | %7s |\n","Ratio","RAM","Hit %","Avg ns","p50 ns","p99 ns");
+	printf("+--------+----------+---------+---------+---------+---------+\n");
+	for(ratio=1;ratio<=64;ratio*=2) {
+		if(!pindexFrames(pindex.pages/ratio)) break;
+		for(i=0;i<count;i++) pindexGet(sample[1+random()%nsample],&entry);
+		memset(&pindex_stats,0,sizeof(pindex_stats));
+		for(i=0;i<count;i++) pindexGet(sample[1+random()%nsample],&entry);
+		pages = pindex_stats.page_hits+pindex_stats.page_misses;
+		printf("| 1:%-4d | %7.1fM | %7.2f | %7lld | %7lld | %7lld |\n",ratio,
+			   (double)pindex.nframes*PINDEX_PSIZE/1024/1024,
+			   pages ? 100.0*pindex_stats.page_hits/pages : 0.0,
+			   (unsigned long long)(pindex_stats.lat_ns/pindex_stats.lookups),
+			   (unsigned long long)pindexPercentile(0.50),
+			   (unsigned long long)pindexPercentile(0.99));
+	}
+	printf("+--------+----------+---------+---------+---------+---------+\n");
+	pindexFrames(nframes);
+	free(sample);
+}
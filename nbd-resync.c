@@ -0,0 +1,442 @@
+/*
+ *      nbd-resync.c
+ *      (c) Gareth Bult 2012
+ *
+ *	Incremental resync of backend hosts that have missed writes.
+ *
+ *	Each host has a bitmap with a bit per resync_region of its own address
+ *	space. Any write that fails on a host (or can't be sent because the
+ *	host is down) sets the bit for the regions it touched, and the map is
+ *	kept on disk (resync_path) so it outlives a restart. The DIRTY bits in
+ *	the cache only cover blocks the cache still holds, this covers the lot.
+ *
+ *	Once the host is back a small pool of threads per host copies just the
+ *	marked regions over, in offset order, from another mirror (or rebuilt
+ *	from the other shards for erasure coded volumes). Copies are capped at
+ *	resync_rate MB/s and go through the governor (nbd-governor.c) so they
+ *	back off while foreground requests are suffering. A foreground write
+ *	that lands on a region while it's being copied leaves the bit set, and
+ *	the region goes round again.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "nbd.h"
+
+#define RESYNC_THREADS	8		// most threads per host
+#define RESYNC_MAGIC	"NBDRSYNC"
+
+typedef struct resync_header {
+
+	char		magic[8];
+	uint32_t	region;			// KB
+	uint32_t	spare;
+	uint64_t	regions;
+
+} resync_header;
+
+typedef struct resync_host {
+
+	int				host;						// 0 based
+	int				fd;							// map file, -1 if memory only
+	uint8_t*		map;						// a bit per region this host hasn't got
+	uint64_t		marked;
+	uint64_t		cursor;						// next region, copies go in offset order
+	uint64_t		active[RESYNC_THREADS];		// region+1 being copied, 0 if none
+	int				raced[RESYNC_THREADS];		// written to while being copied
+	int				inflight;
+	pthread_t		threads[RESYNC_THREADS];
+	struct timeval	pace;						// when the next copy may start
+	struct timeval	start;						// of the current resync
+	uint64_t		marks,copied,bytes,races,failed;
+
+} resync_host;
+
+char*			resync_path		= NULL;	// directory for the maps, NULL = memory only
+int				resync_region	= 1024;	// KB per bit
+int				resync_rate		= 50;	// MB/s per host (0=unlimited)
+int				resync_threads	= 2;	// per host
+
+resync_host		resync_hosts[MAX_HOSTS];
+int				resync_count	= 0;
+uint64_t		resync_regions	= 0;
+uint64_t		resync_hsize	= 0;
+int				resync_running	= False;
+pthread_mutex_t	resync_lock		= PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	resync_cond		= PTHREAD_COND_INITIALIZER;
+__thread int	resync_self		= False;	// set in the workers, their writes don't race
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	resyncBit	- is a region marked for a host
+//	resyncSave	- write the byte holding a region's bit, synced if asked
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int resyncBit(resync_host* h,uint64_t region)
+{
+	return (h->map[region>>3] >> (region&7)) & 1;
+}
+
+void resyncSave(resync_host* h,uint64_t region,int sync)
+{
+	if( h->fd == -1 ) return;
+	if( pwrite(h->fd,&h->map[region>>3],1,sizeof(resync_header)+(region>>3)) != 1 )
+		syslog(LOG_ALERT,"Unable to update resync map for host %d, err=%d",h->host,errno);
+	else if( sync ) fdatasync(h->fd);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	resyncMark	- a write to "host" failed, it'll need these regions again
+//	resyncTouch	- a write is on its way to "host", spoil any copy under it
+//
+//	Both are called from the backend with the host's lock held. A new mark
+//	is synced to disk before we return, so it can't be lost if the write is
+//	acked by the other mirrors and we then go down.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void resyncMark(int host,uint64_t off,uint32_t len)
+{
+	resync_host	*h = &resync_hosts[host];
+	uint64_t	r,first,last;
+
+	if( !len || (host >= resync_count) || !h->map ) return;
+	pthread_mutex_lock(&resync_lock);
+	first = off/(resync_region*1024ULL);
+	last = (off+len-1)/(resync_region*1024ULL);
+	for(r=first;(r<=last) && (r<resync_regions);r++) {
+		if( resyncBit(h,r) ) continue;
+		if( !h->marked++ ) gettimeofday(&h->start,NULL);
+		h->map[r>>3] |= 1<<(r&7);
+		h->marks++;
+		resyncSave(h,r,True);
+	}
+	pthread_mutex_unlock(&resync_lock);
+	resyncTouch(host,off,len);
+}
+
+void resyncTouch(int host,uint64_t off,uint32_t len)
+{
+	resync_host	*h = &resync_hosts[host];
+	uint64_t	first,last;
+	int			i;
+
+	if( resync_self || (host >= resync_count) || !h->inflight ) return;
+	pthread_mutex_lock(&resync_lock);
+	first = off/(resync_region*1024ULL)+1;
+	last = (off+len-1)/(resync_region*1024ULL)+1;
+	for(i=0;i<RESYNC_THREADS;i++)
+		if( (h->active[i] >= first) && (h->active[i] <= last) ) h->raced[i] = True;
+	pthread_mutex_unlock(&resync_lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	resyncNext		- next marked region not already being copied, -1 if none
+//	resyncSource	- fill "buf" with what "host" should have for a range
+//
+//	The cursor sweeps up the volume and wraps, so regions marked behind it
+//	(or spoiled by a racing write) are picked up on the next sweep.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int64_t resyncNext(resync_host* h)
+{
+	uint64_t	n,r;
+	int			i,busy;
+
+	for(n=0;n<resync_regions;n++) {
+		r = (h->cursor+n)%resync_regions;
+		if( !h->map[r>>3] ) {
+			n += 7-(r&7);
+			continue;
+		}
+		if( !resyncBit(h,r) ) continue;
+		for(i=busy=0;i<RESYNC_THREADS;i++) if( h->active[i] == r+1 ) busy = True;
+		if( busy ) continue;
+		h->cursor = r+1;
+		return r;
+	}
+	return -1;
+}
+
+int resyncSource(resync_host* h,uint64_t region,uint64_t off,char* buf,uint32_t len)
+{
+	uint32_t	skip;
+	int			i;
+
+	if( backend_layout == LAYOUT_EC ) return ecResync(h->host,off,buf,len);
+	//
+	//	Anything already written to the other mirrors has to be there
+	//	before we read it, anything later will spoil the copy
+	//
+	skip = backendSkip(h->host/backend_mirrors) | (1<<h->host);
+	for(i=0;i<backend_count;i++) {
+		if( skip & (1<<i) ) continue;
+		pthread_mutex_lock(&resync_lock);
+		if( (i < resync_count) && resyncBit(&resync_hosts[i],region) ) skip |= 1<<i;
+		pthread_mutex_unlock(&resync_lock);
+		pthread_mutex_lock(&backends[i].lock);
+		backendSettle(&backends[i],off,len);
+		pthread_mutex_unlock(&backends[i].lock);
+	}
+	return backendReadFrom(off,buf,len,skip);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	resyncPace	- hold a copy back to resync_rate
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void resyncPace(resync_host* h,uint32_t len)
+{
+	struct timeval	now,at;
+	int64_t			usecs;
+
+	if( resync_rate ) {
+		pthread_mutex_lock(&resync_lock);
+		gettimeofday(&now,NULL);
+		if( timercmp(&h->pace,&now,<) ) h->pace = now;
+		at = h->pace;
+		usecs = (uint64_t)len*1000000ULL/(resync_rate*1048576ULL);
+		h->pace.tv_usec += usecs%1000000;
+		h->pace.tv_sec += usecs/1000000+h->pace.tv_usec/1000000;
+		h->pace.tv_usec %= 1000000;
+		pthread_mutex_unlock(&resync_lock);
+		usecs = (at.tv_sec-now.tv_sec)*1000000LL+at.tv_usec-now.tv_usec;
+		if( usecs > 0 ) usleep(usecs);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	resyncThread	- worker, one of resync_threads per host
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void* resyncThread(void* arg)
+{
+	resync_host		*h = (resync_host*)arg;
+	struct timespec	ts;
+	struct timeval	end;
+	uint64_t		off;
+	uint32_t		len;
+	int64_t			region;
+	char			*buf = (char*)malloc(resync_region*1024);
+	int				me,ok,up;
+
+	resync_self = True;
+	pthread_mutex_lock(&resync_lock);
+	while( resync_running ) {
+		region = -1;
+		if( h->marked ) {
+			pthread_mutex_unlock(&resync_lock);
+			up = backendUp(h->host);
+			pthread_mutex_lock(&resync_lock);
+			if( up ) region = resyncNext(h);
+		}
+		if( region == -1 ) {
+			clock_gettime(CLOCK_REALTIME,&ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&resync_cond,&resync_lock,&ts);
+			continue;
+		}
+		for(me=0;h->active[me];me++);
+		h->active[me] = region+1;
+		h->raced[me] = False;
+		h->inflight++;
+		pthread_mutex_unlock(&resync_lock);
+
+		off = region*resync_region*1024ULL;
+		len = resync_hsize-off < resync_region*1024ULL ? resync_hsize-off : resync_region*1024;
+		resyncPace(h,len);
+		govEnter(GOV_RESYNC,h->host,len);
+		ok = resyncSource(h,region,off,buf,len) && backendRequest(h->host,NBD_WRITE,off,buf,len);
+		govExit(GOV_RESYNC,h->host,len);
+
+		pthread_mutex_lock(&resync_lock);
+		h->active[me] = 0;
+		h->inflight--;
+		if( !ok ) {
+			h->failed++;
+			h->cursor = region;		// try again from here once it's back
+		} else if( h->raced[me] ) h->races++;
+		else if( resyncBit(h,region) ) {
+			h->map[region>>3] &= ~(1<<(region&7));
+			resyncSave(h,region,False);
+			h->copied++;
+			h->bytes += len;
+			if( !--h->marked ) {
+				gettimeofday(&end,NULL);
+				syslog(LOG_INFO,"%s :: Resync complete, %lldMB copied in %lds",backends[h->host].name,
+					   (unsigned long long)h->bytes>>20,(long)(end.tv_sec-h->start.tv_sec));
+			}
+		}
+		pthread_cond_broadcast(&resync_cond);
+		if( !ok ) {
+			clock_gettime(CLOCK_REALTIME,&ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&resync_cond,&resync_lock,&ts);
+		}
+	}
+	pthread_mutex_unlock(&resync_lock);
+	free(buf);
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	resyncLoad	- read (or create) the map for a host
+//
+//	A host with no map, or a map for a different geometry, is taken to be
+//	in step; anything else is a job for a full rebuild.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void resyncLoad(resync_host* h,char* name)
+{
+	resync_header	header;
+	char			path[512];
+	uint64_t		bytes = (resync_regions+7)/8,r;
+
+	h->fd = -1;
+	h->map = (uint8_t*)calloc(bytes,1);
+	if( !resync_path ) return;
+	snprintf(path,sizeof(path),"%s/%s.%s.map",resync_path,name,backends[h->host].name);
+	if( (h->fd = open(path,O_RDWR|O_CREAT,0644)) == -1 ) {
+		syslog(LOG_ALERT,"Unable to open resync map [%s], err=%d",path,errno);
+		return;
+	}
+	if( (read(h->fd,&header,sizeof(header)) == sizeof(header)) &&
+		!memcmp(header.magic,RESYNC_MAGIC,sizeof(header.magic)) &&
+		(header.region == resync_region) && (header.regions == resync_regions) &&
+		(read(h->fd,h->map,bytes) == bytes) ) {
+		for(r=0;r<resync_regions;r++) h->marked += resyncBit(h,r);
+		if( h->marked ) {
+			gettimeofday(&h->start,NULL);
+			syslog(LOG_INFO,"%s :: %lld regions (%lldMB) waiting to resync",backends[h->host].name,
+				   (unsigned long long)h->marked,(unsigned long long)h->marked*resync_region>>10);
+		}
+		return;
+	}
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,RESYNC_MAGIC,sizeof(header.magic));
+	header.region = resync_region;
+	header.regions = resync_regions;
+	if( (pwrite(h->fd,&header,sizeof(header),0) != sizeof(header)) ||
+		(pwrite(h->fd,h->map,bytes,sizeof(header)) != bytes) || ftruncate(h->fd,sizeof(header)+bytes) ) {
+		syslog(LOG_ALERT,"Unable to write resync map [%s], err=%d",path,errno);
+		close(h->fd);
+		h->fd = -1;
+	} else fdatasync(h->fd);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	resyncStart	- load the maps and start the workers, "hsize" is per host
+//	resyncStop	- stop the workers and put the maps away
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int resyncStart(char* name,uint64_t hsize)
+{
+	resync_host	*h;
+	int			i,t,redundant = (backend_mirrors > 1) || (backend_layout == LAYOUT_EC);
+
+	if(resync_running) return True;
+	if( resync_threads > RESYNC_THREADS ) resync_threads = RESYNC_THREADS;
+	if( resync_region < NCACHE_BSIZE/1024 ) resync_region = NCACHE_BSIZE/1024;
+	resync_hsize = hsize;
+	resync_regions = (hsize+resync_region*1024ULL-1)/(resync_region*1024ULL);
+	for(i=0;i<backend_count;i++) {
+		h = &resync_hosts[i];
+		memset(h,0,sizeof(resync_host));
+		h->host = i;
+		resyncLoad(h,name);
+	}
+	resync_count = backend_count;
+	if( !redundant ) {
+		syslog(LOG_INFO,"Resync off, layout %s has no second copy to resync from",backend_layout_names[backend_layout]);
+		return True;
+	}
+	resync_running = True;
+	for(i=0;i<resync_count;i++) {
+		for(t=0;t<resync_threads;t++) {
+			if( pthread_create(&resync_hosts[i].threads[t],NULL,resyncThread,&resync_hosts[i]) != 0 ) {
+				syslog(LOG_ALERT,"Error creating resync thread, err=%d",errno);
+				resyncStop();
+				return False;
+			}
+		}
+	}
+	syslog(LOG_INFO,"Resync started, %lld regions of %dK, %d threads per host, %dMB/s, maps in %s",
+		   (unsigned long long)resync_regions,resync_region,resync_threads,resync_rate,
+		   resync_path ? resync_path : "memory");
+	return True;
+}
+
+void resyncStop()
+{
+	resync_host	*h;
+	int			i,t;
+
+	pthread_mutex_lock(&resync_lock);
+	resync_running = False;
+	pthread_cond_broadcast(&resync_cond);
+	pthread_mutex_unlock(&resync_lock);
+	for(i=0;i<resync_count;i++) {
+		h = &resync_hosts[i];
+		for(t=0;t<RESYNC_THREADS;t++)
+			if(h->threads[t]) pthread_join(h->threads[t],NULL);
+	}
+	pthread_mutex_lock(&resync_lock);
+	for(i=0;i<resync_count;i++) {
+		h = &resync_hosts[i];
+		if( h->fd != -1 ) {
+			if( pwrite(h->fd,h->map,(resync_regions+7)/8,sizeof(resync_header)) != (resync_regions+7)/8 )
+				syslog(LOG_ALERT,"Unable to save resync map for %s, err=%d",backends[i].name,errno);
+			fdatasync(h->fd);
+			close(h->fd);
+		}
+		free(h->map);
+		h->map = NULL;
+	}
+	resync_count = 0;
+	pthread_mutex_unlock(&resync_lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//	resyncStats	- log per host resync figures
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void resyncStats()
+{
+	resync_host	*h;
+	int			i;
+
+	syslog(LOG_INFO,"RESYNC STATS");
+	syslog(LOG_INFO,"Regions %lld x %dK, rate %dMB/s, %d threads per host",
+		   (unsigned long long)resync_regions,resync_region,resync_rate,resync_threads);
+	for(i=0;i<resync_count;i++) {
+		h = &resync_hosts[i];
+		syslog(LOG_INFO,"%-16s :: behind %lld regions (%lldMB), marked %lld, copied %lld (%lldMB), raced %lld, failed %lld",
+			   backends[i].name,(unsigned long long)h->marked,(unsigned long long)h->marked*resync_region>>10,
+			   (unsigned long long)h->marks,(unsigned long long)h->copied,(unsigned long long)h->bytes>>20,
+			   (unsigned long long)h->races,(unsigned long long)h->failed);
+	}
+}
@@ -3,6 +3,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #define NBD_SET_SOCK    _IO( 0xab, 0 )
 #define NBD_SET_BLKSIZE _IO( 0xab, 1 )
@@ -105,6 +107,7 @@ typedef struct hash_entry {
 	uint32_t	slot;
 	uint32_t	usecount;
 	uint8_t		dirty;
+	uint32_t	dtime;		// when last written, for destage pacing
 } hash_entry;
 
 typedef struct cache_entry {
@@ -123,9 +126,25 @@ typedef struct cache_header {
 	struct in_addr	hosts[6];
 	uint8_t			open;
 	uint8_t			reindex;
+	uint8_t			paged;			// block index lives on the device
+	uint32_t		index_pages;	// pages in the on-device index
+	uint64_t		index_offset;	// start of the on-device index
+	uint8_t			version;		// format, 0 (or 1) for slots with inline headers
+	uint64_t		meta_offset;	// v2, start of the metadata region
 		
 } __attribute__ ((packed)) cache_header;
 
+//	v2 format; a metadata region of these, one per slot, then 4K data slots
+
+typedef struct cache_meta {
+
+	uint64_t	block;
+	uint32_t	usecount;
+	uint8_t		dirty;
+	uint8_t		spare[3];
+
+} cache_meta;
+
 struct thread_info {    /* Used as argument to thread_start() */
            pthread_t thread_id;        /* ID returned by pthread_create() */
            int       thread_num;       /* Application-defined thread # */
@@ -138,8 +157,34 @@ struct thread_info {    /* Used as argument to thread_start() */
 #define NCACHE_CSIZE 32768
 #define NCACHE_BSIZE 4096
 #define NCACHE_ESIZE (NCACHE_BSIZE + sizeof(cache_entry))
+#define CACHE_VERSION 2			// current format, aligned data and separate metadata
 #define CACHE_FACTOR 0.02
 
+//	Paged on-SSD block index (see nbd-pindex.c)
+
+#define PINDEX_PSIZE 4096
+#define PINDEX_RUN   32
+#define PINDEX_TOMB  0xFFFFFFFF
+
+typedef struct pindex_entry {
+
+	uint64_t	key;		// block+1, zero means never used
+	uint32_t	slot;		// PINDEX_TOMB when deleted
+	uint32_t	usecount;
+	uint8_t		dirty;
+	uint32_t	dtime;
+
+} __attribute__ ((packed)) pindex_entry;
+
+#define PINDEX_EPP ((PINDEX_PSIZE-sizeof(uint32_t))/sizeof(pindex_entry))
+
+typedef struct pindex_page {
+
+	uint32_t		count;	// entries in use (live or tombstone)
+	pindex_entry	entry[PINDEX_EPP];
+
+} __attribute__ ((packed)) pindex_page;
+
 
 #define	DATA_SEEK(slot,label)																				\
 	cache_tmp = data_offset + (slot*NCACHE_ESIZE);															\
@@ -223,6 +268,325 @@ struct thread_info {    /* Used as argument to thread_start() */
 
 uint64_t ntohll(uint64_t);
 int cacheRead(uint64_t,char*,int);
+void cachePrefetch(uint64_t,int);
+
+extern int pindex_budget;
+int  pindexOpen(int,uint64_t,uint32_t);
+void pindexClose();
+void pindexSync();
+int  pindexClear();
+int  pindexGet(uint64_t,hash_entry*);
+int  pindexPut(hash_entry*);
+int  pindexDel(uint64_t);
+int  pindexWalk(int (*)(hash_entry*,void*),void*);
+void pindexPrefetch(uint64_t,int);
+void pindexStats();
+void pindexBench(int);
+
+extern int cache_extents;
+int  extentOpen(uint64_t);
+void extentClose();
+int  extentGet(uint64_t,hash_entry*);
+int  extentPut(hash_entry*,uint32_t);
+int  extentDel(uint64_t,uint32_t);
+int  extentRange(uint64_t,uint32_t,hash_entry*,uint8_t*);
+int  extentWalk(int (*)(hash_entry*,void*),void*);
+void extentStats();
+
+#define EVICT_ARC	0
+#define EVICT_2Q	1
+#define EVICT_BATCH	255
+#define RECLAIM_BATCH	4096	// most blocks the reclaimer evicts per cache_lock
+
+extern int evict_policy;
+extern char* evict_names[];
+int  evictInit(uint32_t);
+void evictClose();
+void evictInsert(uint64_t,uint32_t);
+void evictAccess(uint64_t);
+void evictMiss(uint64_t);
+void evictRemove(uint64_t);
+int  evictVictim(uint64_t*,uint32_t*);
+uint32_t evictClean();
+void evictStats();
+int  cacheExpire(int);
+
+extern int admit_threshold;
+int  admitInit(uint64_t);
+void admitClose();
+void admitRecord(uint64_t);
+int  admitEstimate(uint64_t);
+int  admitCheck(uint64_t,uint64_t*);
+void admitStats();
+int  cacheAdmit(uint64_t);
+int  cacheInsert(uint64_t,char*,int);
+int  evictPeek(uint64_t*);
+
+#define HALLOC_BUCKETS 24		// free extent histogram, log2 of the size
+
+void hallocInit(uint32_t);
+void hallocLoad(void*,int);
+void hallocAllocate(uint32_t*,int*);
+uint64_t hallocAvailable();
+uint64_t hallocExtents(uint64_t*,int,uint64_t*);
+uint32_t hallocCount(uint32_t,uint32_t);
+int hallocTake(uint32_t,int);
+void hallocFree(uint32_t,uint64_t);
+void hallocFreeList(uint32_t*,uint64_t*,int);
+void hallocBegin();
+void hallocEnd();
+void hallocStats();
+
+//	Backend hosts (see nbd-backend.c)
+
+#define MAX_HOSTS 6
+
+#define BACKEND_CONNS 8			// most connections per host
+
+#define QUORUM_ALL		0		// write acked by every host
+#define QUORUM_MAJORITY	1
+#define QUORUM_FIRST	2		// first ack, the rest finish in the background
+
+#define LAYOUT_RAID1	0		// every host has the whole volume
+#define LAYOUT_RAID0	1		// striped, one copy
+#define LAYOUT_RAID10	2		// striped over sets of backend_copies mirrors
+#define LAYOUT_EC		3		// striped, ec_k data + the rest parity (nbd-ec.c)
+
+#define LAT_BUCKETS 512
+
+typedef struct latency_hist {
+
+	uint64_t	count;
+	uint64_t	bucket[LAT_BUCKETS];	// log2 with 8 linear steps each
+
+} latency_hist;
+
+typedef struct backend_group {
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int					acks,fails;
+	struct backend_req*	first;		// first to ack
+
+} backend_group;
+
+typedef struct backend_hedge {
+
+	backend_group		g;
+	struct backend_req	*r,*h;		// the read, and its hedge if sent
+	struct timespec		ts;			// hedge if no reply by then
+	int					host,other;	// other is -1 if we won't hedge
+	uint32_t			skip;
+
+} backend_hedge;
+
+typedef struct backend_chunk {
+
+	uint64_t	hoff;			// offset on the host
+	uint32_t	boff;			// offset into the caller's buffer
+	uint32_t	len;
+	int			col;			// stripe column, hosts col*mirrors ...
+
+} backend_chunk;
+
+typedef struct backend_req {
+
+	uint64_t			handle;
+	uint32_t			cmd;
+	uint64_t			off;
+	char*				buf;
+	uint32_t			len;
+	int					done,ok;
+	int					detached;		// nobody waiting, free on completion
+	int					busy;			// receiver is reading the data
+	int					background;		// sent on behalf of the governor
+	backend_group*		group;			// counts acks for backendWrite
+	struct timeval		start;
+	struct backend_req*	next;
+
+} backend_req;
+
+typedef struct backend_conn {
+
+	int					sock;
+	int					up;
+	pthread_t			thread;			// receiver, also does the reconnects
+	pthread_mutex_t		wlock;			// one sender at a time
+	backend_req*		pending;		// sent, waiting for a reply
+	uint32_t			inflight;
+	struct backend_host* host;
+
+} backend_conn;
+
+typedef struct backend_host {
+
+	char*			name;
+	char*			export;
+	int				running;
+	pthread_mutex_t	lock;			// pending lists, handles and stats
+	pthread_cond_t	cond;			// signalled on every completion
+	uint64_t		handle;
+	backend_conn	conns[BACKEND_CONNS];
+	int				nconns;
+	uint64_t		reads,writes;
+	uint64_t		rbytes,wbytes;
+	uint64_t		usecs,failed;
+	uint64_t		reconnects;
+	uint64_t		async_done,async_failed;
+	uint32_t		inflight,peak;
+	double			ewma;			// smoothed request latency, usecs
+	latency_hist	rhist;			// read latency on this host
+	latency_hist	whist;			// write latency on this host
+
+} backend_host;
+
+extern backend_host backends[];
+extern int backend_count;
+extern int backend_conns;
+extern int backend_quorum;
+extern int backend_split;
+extern int backend_layout;
+extern int backend_copies;
+extern int backend_mirrors;
+extern int backend_stripes;
+extern int stripe_unit;
+extern char* backend_layout_names[];
+extern int hedge_pct;
+extern int hedge_budget;
+extern char* backend_quorum_names[];
+void latRecord(latency_hist*,uint64_t);
+uint64_t latPercentile(latency_hist*,double);
+int  backendOpen(char**,char*,uint64_t*);
+void backendClose();
+backend_req* backendSubmit(int,uint32_t,uint64_t,char*,uint32_t,backend_group*);
+int  backendWait(int,backend_req*);
+int  backendRequest(int,uint32_t,uint64_t,char*,uint32_t);
+int  backendRead(uint64_t,char*,uint32_t);
+int  backendWrite(uint64_t,char*,uint32_t,uint8_t*);
+int  backendWriteHost(int,uint64_t,char*,uint32_t);
+int  backendChunks(uint64_t,uint32_t,backend_chunk**);
+uint32_t backendSkip(int);
+void backendSettle(backend_host*,uint64_t,uint32_t);
+int  backendUp(int);
+int  backendReadFrom(uint64_t,char*,uint32_t,uint32_t);
+uint8_t backendDirtyMask(uint64_t);
+void backendStats();
+
+//	Erasure coding (see nbd-ec.c)
+
+extern int ec_k;
+int  ecInit(int,int);
+int  ecRead(uint64_t,char*,uint32_t);
+int  ecWrite(uint64_t,char*,uint32_t);
+int  ecWriteHost(int,uint64_t,char*,uint32_t);
+int  ecResync(int,uint64_t,char*,uint32_t);
+uint8_t ecDirtyMask(uint64_t);
+void ecStats();
+void ecBench(int,int);
+
+//	Resync of hosts that missed writes (see nbd-resync.c)
+
+extern char* resync_path;
+extern int resync_region;
+extern int resync_rate;
+extern int resync_threads;
+void resyncMark(int,uint64_t,uint32_t);
+void resyncTouch(int,uint64_t,uint32_t);
+int  resyncStart(char*,uint64_t);
+void resyncStop();
+void resyncStats();
+
+//	Background IO governor (see nbd-governor.c)
+
+#define GOV_DESTAGE		0		// classes, highest priority first
+#define GOV_CLEAN		1
+#define GOV_RESYNC		2
+#define GOV_SCRUB		3
+#define GOV_WARM		4
+#define GOV_CLASSES		5
+
+extern int gov_enabled;
+extern int gov_slo_ssd;
+extern int gov_slo_host;
+void govSample(int,uint64_t);
+int  govBackground();
+void govEnter(int,int,uint32_t);
+void govExit(int,int,uint32_t);
+int  govStart();
+void govStop();
+void govStats();
+
+//	Log structured cache layout (see nbd-log.c)
+
+extern int log_segment;
+extern int log_clean;
+extern int log_reserve;
+extern int log_running;
+int  logWrite(uint32_t,void*,int);
+int  logWriteAt(int,uint64_t,void*,int);
+void logAllocate(uint32_t*,int*);
+int  logStart();
+void logStop();
+void logStats();
+
+#define CACHE_WB	0
+#define CACHE_WT	1
+#define CACHE_WA	2
+#define MAX_EXPORTS	64
+
+extern int cache_mode;
+extern char* cache_mode_file;
+extern char* cache_mode_names[];
+int  cacheModeParse(char*);
+int  cacheModeLoad();
+void cacheSetExport(char*);
+int  cacheExportMode();
+int  cacheWriteAround(uint64_t,char*,int);
+struct write_flight* writeFind(uint64_t,uint32_t);
+
+extern pthread_mutex_t cache_lock;
+extern uint64_t cache_dirty;
+extern int miss_coalesce;
+extern int dirty_limit;
+extern int throttle_max;
+void cacheInvalidate(uint64_t,int);
+extern int reclaim_low;
+extern int reclaim_high;
+void reclaimKick();
+int  reclaimStart();
+void reclaimStop();
+void reclaimStats();
+extern int cache_version;
+extern int cache_direct;
+uint64_t slotOffset(uint32_t);
+int  cacheReadSlot(uint32_t,char*);
+int  cacheReadSlots(uint32_t,char*,cache_entry*,int);
+int  cacheWriteSlots(uint32_t,char*,cache_entry*,int);
+int  cacheMigrate(char*);
+int  cacheStore(uint64_t,char*,int,uint8_t);
+int  indexGet(uint64_t,hash_entry*);
+int  indexPutRun(hash_entry*,int);
+int  indexGetRun(uint64_t,int,hash_entry*,uint8_t*);
+uint32_t indexUpdateRun(uint32_t,cache_entry*,int);
+int  indexPut(hash_entry*,uint8_t);
+int  indexDel(uint64_t);
+int  cacheFlush(uint64_t,int);
+int  cacheClean(uint64_t,int,uint32_t,uint32_t);
+int  cacheDirtyWalk(int (*)(hash_entry*,void*),void*);
+int  cacheDirtyRatio();
+
+extern int destage_threads;
+extern int destage_delay;
+extern int destage_ratio;
+int  destageStart();
+void destageStop();
+void destageWait(uint64_t,uint32_t);
+void destageKick();
+void destageStats();
+
+int  cacheBypassRead(uint64_t,char*,int);
+int  cacheBypassWrite(uint64_t,char*,int);
+void cacheStats();
 
 #define PUT_DIRTY \
 	if(hash_dirty->put(hash_dirty,NULL,&key,&val,0)!=0) \
@@ -52,6 +52,22 @@ int             pcount=0;
 char*			dev="/dev/cache/onegig";
 char*			hosts[10];
 int 			hostp=0;
+int				seq_cutoff = 4096;	// KB of sequential IO before a stream skips the cache (0=off)
+int				seq_iosize = 64;	// KB, smaller requests always go through the cache
+volatile int	stats_pending = False;
+volatile int	modes_pending = False;
+
+typedef struct session_info {
+
+	int			sock;
+	int			joined;		// counted in "sessions"
+
+} session_info;
+
+pthread_mutex_t	session_lock = PTHREAD_MUTEX_INITIALIZER;
+int				sessions = 0;		// sessions sharing the backend connections
+char*			session_export = NULL;
+uint64_t		session_size;
 
 void doLog(char *text)
 {
@@ -80,6 +96,11 @@ void doKill()
 	//	ioctl(procs[i].nbd, NBD_CLEAR_SOCK);
 	//	kill(procs[i].pid,SIGINT);	
     //}
+	destageStop();
+	resyncStop();
+	govStop();
+	reclaimStop();
+	logStop();
 	cacheClose(dev);									
     doLog("NBD server stopped");
 }
@@ -111,42 +132,6 @@ int getNextFreeDev()
     return -1;
 }
 
-int doConnect(char* host)
-{   
-    struct addrinfo hints;
-    struct addrinfo *ai = NULL;
-    struct addrinfo *rp = NULL;
-    int e;
-    int s;    
-    int size = 1;
-
-    memset(&hints,'\0',sizeof(hints));
-    hints.ai_family     = AF_UNSPEC;
-    hints.ai_socktype   = SOCK_STREAM;
-    hints.ai_flags      = AI_ADDRCONFIG | AI_NUMERICSERV;
-    hints.ai_protocol   = IPPROTO_TCP;
-    
-    if( getaddrinfo(host, NBD_SERVER_PORT, &hints, &ai) < 0) {
-        printf("Unable to resolve hostname, errno=%d\n",errno);
-        exit(1);
-    }
-    s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if(s<0) {
-        printf("Unable to allocate socket (%d)\n",errno);
-        exit(errno);    
-    }
-    if(connect(s, ai->ai_addr, ai->ai_addrlen) < 0) {
-        printf("Unable to connect to server, err=%d\n",errno);
-        exit(errno);
-    }   
-    if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &size, sizeof(int)) < 0) {
-        printf("Error setting options, errno=%d\n",errno);
-        exit(errno);
-    }
-    freeaddrinfo(ai);
-    return s;
-}
-
 void setsizes(int nbd, uint64_t size64, int blocksize, uint32_t flags)
 {
 	unsigned long size,xsize;
@@ -163,100 +148,6 @@ void setsizes(int nbd, uint64_t size64, int blocksize, uint32_t flags)
 	ioctl(nbd, BLKGETSIZE, &xsize);
 }
 
-void negotiate(int sock, uint64_t *rsize64, uint32_t *flags, char* name, uint32_t needed_flags, uint32_t client_flags, uint32_t do_opts)
-{
-    uint64_t magic, size64;
-    uint16_t tmp;
-    char buf[256] = "\0\0\0\0\0\0\0\0\0";
-    uint32_t opt;
-    uint32_t namesize;        
-
-    syslog(LOG_INFO,"Client negotiation");
-    if (read(sock, buf, 8) < 0) {
-        syslog(LOG_ERR,"Failed to read PASSWD, err=%d",errno);
-        return;
-    }
-    if (strlen(buf)==0) {
-        syslog(LOG_ERR,"Zero length PASSWD, err=%d",errno);
-        return;
-    }
-    if (strcmp(buf, INIT_PASSWD)) {
-        syslog(LOG_ERR,"Bad PASSWD, err=%d",errno);
-        return;
-    }
-    if (read(sock, &magic, sizeof(magic)) < 0) {
-        syslog(LOG_ERR,"Error reading MAGIC, err=%d",errno);
-        return;
-    }
-    magic = ntohll(magic);
-    if (magic != OPTS_MAGIC) {
-        syslog(LOG_ERR,"Bad MAGIC, err=%d",errno);
-        return;
-    }
-    if(read(sock, &tmp, sizeof(uint16_t)) < 0) {
-        syslog(LOG_ERR,"Error reading flags, err=%d",errno);
-        return;
-    }
-    *flags = ((uint32_t)ntohs(tmp));
-    client_flags = htonl(client_flags);
-    if (write(sock, &client_flags, sizeof(client_flags)) < 0) {
-        syslog(LOG_ERR,"Error returning client flags, err=%d",errno);
-        return;
-    }
-    magic = htonll(OPTS_MAGIC);
-    if (write(sock, &magic, sizeof(magic)) < 0) {
-        syslog(LOG_ERR,"Error writing MAGIC, err=%d",errno);
-        return;
-    }
-    opt = ntohl(NBD_OPT_EXPORT_NAME);
-    if (write(sock, &opt, sizeof(opt)) < 0) {
-        syslog(LOG_ERR,"Error writing command, err=%d",errno);
-        return;        
-    }
-    namesize = (uint32_t)strlen(name);
-    namesize = ntohl(namesize);
-    if (write(sock, &namesize, sizeof(namesize)) < 0) {
-        syslog(LOG_ERR,"Error writing share name, err=%d",errno);
-        return;        
-    }
-    if (write(sock, name, strlen(name)) < 0) {
-        syslog(LOG_ERR,"Error writing share name length, err=%d",errno);
-        return;                
-    }
-    syslog(LOG_ALERT,"SENT NAME=%s",name);
-    if (read(sock, &size64, sizeof(size64)) < 0) {
-        syslog(LOG_ERR,"Error reading size, err=%d",errno);
-        return;                
-    }
-    size64 = ntohll(size64);
-    syslog(LOG_INFO,"Share name is %s, size is %luMB",name,(unsigned long)(size64>>20));
-    if(read(sock, &tmp, sizeof(tmp)) < 0) {
-        syslog(LOG_ERR,"Error reading flags, err=%d",errno);
-        return;                
-    }
-    *flags |= (uint32_t)ntohs(tmp);
-    if (read(sock, &buf, 124) < 0) {
-        syslog(LOG_ERR,"Error reading zeros, err=%d",errno);
-        return;                
-    }
-    *rsize64 = size64;
-}
-
-int doSetup(char* host,char* name,uint64_t *size64)
-{
-    uint32_t flags;
-    uint32_t needed_flags=0;
-    uint32_t cflags=0;
-    uint32_t opts=0;
-    //int blocksize=1024;
-    int s;
-    //
-    s = doConnect(host);
-    negotiate(s, size64, &flags, name, needed_flags, cflags, opts);
-    //setsizes(nbd, *size64, blocksize, flags);    
-    return s;
-}
-
 void bye()
 {
     syslog(LOG_INFO,"** Process %d exited\n",getpid());
@@ -267,6 +158,12 @@ void termination_handler (int signum)
 	exit(0);
 }
 
+void stats_handler (int signum)
+{
+	if(signum == SIGUSR2) modes_pending = True;
+	else stats_pending = True;
+}
+
 
 /*
  *
@@ -419,7 +316,7 @@ void getBytes(int sock,void *buf, size_t len)
 		if( bytes <= 0) {
 			if( errno != EAGAIN ) {
 			doLog("Critical Error in READ");
-			exit(errno);
+			pthread_exit(NULL);
 			}
 		} else {
 			if(debug>2) {
@@ -458,7 +355,7 @@ void putBytes(int sock,void *buf, size_t len)
 	}
 	if( write( sock,buf,len ) < 0) {
 		doLog("Critical Error in WRITE");
-		exit(errno);
+		pthread_exit(NULL);
 	}
 }
 
@@ -498,7 +395,52 @@ static void sendReply(int sock,uint32_t opt,uint32_t reply_type, size_t datasize
 
 //	doNegotiate - negotiate a new connection with the client
 
-int doNegotiate(int sock)
+//	sessionJoin - first session in connects to the backend, the rest share it
+//	sessionLeave - last one out disconnects
+
+int sessionJoin(char* name,uint64_t* size)
+{
+	int ok = True;
+
+	pthread_mutex_lock(&session_lock);
+	if(!sessions) {
+		if(!backendOpen(hosts,name,&session_size)) {
+			syslog(LOG_ALERT,"Unable to connect to backend hosts for [%s]",name);
+			ok = False;
+		} else {
+			session_export = strdup(name);
+			cacheSetExport(name);
+			govStart();
+			destageStart();
+			resyncStart(name,backend_stripes > 1 ? session_size/backend_stripes : session_size);
+		}
+	} else if(strcmp(name,session_export)) {
+		syslog(LOG_ALERT,"Cache is serving [%s], refusing [%s]",session_export,name);
+		ok = False;
+	}
+	if(ok) {
+		sessions++;
+		*size = session_size;
+	}
+	pthread_mutex_unlock(&session_lock);
+	return ok;
+}
+
+void sessionLeave()
+{
+	pthread_mutex_lock(&session_lock);
+	if(!--sessions) {
+		destageStop();
+		resyncStop();
+		govStop();
+		backendClose();
+		free(session_export);
+		session_export = NULL;
+	}
+	pthread_mutex_unlock(&session_lock);
+}
+
+int doNegotiate(int sock,int* joined)
 {
     struct {
         volatile uint64_t magic __attribute__((packed));
@@ -541,21 +483,11 @@ int doNegotiate(int sock)
 	            doLog("EXPORT NAME");
 	            doLog(name);
 				
-		        int sock1 = doSetup(host1,name,&size);
-				if(sock1==-1) {
-					syslog(LOG_ALERT,"Unable to connect to host [%s] - retry in 10s (%d:%d)",host1,sock1,errno);
+				if(!sessionJoin(name,(uint64_t*)&size)) {
+					free(name);
 					return False;
 				}
-				syslog(LOG_INFO,"%s :: Negotiated size=%lld",host1,(unsigned long long) size);
-				int sock2 = doSetup(host1,name,&size);
-				if(sock2==-1) {
-					syslog(LOG_ALERT,"Unable to connect to host [%s] - retry in 10s (%d:%d)",host2,sock2,errno);
-					return False;
-				}
-				syslog(LOG_INFO,"%s :: Negotiated size=%lld",host2,(unsigned long long) size);
-	
-				close(sock1);
-				close(sock2);
+				*joined = True;
 	
 
 /*			pthread_t thread1;
@@ -639,10 +571,50 @@ uint64_t computeChecksum(uint64_t *ptr,int len)
 }
 
 
-//	doSession - process a single client session
+//	seqBypass - track sequential streams, True if this request should skip the cache
+//
+//	Like bcache, we remember where the last few streams were heading. A request
+//	that starts where a stream left off extends it, anything else replaces the
+//	least recently used stream. Once a stream has run for "seq_cutoff" KB, its
+//	large requests go straight to the backend.
+
+#define SEQ_STREAMS 16
+
+struct {
+	uint64_t	next;		// offset the stream should continue from
+	uint64_t	run;		// bytes of sequential IO so far
+	uint64_t	used;		// for LRU replacement
+} seq_streams[SEQ_STREAMS];
+uint64_t seq_clock = 0;
+pthread_mutex_t seq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int seqBypass(uint64_t off,uint32_t len)
+{
+	int i,lru = 0,bypass;
+
+	if(!seq_cutoff) return False;
+	pthread_mutex_lock(&seq_lock);
+	for(i=0;i<SEQ_STREAMS;i++) {
+		if(seq_streams[i].next == off) break;
+		if(seq_streams[i].used < seq_streams[lru].used) lru = i;
+	}
+	if( i == SEQ_STREAMS ) {
+		i = lru;
+		seq_streams[i].run = 0;
+	}
+	seq_streams[i].run += len;
+	seq_streams[i].next = off+len;
+	seq_streams[i].used = ++seq_clock;
+	bypass = (len >= seq_iosize*1024) && (seq_streams[i].run >= (uint64_t)seq_cutoff*1024);
+	pthread_mutex_unlock(&seq_lock);
+	return bypass;
+}
+
+//	doSession - process a single client session, one thread each
 
-void doSession(int sock)
+void doSession(session_info* session)
 {
+	int sock = session->sock;
 	struct nbd_request request;
 	struct nbd_reply reply;
 	char buffer[NCACHE_BSIZE];
@@ -660,19 +632,13 @@ void doSession(int sock)
 	int i;
 	
 	doLog("Enter SESSION");
-	
-	if( cacheOpen(dev,hosts) == -1) {
-		printf("Error opening cache\n");
-		exit(1);
-	}            
-	
 	doConnectionMade(sock);
         
     int h1,h2,h3;
 	uint64_t sum1,sum2;
 	cache_entry *entry1,*entry2;	
         
-	if(doNegotiate(sock)) {
+	if(doNegotiate(sock,&session->joined)) {
 	
 		doLog("Processing DATA requests ...");
                 h1 = fd1;
@@ -684,9 +650,18 @@ void doSession(int sock)
 			off = ntohll(request.from);
 			cmd = ntohl(request.type) & NBD_CMD_MASK_COMMAND;
 			len = ntohl(request.len);
+			if( (cmd == NBD_READ) || (cmd == NBD_WRITE) ) cachePrefetch(off,len);
 			reply.magic = htonl(NBD_REPLY_MAGIC);
 			reply.error = 0;
 			memcpy(reply.handle, request.handle, sizeof(reply.handle));
+			if(stats_pending) {
+				stats_pending = False;
+				cacheStats();
+			}
+			if(modes_pending) {
+				modes_pending = False;
+				cacheModeLoad();
+			}
 			
 			//if(debug) {	
 			//	snprintf(pbuf,sizeof(pbuf),"%s - block [%04llx] %ld blocks, off=%lld, len=%ld",	
@@ -700,8 +675,13 @@ void doSession(int sock)
 			switch(cmd) {
 				case NBD_READ:
 					putBytes(sock,&reply,sizeof(reply));
-					bufp = (char*)malloc(len);
-					if(!cacheRead(off,bufp,len)) {
+					bufp = (char*)valloc(len);
+					if(seqBypass(off,len)) {
+						if(!cacheBypassRead(off,bufp,len)) {
+							syslog(LOG_ALERT,"%% Bypass Read error on block %lld %%",(unsigned long long)off/NCACHE_BSIZE);
+							memset(bufp,0,len);
+						}
+					} else if(!cacheRead(off,bufp,len)) {
 						syslog(LOG_ALERT,"%% Cache Read error on block %lld %%",(unsigned long long)block);
 						memset(bufp,0,len);
 					}
@@ -710,14 +690,29 @@ void doSession(int sock)
 					break;
 
 			case NBD_WRITE:
-				bufp = (char*)malloc(len);
+				bufp = (char*)valloc(len);
 				getBytes(sock,bufp,len);			
+				if(seqBypass(off,len)) {
+					if(!cacheBypassWrite(off,bufp,len))
+						syslog(LOG_ALERT,"%% Bypass Write error on block %lld %%",(unsigned long long)off/NCACHE_BSIZE);
+					putBytes(sock,&reply,sizeof(reply));
+					free(bufp);
+					break;
+				}
 				sum1 = computeChecksum((uint64_t*)bufp,len);
 				if(!cacheWrite(off,bufp,len)) {
 					syslog(LOG_ALERT,"%% Cache Write error on block %lld %%",(unsigned long long)block);
 					memset(bufp,0,len);
 				}
 				putBytes(sock,&reply,sizeof(reply));				
+				//
+				//	Only write-back is sure to leave the blocks in the cache, read
+				//	back from anything else would be a fill from the backend
+				//
+				if( cacheExportMode() != CACHE_WB ) {
+					free(bufp);
+					break;
+				}
 				if(!cacheRead(off,bufp,len)) {				
 						syslog(LOG_ALERT,"%% Cache Read error on block %lld %%",(unsigned long long)block);
 						memset(bufp,0,len);
@@ -731,7 +726,6 @@ void doSession(int sock)
 			
 			case NBD_CLOSE:
 				//putBytes(&reply,sizeof(reply));
-				cacheClose(dev);													
 				running = False;
 				break;
 			
@@ -750,9 +744,25 @@ void doSession(int sock)
 			}	
 		} while( running );          
 	}
-	if(dbm) close(dbm);
+}
+
+void sessionEnd(void* arg)
+{
+	session_info* session = (session_info*)arg;
+
+	if(session->joined) sessionLeave();
+	close(session->sock);
+	free(session);
 	doLog("Exit SESSION");
 }
+
+void* doSessionThread(void* arg)
+{
+	pthread_cleanup_push(sessionEnd,arg);
+	doSession((session_info*)arg);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
 			// OLD WRITE
 				//while( len > 0 ) {
 				 //   getBytes(sock,&buffer,NCACHE_BSIZE);
@@ -813,11 +823,16 @@ void doSession(int sock)
 void doAccept(int listener)
 {
 	int net,f,status,sock;
+	session_info* session;
+	pthread_t thread;
+	pthread_attr_t attr;
 	fd_set rfds;
 	struct sockaddr_storage addrin;
 	socklen_t addrinlen=sizeof(addrin);
 
 	doLog("Enter ACCEPT");
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
 	while(1) {
 		FD_ZERO(&rfds);
 		FD_SET(listener, &rfds);
@@ -842,9 +857,14 @@ void doAccept(int listener)
 				//		exit(0);
 				//	}
 				//} else {
-					doSession(sock);
+					session = (session_info*)calloc(1,sizeof(session_info));
+					session->sock = sock;
+					if( pthread_create(&thread,&attr,doSessionThread,session) != 0 ) {
+						doError("Error creating SESSION thread");
+						close(sock);
+						free(session);
+					}
 				//}
-				close(sock);
 			}
 		}	
 	}
@@ -855,16 +875,125 @@ void doAccept(int listener)
   
 void main(int argc,char **argv)
 {
-    int listener,c,f,status;
+    int listener,c,f,status,bench = False;
     struct sigaction new_action;
  	
-    while ((c = getopt (argc, argv, "da:b:n:")) != -1)
+    while ((c = getopt (argc, argv, "duBEa:b:h:n:i:e:t:s:z:m:c:f:w:p:k:q:x:g:l:r:v:o:y:j:J:G:H:L:M:W:X:S:C:")) != -1)
     {
         switch(c)
     	{
 	    case 'd':
                 debug++;
                 break;
+            case 'u':
+                miss_coalesce = False;
+                break;
+            case 'i':
+                pindex_budget = atoi(optarg);
+                break;
+            case 'e':
+                evict_policy = strcasecmp(optarg,"2q") ? EVICT_ARC : EVICT_2Q;
+                break;
+            case 't':
+                admit_threshold = atoi(optarg);
+                break;
+            case 's':
+                seq_cutoff = atoi(optarg);
+                break;
+            case 'z':
+                seq_iosize = atoi(optarg);
+                break;
+            case 'm':
+                if((cache_mode = cacheModeParse(optarg)) == -1) {
+                    printf("Cache mode should be wb, wt or wa\n");
+                    exit(1);
+                }
+                break;
+            case 'c':
+                cache_mode_file = optarg;
+                break;
+            case 'f':
+                destage_delay = atoi(optarg);
+                break;
+            case 'w':
+                destage_ratio = atoi(optarg);
+                break;
+            case 'p':
+                destage_threads = atoi(optarg);
+                break;
+            case 'k':
+                backend_conns = atoi(optarg);
+                break;
+            case 'g':
+                hedge_pct = atoi(optarg);
+                break;
+            case 'l':
+                hedge_budget = atoi(optarg);
+                break;
+            case 'r':
+                for(f=0;(f<4) && strcasecmp(optarg,backend_layout_names[f]);f++);
+                if(f==4) {
+                    printf("Layout should be raid1, raid0, raid10 or ec\n");
+                    exit(1);
+                }
+                backend_layout = f;
+                break;
+            case 'v':
+                backend_copies = atoi(optarg);
+                break;
+            case 'o':
+                stripe_unit = atoi(optarg);
+                break;
+            case 'y':
+                ec_k = atoi(optarg);
+                break;
+            case 'B':
+                bench = True;
+                break;
+            case 'E':
+                cache_extents = True;
+                break;
+            case 'j':
+                resync_path = optarg;
+                break;
+            case 'J':
+                resync_rate = atoi(optarg);
+                break;
+            case 'G':
+                if(!(gov_slo_host = atoi(optarg))) gov_enabled = False;
+                break;
+            case 'H':
+                gov_slo_ssd = atoi(optarg);
+                break;
+            case 'L':
+                dirty_limit = atoi(optarg);
+                break;
+            case 'M':
+                throttle_max = atoi(optarg);
+                break;
+            case 'W':
+                reclaim_low = atoi(optarg);
+                break;
+            case 'X':
+                reclaim_high = atoi(optarg);
+                break;
+            case 'S':
+                log_segment = atoi(optarg);
+                break;
+            case 'C':
+                log_clean = atoi(optarg);
+                break;
+            case 'x':
+                backend_split = atoi(optarg);
+                break;
+            case 'q':
+                for(f=0;(f<3) && strcasecmp(optarg,backend_quorum_names[f]);f++);
+                if(f==3) {
+                    printf("Write quorum should be all, majority or first\n");
+                    exit(1);
+                }
+                backend_quorum = f;
+                break;
             case 'a':
                 host1 = optarg;
 				hosts[hostp++]=optarg;
@@ -873,10 +1002,21 @@ void main(int argc,char **argv)
                 host2 = optarg;
 				hosts[hostp++]=optarg;
                 break;
+            case 'h':
+                if(hostp==MAX_HOSTS) {
+                    printf("No more than %d hosts\n",MAX_HOSTS);
+                    exit(1);
+                }
+				hosts[hostp++]=optarg;
+                break;
             default:
 		exit(1);
         }
     }
+    if(bench) {
+        ecBench(ec_k,hostp > ec_k ? hostp-ec_k : 2);
+        exit(0);
+    }
     //if(!debug) {
     //    f = fork();
 	//if(f<0) { printf("Fork error [err=%d]\n",errno); exit(1); }
@@ -896,7 +1036,18 @@ void main(int argc,char **argv)
     sigaction (SIGINT, &new_action, NULL);
 	sigaction (SIGHUP, &new_action, NULL);
 	sigaction (SIGTERM, &new_action, NULL);
+    new_action.sa_handler = stats_handler;
+    new_action.sa_flags = SA_RESTART;
+	sigaction (SIGUSR1, &new_action, NULL);
+	sigaction (SIGUSR2, &new_action, NULL);
+	cacheModeLoad();
+	if( cacheOpen(dev,hosts) == -1) {
+		printf("Error opening cache\n");
+		exit(1);
+	}
 	atexit(doKill);
+	reclaimStart();
+	logStart();
     
     if((listener=getSocket())>0) {
 		doAccept(listener);